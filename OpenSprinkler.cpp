@@ -22,6 +22,8 @@
  */
 #if !defined(ARDUINO)
 #include <netdb.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 #endif
 
 #include "OpenSprinkler.h"
@@ -39,6 +41,9 @@
 
 /** Declare static data members */
 NVConData OpenSprinkler::nvdata;
+GeoLocation OpenSprinkler::geo;
+byte OpenSprinkler::seq_group[MAX_NUM_STATIONS];
+byte OpenSprinkler::seq_group_delay[NUM_SEQ_GROUPS-1];
 ConStatus OpenSprinkler::status;
 ConStatus OpenSprinkler::old_status;
 byte OpenSprinkler::hw_type;
@@ -49,6 +54,16 @@ byte OpenSprinkler::station_bits[MAX_EXT_BOARDS+1];
 #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
 byte OpenSprinkler::engage_booster;
 uint16_t OpenSprinkler::baseline_current;
+uint16_t OpenSprinkler::curr_min;
+uint16_t OpenSprinkler::curr_avg;
+uint16_t OpenSprinkler::curr_max;
+uint16_t OpenSprinkler::curr_signature[MAX_NUM_STATIONS];
+uint16_t OpenSprinkler::curr_samples[CURR_WINDOW_SIZE];
+byte OpenSprinkler::curr_nsamples;
+byte OpenSprinkler::curr_pos;
+byte OpenSprinkler::curr_window_sid = 255;
+byte OpenSprinkler::curr_window_bits[MAX_EXT_BOARDS+1];
+ulong OpenSprinkler::curr_sample_lasttime;
 #endif
 
 ulong OpenSprinkler::sensor_lasttime;
@@ -67,6 +82,9 @@ char tmp_buffer[TMP_BUFFER_SIZE+1];       // scratch buffer
 const char wtopts_filename[] PROGMEM = WEATHER_OPTS_FILENAME;
 const char stns_filename[]   PROGMEM = STATION_ATTR_FILENAME;
 const char ifkey_filename[]  PROGMEM = IFTTT_KEY_FILENAME;
+const char ifqueue_filename[] PROGMEM = IFTTT_QUEUE_FILENAME;
+const char seqgrp_filename[] PROGMEM = SEQ_GROUPS_FILENAME;
+const char snap_filename[]   PROGMEM = SNAPSHOT_FILENAME;
 #ifdef ESP8266
 const char wifi_filename[]   PROGMEM = WIFI_FILENAME;
 byte OpenSprinkler::state = OS_STATE_INITIAL;
@@ -90,174 +108,47 @@ extern char ether_buffer[];
   byte OpenSprinkler::pin_sr_data = PIN_SR_DATA;
 #endif
 
-/** Option json names (stored in progmem) */
-// IMPORTANT: each json name is strictly 5 characters
-// with 0 fillings if less
-#define OP_JSON_NAME_STEPSIZE 5
-const char op_json_names[] PROGMEM =
-    "fwv\0\0"
-    "tz\0\0\0"
-    "ntp\0\0"
-    "dhcp\0"
-    "ip1\0\0"
-    "ip2\0\0"
-    "ip3\0\0"
-    "ip4\0\0"
-    "gw1\0\0"
-    "gw2\0\0"
-    "gw3\0\0"
-    "gw4\0\0"
-    "hp0\0\0"
-    "hp1\0\0"
-    "hwv\0\0"
-    "ext\0\0"
-    "seq\0\0"
-    "sdt\0\0"
-    "mas\0\0"
-    "mton\0"
-    "mtof\0"
-    "urs\0\0"
-    "rso\0\0"
-    "wl\0\0\0"
-    "den\0\0"
-    "ipas\0"
-    "devid"
-    "con\0\0"
-    "lit\0\0"
-    "dim\0\0"
-    "bst\0\0"
-    "uwt\0\0"
-    "ntp1\0"
-    "ntp2\0"
-    "ntp3\0"
-    "ntp4\0"
-    "lg\0\0\0"
-    "mas2\0"
-    "mton2"
-    "mtof2"
-    "fwm\0\0"
-    "fpr0\0"
-    "fpr1\0"
-    "re\0\0\0"
-    "dns1\0"
-    "dns2\0"
-    "dns3\0"
-    "dns4\0"
-    "sar\0\0"
-    "ife\0\0"
-    "reset";
-
-/** Option promopts (stored in progmem, for LCD display) */
-// Each string is strictly 16 characters
-// with SPACE fillings if less
-const char op_prompts[] PROGMEM =
-    "Firmware version"
-    "Time zone (GMT):"
-    "Enable NTP sync?"
-    "Enable DHCP?    "
-    "Static.ip1:     "
-    "Static.ip2:     "
-    "Static.ip3:     "
-    "Static.ip4:     "
-    "Gateway.ip1:    "
-    "Gateway.ip2:    "
-    "Gateway.ip3:    "
-    "Gateway.ip4:    "
-    "HTTP Port:      "
-    "----------------"
-    "Hardware version"
-    "# of exp. board:"
-    "----------------"
-    "Stn. delay (sec)"
-    "Master 1 (Mas1):"
-    "Mas1  on adjust:"
-    "Mas1 off adjust:"
-    "Sensor type:    "
-    "Normally open?  "
-    "Watering level: "
-    "Device enabled? "
-    "Ignore password?"
-    "Device ID:      "
-    "LCD contrast:   "
-    "LCD brightness: "
-    "LCD dimming:    "
-    "DC boost time:  "
-    "Weather algo.:  "
-    "NTP server.ip1: "
-    "NTP server.ip2: "
-    "NTP server.ip3: "
-    "NTP server.ip4: "
-    "Enable logging? "
-    "Master 2 (Mas2):"
-    "Mas2  on adjust:"
-    "Mas2 off adjust:"
-    "Firmware minor: "
-    "Pulse rate:     "
-    "----------------"
-    "As remote ext.? "
-    "DNS server.ip1: "
-    "DNS server.ip2: "
-    "DNS server.ip3: "
-    "DNS server.ip4: "
-    "Special Refresh?"
-    "IFTTT Enable:   "
-    "Factory reset?  ";
-
-/** Option maximum values (stored in progmem) */
-const char op_max[] PROGMEM = {
-  0,
-  108,
-  1,
-  1,
-  255,
-  255,
-  255,
-  255,
-  255,
-  255,
-  255,
-  255,
-  255,
-  255,
-  0,
-  MAX_EXT_BOARDS,
-  1,
-  255,
-  MAX_NUM_STATIONS,
-  255,
-  255,
-  255,
-  1,
-  250,
-  1,
-  1,
-  255,
-  255,
-  255,
-  255,
-  250,
-  255,
-  255,
-  255,
-  255,
-  255,
-  1,
-  MAX_NUM_STATIONS,
-  255,
-  255,
-  0,
-  255,
-  255,
-  1,
-  255,
-  255,
-  255,
-  255,
-  1,
-  255,
-  1
+/** Option registry (stored in progmem), generated from OPTION_REGISTRY */
+#define OPTION_INFO(id, name, max, flags, prompt)  {name, prompt, max, flags},
+const OptionInfo op_registry[] PROGMEM = {
+  OPTION_REGISTRY(OPTION_INFO)
 };
 
+#define OPTION_SIZES(id, name, max, flags, prompt)  sizeof(name)<=6 && sizeof(prompt)==17 &&
+static_assert(OPTION_REGISTRY(OPTION_SIZES) true, "option names take at most 5 characters, prompts exactly 16");
+
+/** Option name hash table (stored in progmem): bucket -> option index (NUM_OPTIONS: empty) */
+#define OPTION_MATCH(id, name, max, flags, prompt)  opt_hash(name)==b ? OPTION_##id :
+constexpr byte opt_bucket(int b) {
+  return OPTION_REGISTRY(OPTION_MATCH) NUM_OPTIONS;
+}
+
+#define OPTION_UNIQUE(id, name, max, flags, prompt)  opt_bucket(opt_hash(name))==OPTION_##id &&
+static_assert(OPTION_REGISTRY(OPTION_UNIQUE) true, "option names collide in the name hash, change OPT_HASH_MUL");
+
+#define OPT_B4(b)   opt_bucket(b), opt_bucket(b+1), opt_bucket(b+2), opt_bucket(b+3)
+#define OPT_B16(b)  OPT_B4(b), OPT_B4(b+4), OPT_B4(b+8), OPT_B4(b+12)
+#define OPT_B64(b)  OPT_B16(b), OPT_B16(b+16), OPT_B16(b+32), OPT_B16(b+48)
+const byte op_hash_table[OPT_HASH_SIZE] PROGMEM = {
+  OPT_B64(0), OPT_B64(64), OPT_B64(128), OPT_B64(192)
+};
+
+/** Option index of a json name (len characters, need not be 0 terminated),
+ * NUM_OPTIONS if there is no such option */
+byte option_lookup(const char *name, int len) {
+  if (len<=0 || len>5) return NUM_OPTIONS;
+  uint16_t h = 0;
+  for (int i=0; i<len; i++)  h = opt_hash_step(h, name[i]);
+  byte oid = pgm_read_byte(op_hash_table+opt_hash_fold(h));
+  if (oid>=NUM_OPTIONS) return NUM_OPTIONS;
+  // the bucket holds the only name with this hash, compare against it
+  PGM_P s = op_name(oid);
+  for (int i=0; i<len; i++) {
+    if (pgm_read_byte(s+i) != name[i]) return NUM_OPTIONS;
+  }
+  return pgm_read_byte(s+len)==0 ? oid : NUM_OPTIONS;
+}
+
 /** Option values (stored in RAM) */
 byte OpenSprinkler::options[] = {
   OS_FW_VERSION, // firmware version
@@ -315,7 +206,9 @@ byte OpenSprinkler::options[] = {
   8,
   0,  // special station auto refresh
   0,  // ifttt enable bits
-  0   // reset
+  0,  // reset
+  0,  // lane flow limit (gal or L per minute). 0: no flow limit
+  0   // lane current limit (in 10 mA). 0: no current limit
 };
 
 /** Weekday strings (stored in progmem, for LCD display) */
@@ -951,7 +844,7 @@ bool OpenSprinkler::programswitch_status(ulong curr_time) {
   }
   return false;
 }
-/** Read current sensing value
+/** Current sensing conversion factor
  * OpenSprinkler 2.3 and above have a 0.2 ohm current sensing resistor.
  * Therefore the conversion from analog reading to milli-amp is:
  * (r/1024)*3.3*1000/0.2 (DC-powered controller)
@@ -961,38 +854,94 @@ bool OpenSprinkler::programswitch_status(ulong curr_time) {
  * it's further discounted by 1/3.3
  */
 #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
-uint16_t OpenSprinkler::read_current() {
-  float scale = 1.0f;
-  if(status.has_curr_sense) {
-    if (hw_type == HW_TYPE_DC) {
-      #if defined(ESP8266)
-      scale = 4.88;
-      #else
-      scale = 16.11;
-      #endif
-    } else {
-      #if defined(ESP8266)
-      scale = 3.45;
-      #else
-      scale = 11.39;
-      #endif     
-    }
-    /* do an average */
-    const byte K = 5;
-    //uint16_t sum = 0;
-    uint16_t min=65535;
-    for(byte i=0;i<K;i++) {
-      //sum += analogRead(PIN_CURR_SENSE);
-      uint16_t r = analogRead(PIN_CURR_SENSE);
-      if(r<min) min=r;
-      delay(2);
-    }
-    //return (uint16_t)((sum/K)*scale);
-    return (uint16_t)(min*scale);
+float OpenSprinkler::current_scale() {
+  if (hw_type == HW_TYPE_DC) {
+    #if defined(ESP8266)
+    return 4.88;
+    #else
+    return 16.11;
+    #endif
   } else {
-    return 0;
+    #if defined(ESP8266)
+    return 3.45;
+    #else
+    return 11.39;
+    #endif
   }
 }
+
+/** Index of the only station that is currently open
+ * Master stations are left out, as they run along with the station.
+ * returns 255 if no station or more than one station is open
+ */
+byte OpenSprinkler::current_station() {
+  byte sid = 255;
+  for(byte bid=0;bid<nboards;bid++) {
+    byte sbits = station_bits[bid];
+    if(status.mas && (status.mas-1)>>3==bid) sbits &= ~(1<<((status.mas-1)&0x07));
+    if(status.mas2 && (status.mas2-1)>>3==bid) sbits &= ~(1<<((status.mas2-1)&0x07));
+    if(!sbits) continue;
+    if(sid!=255 || (sbits&(sbits-1))) return 255;
+    byte s=0;
+    while(!(sbits&1)) { sbits>>=1; s++; }
+    sid = (bid<<3)+s;
+  }
+  return sid;
+}
+
+/** Take one background current sample
+ * Called from the main loop. Each call takes at most one analogRead,
+ * so the web server never waits on the ADC. The rolling window is
+ * restarted whenever the set of open stations changes, so min/mean/max
+ * always describe the stations that are currently on. When exactly
+ * one station is open (apart from the masters), every full window is
+ * folded into that station's current signature (moving average), which
+ * makes shorted (too high) or open (near baseline) solenoids easy to spot.
+ */
+void OpenSprinkler::sample_current() {
+  if(!status.has_curr_sense) return;
+  ulong curr_ms = millis();
+  if(curr_ms - curr_sample_lasttime < CURR_SAMPLE_INTERVAL) return;
+  curr_sample_lasttime = curr_ms;
+
+  if(memcmp(curr_window_bits, station_bits, sizeof(curr_window_bits))) {
+    memcpy(curr_window_bits, station_bits, sizeof(curr_window_bits));
+    curr_window_sid = current_station();
+    curr_nsamples = 0;
+    curr_pos = 0;
+  }
+  byte sid = curr_window_sid;
+  curr_samples[curr_pos] = analogRead(PIN_CURR_SENSE);
+  curr_pos = (curr_pos+1) % CURR_WINDOW_SIZE;
+  if(curr_nsamples < CURR_WINDOW_SIZE) curr_nsamples++;
+
+  uint16_t rmin=65535, rmax=0;
+  ulong sum=0;
+  for(byte i=0;i<curr_nsamples;i++) {
+    uint16_t r = curr_samples[i];
+    if(r<rmin) rmin=r;
+    if(r>rmax) rmax=r;
+    sum+=r;
+  }
+  float scale = current_scale();
+  curr_min = (uint16_t)(rmin*scale);
+  curr_max = (uint16_t)(rmax*scale);
+  curr_avg = (uint16_t)((sum/curr_nsamples)*scale);
+
+  // a full window with a single open station updates its signature
+  if(sid<MAX_NUM_STATIONS && curr_nsamples==CURR_WINDOW_SIZE && curr_pos==0) {
+    uint16_t sig = curr_signature[sid];
+    curr_signature[sid] = sig ? (uint16_t)(((ulong)sig*7+curr_avg)>>3) : curr_avg;
+  }
+}
+
+/** Read current sensing value
+ * Returns the minimum of the rolling sample window (filters out spikes),
+ * which is kept up to date by sample_current in the background.
+ */
+uint16_t OpenSprinkler::read_current() {
+  return status.has_curr_sense ? curr_min : 0;
+}
 #endif
 
 /** Read the number of 8-station expansion boards */
@@ -1074,6 +1023,158 @@ uint16_t OpenSprinkler::parse_rfstation_code(RFStationData *data, ulong* on, ulo
   return v;
 }
 
+/* ====== Config file cache ======
+ * stns.dat, wtopts.txt and ifkey.txt are read on hot paths (every special
+ * station toggle and auto-refresh tick, every /jc, every weather call and
+ * notification), so they are kept in RAM: special station records parsed,
+ * the others as strings. An entry is loaded on first use and reloaded
+ * after the write paths in server.cpp (or, on Linux, an external edit)
+ * invalidate it.
+ * AVR has no RAM for the full cache: only the type of each station is
+ * kept, plus the last special station decoded, and wtopts.txt is read
+ * into tmp_buffer on every use. */
+#if defined(ARDUINO) && !defined(ESP8266)
+static byte special_type[MAX_NUM_STATIONS];
+static SpecialStation special_last;
+static byte special_last_sid = 0xFF;
+static const SpecialStation special_standard = {STN_TYPE_STANDARD};
+#else
+static SpecialStation special_cache[MAX_NUM_STATIONS];
+static char wtopts_cache[TMP_BUFFER_SIZE+1];
+#endif
+#if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+static char ifkey_cache[IFTTT_KEY_MAXSIZE+1];
+#endif
+static byte file_cache_valid = 0;
+
+/** Split http station data "server,port,on_cmd,off_cmd" in place */
+static bool http_split(char *data) {
+  byte n = 1;
+  for (char *c=data; *c; c++) {
+    if (*c==',') { *c = 0; n++; }
+  }
+  return n>=4;
+}
+
+void OpenSprinkler::file_cache_invalidate(byte which) {
+  if (which & FILE_CACHE_STNS) {
+#if defined(ARDUINO) && !defined(ESP8266)
+    memset(special_type, SPECIAL_UNCACHED, MAX_NUM_STATIONS);
+    special_last_sid = 0xFF;
+#else
+    for (byte sid=0; sid<MAX_NUM_STATIONS; sid++) {
+      if (special_cache[sid].type==STN_TYPE_HTTP) free(special_cache[sid].http);
+      special_cache[sid].type = SPECIAL_UNCACHED;
+    }
+#endif
+  }
+  file_cache_valid &= ~which;
+}
+
+/** Decode the special data of a station from stns.dat */
+void OpenSprinkler::special_load(byte sid, SpecialStation *c) {
+  c->type = STN_TYPE_STANDARD;
+  if (!(station_attrib_bits_read(ADDR_NVM_STNSPE+(sid>>3))&(1<<(sid&0x07)))) return;
+
+  int stepsize=sizeof(StationSpecialData);
+  read_from_file(stns_filename, tmp_buffer, stepsize, sid*stepsize);
+  StationSpecialData *stn = (StationSpecialData *)tmp_buffer;
+  switch (stn->type) {
+  case STN_TYPE_RF:
+    c->rf.timing = parse_rfstation_code((RFStationData *)stn->data, &c->rf.on, &c->rf.off);
+    if (!c->rf.timing) return;  // invalid code: nothing to send
+    break;
+  case STN_TYPE_REMOTE: {
+    RemoteStationData *d = (RemoteStationData *)stn->data;
+    c->remote.ip = hex2ulong(d->ip, sizeof(d->ip));
+    c->remote.port = hex2ulong(d->port, sizeof(d->port));
+    c->remote.sid = hex2ulong(d->sid, sizeof(d->sid));
+    } break;
+  case STN_TYPE_GPIO: {
+    GPIOStationData *d = (GPIOStationData *)stn->data;
+    c->gpio.pin = (d->pin[0]-'0')*10 + (d->pin[1]-'0');
+    c->gpio.active = d->active-'0';
+    } break;
+  case STN_TYPE_HTTP:
+#if !defined(ARDUINO) || defined(ESP8266)
+    stn->data[sizeof(HTTPStationData)-1] = 0;
+    if (!http_split((char *)stn->data)) return;
+    c->http = (char *)malloc(sizeof(HTTPStationData));
+    if (!c->http) return;
+    memcpy(c->http, stn->data, sizeof(HTTPStationData));
+#endif
+    // AVR has no RAM to spare for http data: it is read at switch time
+    break;
+  default:
+    return;
+  }
+  c->type = stn->type;
+}
+
+const SpecialStation* OpenSprinkler::get_special(byte sid) {
+#if defined(ARDUINO) && !defined(ESP8266)
+  if (special_type[sid]==STN_TYPE_STANDARD) return &special_standard;
+  if (special_last_sid != sid) {
+    special_load(sid, &special_last);
+    special_last_sid = sid;
+    special_type[sid] = special_last.type;
+  }
+  return &special_last;
+#else
+  SpecialStation *c = special_cache+sid;
+  if (c->type == SPECIAL_UNCACHED) special_load(sid, c);
+  return c;
+#endif
+}
+
+const char* OpenSprinkler::get_wtopts() {
+#if defined(ARDUINO) && !defined(ESP8266)
+  read_from_file(wtopts_filename, tmp_buffer, TMP_BUFFER_SIZE);
+  return tmp_buffer;
+#else
+  if (!(file_cache_valid & FILE_CACHE_WTOPTS)) {
+    read_from_file(wtopts_filename, wtopts_cache, TMP_BUFFER_SIZE);
+    file_cache_valid |= FILE_CACHE_WTOPTS;
+  }
+  return wtopts_cache;
+#endif
+}
+
+#if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+char* OpenSprinkler::get_ifkey() {
+  if (!(file_cache_valid & FILE_CACHE_IFKEY)) {
+    read_from_file(ifkey_filename, ifkey_cache, IFTTT_KEY_MAXSIZE);
+    ifkey_cache[IFTTT_KEY_MAXSIZE-1] = 0;
+    file_cache_valid |= FILE_CACHE_IFKEY;
+  }
+  return ifkey_cache;
+}
+#endif
+
+#if !defined(ARDUINO)
+/** Invalidate cached files that were changed outside the firmware */
+void OpenSprinkler::file_cache_watch() {
+  static int fd = -1;
+  if (fd < 0) {
+    fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0) return;
+    inotify_add_watch(fd, get_runtime_path(), IN_CLOSE_WRITE|IN_MOVED_TO|IN_DELETE);
+    return;
+  }
+  char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *q=buf; q<buf+len; q+=sizeof(struct inotify_event)+((struct inotify_event *)q)->len) {
+      struct inotify_event *e = (struct inotify_event *)q;
+      if (!e->len) continue;
+      if (!strcmp(e->name, STATION_ATTR_FILENAME))      file_cache_invalidate(FILE_CACHE_STNS);
+      else if (!strcmp(e->name, WEATHER_OPTS_FILENAME)) file_cache_invalidate(FILE_CACHE_WTOPTS);
+      else if (!strcmp(e->name, IFTTT_KEY_FILENAME))    file_cache_invalidate(FILE_CACHE_IFKEY);
+    }
+  }
+}
+#endif
+
 /** Get station name from NVM */
 void OpenSprinkler::get_station_name(byte sid, char tmp[]) {
   tmp[STATION_NAME_SIZE]=0;
@@ -1138,31 +1239,32 @@ byte OpenSprinkler::weekday_today() {
 
 /** Switch special station */
 void OpenSprinkler::switch_special_station(byte sid, byte value) {
-  // check station special bit
-  if(station_attrib_bits_read(ADDR_NVM_STNSPE+(sid>>3))&(1<<(sid&0x07))) {
-    // read station special data from sd card
+  const SpecialStation *stn = get_special(sid);
+  // check station type
+  if(stn->type==STN_TYPE_RF) {
+    // transmit RF signal
+    switch_rfstation(sid, stn, value);
+  } else if(stn->type==STN_TYPE_REMOTE) {
+    // request remote station
+    switch_remotestation(stn, value);
+  }
+#if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+  // GPIO and HTTP stations are only available for OS23 or OSPi
+  else if(stn->type==STN_TYPE_GPIO) {
+    // set GPIO pin
+    switch_gpiostation(stn, value);
+  } else if(stn->type==STN_TYPE_HTTP) {
+    // send GET command
+  #if defined(ARDUINO) && !defined(ESP8266)
     int stepsize=sizeof(StationSpecialData);
     read_from_file(stns_filename, tmp_buffer, stepsize, sid*stepsize);
-    StationSpecialData *stn = (StationSpecialData *)tmp_buffer;
-    // check station type
-    if(stn->type==STN_TYPE_RF) {
-      // transmit RF signal
-      switch_rfstation((RFStationData *)stn->data, value);
-    } else if(stn->type==STN_TYPE_REMOTE) {
-      // request remote station
-      switch_remotestation((RemoteStationData *)stn->data, value);
-    }
-#if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
-    // GPIO and HTTP stations are only available for OS23 or OSPi
-    else if(stn->type==STN_TYPE_GPIO) {
-      // set GPIO pin
-      switch_gpiostation((GPIOStationData *)stn->data, value);
-    } else if(stn->type==STN_TYPE_HTTP) {
-      // send GET command
-      switch_httpstation((HTTPStationData *)stn->data, value);
-    }
-#endif    
+    tmp_buffer[stepsize-1] = 0;
+    if(http_split(tmp_buffer+1)) switch_httpstation(tmp_buffer+1, value);
+  #else
+    switch_httpstation(stn->http, value);
+  #endif
   }
+#endif
 }
 
 /** Set station bit
@@ -1202,24 +1304,164 @@ void OpenSprinkler::clear_all_station_bits() {
   }
 }
 
-#if !defined(ARDUINO)
+// ==================
+// RF Transmit Queue
+// ==================
+/* RF codes are sent from a small queue in the background, so switching
+ * an RF station no longer stalls the main loop for the whole transmission
+ * (15 repeats of 24 bits plus sync). The code is parsed once per switch,
+ * not per repeat. On AVR and ESP8266 a hardware timer interrupt walks
+ * through the bit phases; on Linux a dedicated thread sends the frames.
+ * A frame that has not started yet is merged with a newer frame for the
+ * same station, so back-to-back switches cost a single transmission.
+ */
+#define RF_QUEUE_SIZE  4
+#define RF_REPEATS     15
+
+struct RFFrame {
+  ulong code;     // 24-bit code
+  uint16_t len;   // pulse length (in us)
+  byte sid;       // station index
+};
+
+static RFFrame rf_queue[RF_QUEUE_SIZE];
+static volatile byte rf_head = 0;   // next free slot, written by the main loop
+static volatile byte rf_tail = 0;   // frame being sent, written by the sender
+
+#if defined(ARDUINO)
+
+#ifdef ESP8266
+  #define RF_USE_TIMER
+#elif defined(TCCR5A) // ATmega2560: timers 1 and 3 drive PWM pins in use
+  #define RF_USE_TIMER
+  #define RF_TCCRA  TCCR5A
+  #define RF_TCCRB  TCCR5B
+  #define RF_TCNT   TCNT5
+  #define RF_OCRA   OCR5A
+  #define RF_TIMSK  TIMSK5
+  #define RF_OCIE   OCIE5A
+  #define RF_WGM    WGM52
+  #define RF_CS     CS51
+  #define RF_TIMER_vect TIMER5_COMPA_vect
+#elif defined(TCCR3A) // ATmega1284: timer 1 drives the LCD backlight / contrast
+  #define RF_USE_TIMER
+  #define RF_TCCRA  TCCR3A
+  #define RF_TCCRB  TCCR3B
+  #define RF_TCNT   TCNT3
+  #define RF_OCRA   OCR3A
+  #define RF_TIMSK  TIMSK3
+  #define RF_OCIE   OCIE3A
+  #define RF_WGM    WGM32
+  #define RF_CS     CS31
+  #define RF_TIMER_vect TIMER3_COMPA_vect
+#endif
+
+#define RF_LOCK()   noInterrupts()
+#define RF_UNLOCK() interrupts()
+
+#else
+
+#include <pthread.h>
+static pthread_mutex_t rf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rf_cond = PTHREAD_COND_INITIALIZER;
+#define RF_LOCK()   pthread_mutex_lock(&rf_mutex)
+#define RF_UNLOCK() pthread_mutex_unlock(&rf_mutex)
 int rf_gpio_fd = -1;
+
 #endif
 
-/** Transmit one RF signal bit */
-void transmit_rfbit(ulong lenH, ulong lenL) {
-#if defined(ARDUINO)
+#if defined(RF_USE_TIMER)
+static volatile byte rf_active = 0;       // timer is running
+static volatile signed char rf_bit = 23;  // bit being sent, -1 is the sync bit
+static volatile byte rf_phase = 0;        // 0: high phase, 1: low phase
+static volatile byte rf_repeat = 0;       // number of completed repeats
+
+/** Timer interrupt: output the next phase of the current frame */
+#ifdef ESP8266
+ICACHE_RAM_ATTR
+#endif
+static void rf_tick() {
+  if(rf_tail == rf_head) {  // queue is empty, stop the timer
+  #ifdef ESP8266
+    timer1_disable();
+  #else
+    RF_TIMSK &= ~(1<<RF_OCIE);
+    RF_TCCRB = 0;
+  #endif
+    rf_active = 0;
+    return;
+  }
+  RFFrame *f = rf_queue+rf_tail;
+  ulong len = f->len;
+  byte one = (rf_bit>=0) && ((f->code>>rf_bit)&1);
+  ulong dur;
+  if(!rf_phase) {
   #ifdef ESP8266
     digitalWrite(PIN_RFTX, 1);
-    delayMicroseconds(lenH);
-    digitalWrite(PIN_RFTX, 0);
-    delayMicroseconds(lenL);
   #else
     PORT_RF |= (1<<PINX_RF);
-    delayMicroseconds(lenH);
+  #endif
+    dur = (rf_bit<0) ? len : (one ? len*3 : len);
+    rf_phase = 1;
+  } else {
+  #ifdef ESP8266
+    digitalWrite(PIN_RFTX, 0);
+  #else
     PORT_RF &=~(1<<PINX_RF);
-    delayMicroseconds(lenL);
   #endif
+    dur = (rf_bit<0) ? len*31 : (one ? len : len*3);
+    rf_phase = 0;
+    if(--rf_bit < -1) {   // frame done
+      rf_bit = 23;
+      if(++rf_repeat >= RF_REPEATS) {
+        rf_repeat = 0;
+        rf_tail = (rf_tail+1) % RF_QUEUE_SIZE;
+      }
+    }
+  }
+#ifdef ESP8266
+  timer1_write(dur*5);  // 80MHz / 16
+#else
+  dur <<= 1;            // 16MHz / 8
+  RF_OCRA = (dur>65535) ? 65535 : (dur-1);
+#endif
+}
+
+#ifndef ESP8266
+ISR(RF_TIMER_vect) {
+  rf_tick();
+}
+#endif
+
+/** Start the timer if it is idle (called with interrupts disabled) */
+static void rf_start() {
+  if(rf_active) return;
+  rf_active = 1;
+  rf_bit = 23;
+  rf_phase = 0;
+  rf_repeat = 0;
+#ifdef ESP8266
+  timer1_attachInterrupt(rf_tick);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_SINGLE);
+  timer1_write(500);
+#else
+  RF_TCCRA = 0;
+  RF_TCNT = 0;
+  RF_OCRA = 200;
+  RF_TCCRB = (1<<RF_WGM)|(1<<RF_CS);  // CTC mode, prescaler 8
+  RF_TIMSK |= (1<<RF_OCIE);
+#endif
+}
+
+#else
+
+/** Transmit one RF signal bit */
+void transmit_rfbit(ulong lenH, ulong lenL) {
+#if defined(ARDUINO)
+  PORT_RF |= (1<<PINX_RF);
+  delayMicroseconds(lenH);
+  PORT_RF &=~(1<<PINX_RF);
+  delayMicroseconds(lenL);
 #else
   gpio_write(rf_gpio_fd, 1);
   delayMicrosecondsHard(lenH);
@@ -1232,7 +1474,7 @@ void transmit_rfbit(ulong lenH, ulong lenL) {
 void send_rfsignal(ulong code, ulong len) {
   ulong len3 = len * 3;
   ulong len31 = len * 31;
-  for(byte n=0;n<15;n++) {
+  for(byte n=0;n<RF_REPEATS;n++) {
     int i=23;
     // send code
     while(i>=0) {
@@ -1248,24 +1490,81 @@ void send_rfsignal(ulong code, ulong len) {
   }
 }
 
+#if !defined(ARDUINO)
+/** RF sender thread: sends queued frames one at a time */
+static void *rf_thread(void *arg) {
+  for(;;) {
+    RF_LOCK();
+    while(rf_tail == rf_head)
+      pthread_cond_wait(&rf_cond, &rf_mutex);
+    RFFrame f = rf_queue[rf_tail];
+    rf_tail = (rf_tail+1) % RF_QUEUE_SIZE;
+    RF_UNLOCK();
+    // pre-open gpio file to minimize overhead
+    rf_gpio_fd = gpio_fd_open(PIN_RFTX);
+    send_rfsignal(f.code, f.len);
+    gpio_fd_close(rf_gpio_fd);
+    rf_gpio_fd = -1;
+  }
+  return NULL;
+}
+#endif
+
+#endif  // RF_USE_TIMER
+
+/** Queue an RF frame for transmission */
+static void rf_enqueue(byte sid, ulong code, uint16_t len) {
+#if defined(ARDUINO) && !defined(RF_USE_TIMER)
+  // no spare timer: send right away
+  send_rfsignal(code, len);
+#else
+  RF_LOCK();
+  // merge with a frame for the same station that has not started yet
+  byte i = rf_tail;
+  #if defined(RF_USE_TIMER)
+  if(rf_active && i!=rf_head) i = (i+1) % RF_QUEUE_SIZE;  // head-of-line frame is on air
+  #endif
+  for(;i!=rf_head;i=(i+1)%RF_QUEUE_SIZE) {
+    if(rf_queue[i].sid == sid) {
+      rf_queue[i].code = code;
+      rf_queue[i].len = len;
+      RF_UNLOCK();
+      return;
+    }
+  }
+  // wait for a free slot (only if more stations switch than the queue holds)
+  while((rf_head+1)%RF_QUEUE_SIZE == rf_tail) {
+    RF_UNLOCK();
+    delay(1);
+    RF_LOCK();
+  }
+  RFFrame *f = rf_queue+rf_head;
+  f->code = code;
+  f->len = len;
+  f->sid = sid;
+  rf_head = (rf_head+1) % RF_QUEUE_SIZE;
+  #if defined(RF_USE_TIMER)
+  rf_start();
+  #else
+  static bool thread_started = false;
+  if(!thread_started) {
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, rf_thread, NULL);
+    thread_started = true;
+  }
+  pthread_cond_signal(&rf_cond);
+  #endif
+  RF_UNLOCK();
+#endif
+}
+
 /** Switch RF station
  * This function takes a RF code,
  * parses it into signals and timing,
- * and sends it out through RF transmitter.
+ * and queues it for the RF transmitter.
  */
-void OpenSprinkler::switch_rfstation(RFStationData *data, bool turnon) {
-  ulong on, off;
-  uint16_t length = parse_rfstation_code(data, &on, &off);
-#if defined(ARDUINO)
-  send_rfsignal(turnon ? on : off, length);
-#else
-  // pre-open gpio file to minimize overhead
-  rf_gpio_fd = gpio_fd_open(PIN_RFTX);
-  send_rfsignal(turnon ? on : off, length);
-  gpio_fd_close(rf_gpio_fd);
-  rf_gpio_fd = -1;
-#endif
-
+void OpenSprinkler::switch_rfstation(byte sid, const SpecialStation *stn, bool turnon) {
+  rf_enqueue(sid, turnon ? stn->rf.on : stn->rf.off, stn->rf.timing);
 }
 
 /** Switch GPIO station
@@ -1273,9 +1572,9 @@ void OpenSprinkler::switch_rfstation(RFStationData *data, bool turnon) {
  * First two bytes are zero padded GPIO pin number.
  * Third byte is either 0 or 1 for active low (GND) or high (+5V) relays
  */
-void OpenSprinkler::switch_gpiostation(GPIOStationData *data, bool turnon) {
-  byte gpio = (data->pin[0] - '0') * 10 + (data->pin[1] - '0');
-  byte activeState = data->active - '0';
+void OpenSprinkler::switch_gpiostation(const SpecialStation *stn, bool turnon) {
+  byte gpio = stn->gpio.pin;
+  byte activeState = stn->gpio.active;
 
   pinMode(gpio, OUTPUT);
   if (turnon)
@@ -1302,11 +1601,11 @@ void httpget_callback(byte status, uint16_t off, uint16_t len) {
  * The remote controller is assumed to have the same
  * password as the main controller
  */
-void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
+void OpenSprinkler::switch_remotestation(const SpecialStation *stn, bool turnon) {
 #if defined(ARDUINO)
 
-  ulong ip = hex2ulong(data->ip, sizeof(data->ip));
-  ulong port = hex2ulong(data->port, sizeof(data->port));
+  ulong ip = stn->remote.ip;
+  ulong port = stn->remote.port;
 
   #ifdef ESP8266
   // todo tmp buffer
@@ -1318,7 +1617,7 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
   uint16_t timer = options[OPTION_SPE_AUTO_REFRESH]?2*MAX_NUM_STATIONS:64800;  
   bf.emit_p(PSTR("GET /cm?pw=$E&sid=$D&en=$D&t=$D"),
             ADDR_NVM_PASSWORD,
-            (int)hex2ulong(data->sid, sizeof(data->sid)),
+            (int)stn->remote.sid,
             turnon, timer);
   bf.emit_p(PSTR(" HTTP/1.0\r\nHOST: *\r\n\r\n"));
   
@@ -1360,7 +1659,7 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
   uint16_t timer = options[OPTION_SPE_AUTO_REFRESH]?2*MAX_NUM_STATIONS:64800;
   bf.emit_p(PSTR("?pw=$E&sid=$D&en=$D&t=$D"),
             ADDR_NVM_PASSWORD,
-            (int)hex2ulong(data->sid,sizeof(data->sid)),
+            (int)stn->remote.sid,
             turnon, timer);
   ether.browseUrl(PSTR("/cm"), p, PSTR("*"), httpget_callback);
   for(int l=0;l<100;l++)  ether.packetLoop(ether.packetReceive());
@@ -1372,12 +1671,12 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
 
   uint8_t hisip[4];
   uint16_t hisport;
-  ulong ip = hex2ulong(data->ip, sizeof(data->ip));
+  ulong ip = stn->remote.ip;
   hisip[0] = ip>>24;
   hisip[1] = (ip>>16)&0xff;
   hisip[2] = (ip>>8)&0xff;
   hisip[3] = ip&0xff;
-  hisport = hex2ulong(data->port, sizeof(data->port));
+  hisport = stn->remote.port;
 
   if (!client.connect(hisip, hisport)) {
     client.stop();
@@ -1390,7 +1689,7 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
   uint16_t timer = options[OPTION_SPE_AUTO_REFRESH]?2*MAX_NUM_STATIONS:64800;  
   bf.emit_p(PSTR("GET /cm?pw=$E&sid=$D&en=$D&t=$D"),
             ADDR_NVM_PASSWORD,
-            (int)hex2ulong(data->sid, sizeof(data->sid)),
+            (int)stn->remote.sid,
             turnon, timer);
   bf.emit_p(PSTR(" HTTP/1.0\r\nHOST: *\r\n\r\n"));
 
@@ -1417,15 +1716,12 @@ void OpenSprinkler::switch_remotestation(RemoteStationData *data, bool turnon) {
  * This function takes an http station code,
  * parses it into a server name and two HTTP GET requests.
  */
-void OpenSprinkler::switch_httpstation(HTTPStationData *data, bool turnon) {
-
-  static HTTPStationData copy;
-  // make a copy of the HTTP station data and work with it
-  memcpy((char*)&copy, (char*)data, sizeof(HTTPStationData));
-  char * server = strtok((char *)copy.data, ",");
-  char * port = strtok(NULL, ",");
-  char * on_cmd = strtok(NULL, ",");
-  char * off_cmd = strtok(NULL, ",");
+void OpenSprinkler::switch_httpstation(char *data, bool turnon) {
+
+  char * server = data;
+  char * port = server+strlen(server)+1;
+  char * on_cmd = port+strlen(port)+1;
+  char * off_cmd = on_cmd+strlen(on_cmd)+1;
   char * cmd = turnon ? on_cmd : off_cmd;
 
 #if defined(ARDUINO)
@@ -1586,6 +1882,9 @@ void OpenSprinkler::options_setup() {
     // 5. delete sd file
     remove_file(wtopts_filename);
     remove_file(ifkey_filename);
+    remove_file(ifqueue_filename);
+    remove_file(seqgrp_filename);
+    remove_file(snap_filename);
 #endif
 
     // 6. write options
@@ -1607,6 +1906,15 @@ void OpenSprinkler::options_setup() {
 
     // load non-volatile controller data
     nvdata_load();
+
+    // load latitude/longitude
+    geo_load();
+
+    // load sequential groups
+    seq_groups_load();
+
+    // cached config files are loaded on first use
+    file_cache_invalidate(FILE_CACHE_ALL);
   }
 
 #if defined(ARDUINO)  // handle AVR buttons
@@ -1681,6 +1989,64 @@ void OpenSprinkler::nvdata_save() {
   nvm_write_block(&nvdata, (void*)ADDR_NVM_NVCONDATA, sizeof(NVConData));
 }
 
+static_assert(sizeof(GeoLocation) <= NVM_GEOLOC_SIZE && ADDR_NVM_GEOLOC+NVM_GEOLOC_SIZE <= NVM_SIZE,
+              "geolocation block does not fit in nvm");
+static_assert(NUM_OPTIONS <= MAX_NVM_OPTIONS, "options run into the geolocation block");
+
+/** Load latitude/longitude from internal NVM */
+void OpenSprinkler::geo_load() {
+  nvm_read_block(&geo, (void*)ADDR_NVM_GEOLOC, sizeof(GeoLocation));
+}
+
+/** Save latitude/longitude to internal NVM */
+void OpenSprinkler::geo_save() {
+  nvm_write_block(&geo, (void*)ADDR_NVM_GEOLOC, sizeof(GeoLocation));
+}
+
+/** Load sequential groups from file
+ * The file is a single line: one digit per station (its group),
+ * followed by three digits per group (from group 1 on) for the
+ * encoded station delay. Group 0 uses OPTION_STATION_DELAY_TIME.
+ * A missing file puts every station in group 0. */
+void OpenSprinkler::seq_groups_load() {
+  byte i;
+  memset(seq_group, 0, MAX_NUM_STATIONS);
+  memset(seq_group_delay, 120, NUM_SEQ_GROUPS-1);  // 120 encodes 0 seconds
+  read_from_file(seqgrp_filename, tmp_buffer, MAX_NUM_STATIONS+3*(NUM_SEQ_GROUPS-1)+1);
+  if (strlen(tmp_buffer) < MAX_NUM_STATIONS+3*(NUM_SEQ_GROUPS-1)) return;
+  for(i=0;i<MAX_NUM_STATIONS;i++) {
+    byte g = tmp_buffer[i]-'0';
+    seq_group[i] = (g<NUM_SEQ_GROUPS) ? g : 0;
+  }
+  char *p = tmp_buffer+MAX_NUM_STATIONS;
+  for(i=0;i<NUM_SEQ_GROUPS-1;i++,p+=3) {
+    byte v = (p[0]-'0')*100+(p[1]-'0')*10+(p[2]-'0');
+    seq_group_delay[i] = (v>240) ? 120 : v;
+  }
+}
+
+/** Save sequential groups to file */
+void OpenSprinkler::seq_groups_save() {
+  byte i;
+  for(i=0;i<MAX_NUM_STATIONS;i++) {
+    tmp_buffer[i] = '0'+seq_group[i];
+  }
+  char *p = tmp_buffer+MAX_NUM_STATIONS;
+  for(i=0;i<NUM_SEQ_GROUPS-1;i++,p+=3) {
+    byte v = seq_group_delay[i];
+    p[0] = '0'+v/100;
+    p[1] = '0'+(v/10)%10;
+    p[2] = '0'+v%10;
+  }
+  *p = 0;
+  write_to_file(seqgrp_filename, tmp_buffer, p-tmp_buffer);
+}
+
+/** Station delay (in seconds) of a sequential group */
+int16_t OpenSprinkler::seq_group_delay_time(byte grp) {
+  return water_time_decode_signed(grp ? seq_group_delay[grp-1] : options[OPTION_STATION_DELAY_TIME]);
+}
+
 /** Load options from internal NVM */
 void OpenSprinkler::options_load() {
   nvm_read_block(tmp_buffer, (void*)ADDR_NVM_OPTIONS, NUM_OPTIONS);
@@ -1916,7 +2282,7 @@ void OpenSprinkler::lcd_print_version(byte v) {
 /** print an option value */
 void OpenSprinkler::lcd_print_option(int i) {
   // each prompt string takes 16 characters
-  strncpy_P0(tmp_buffer, op_prompts+16*i, 16);
+  strncpy_P0(tmp_buffer, op_prompt(i), 16);
   lcd.setCursor(0, 0);
   lcd.print(tmp_buffer);
   lcd_print_line_clear_pgm(PSTR(""), 1);
@@ -1985,7 +2351,7 @@ void OpenSprinkler::lcd_print_option(int i) {
     break;
   default:
     // if this is a boolean option
-    if (pgm_read_byte(op_max+i)==1)
+    if (op_max(i)==1)
       lcd_print_pgm(options[i] ? PSTR("Yes") : PSTR("No"));
     else
       lcd.print((int)options[i]);
@@ -2071,7 +2437,7 @@ void OpenSprinkler::ui_set_options(int oid)
       if (i==OPTION_FW_VERSION || i==OPTION_HW_VERSION || i==OPTION_FW_MINOR ||
           i==OPTION_HTTPPORT_0 || i==OPTION_HTTPPORT_1 ||
           i==OPTION_PULSE_RATE_0 || i==OPTION_PULSE_RATE_1) break; // ignore non-editable options
-      if (pgm_read_byte(op_max+i) != options[i]) options[i] ++;
+      if (op_max(i) != options[i]) options[i] ++;
       break;
 
     case BUTTON_2:
@@ -2103,6 +2469,9 @@ void OpenSprinkler::ui_set_options(int oid)
         else  {
           i = (i+1) % NUM_OPTIONS;
         }
+        #if !defined(__AVR_ATmega1284P__) && !defined(__AVR_ATmega1284__) && !defined(ESP8266)
+        if(i==OPTION_LANE_CURR_LIMIT) i = (i+1) % NUM_OPTIONS;  // no current sensing on this board
+        #endif
         if(i==OPTION_SEQUENTIAL_RETIRED) i++;
         #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
         else if (hw_type==HW_TYPE_AC && i==OPTION_BOOST_TIME) i++;  // skip boost time for non-DC controller
@@ -2181,7 +2550,7 @@ void OpenSprinkler::toggle_screen_led() {
 void OpenSprinkler::set_screen_led(byte status) {
   lcd.setColor(status ? WHITE : BLACK);
   lcd.fillCircle(122, 58, 4);
-  lcd.display();
+  lcd.flush();
   lcd.setColor(WHITE);
 }
 
@@ -60,6 +60,21 @@ struct NVConData {
     uint32_t external_ip;   // external ip
 };
 
+/** Network health probe target (rolling loss/latency window) */
+struct NetTarget {
+    byte ip[4];       // 0.0.0.0 if unused
+    uint16_t lost;    // results of the last probes, bit 0 most recent (1: lost)
+    byte n;           // number of probes in the window
+    uint16_t rtt;     // smoothed round trip time (in ms)
+};
+
+/** Controller latitude/longitude (stored at ADDR_NVM_GEOLOC, the top of nvm) */
+struct GeoLocation {
+    int16_t lat;  // latitude (in 1/100 degree, north positive)
+    int16_t lon;  // longitude (in 1/100 degree, east positive)
+    byte tag;     // GEOLOC_TAG if set
+};
+
 /** Station special attribute data */
 struct StationSpecialData {
     byte type;
@@ -88,6 +103,26 @@ struct HTTPStationData {
     byte data[STATION_SPECIAL_DATA_SIZE];
 };
 
+/** Station special data parsed from stns.dat (cached in RAM) */
+struct SpecialStation {
+    byte type;    // STN_TYPE_xxx, or SPECIAL_UNCACHED
+    union {
+        struct { ulong on, off; uint16_t timing; } rf;
+        struct { ulong ip; uint16_t port; byte sid; } remote;
+        struct { byte pin, active; } gpio;
+#if !defined(ARDUINO) || defined(ESP8266)
+        char *http;   // "server\0port\0on_cmd\0off_cmd", allocated
+#endif
+    };
+};
+#define SPECIAL_UNCACHED    0xFE
+
+// RAM copies of small config files
+#define FILE_CACHE_STNS     0x01  // stns.dat (and the station special bits)
+#define FILE_CACHE_WTOPTS   0x02  // wtopts.txt
+#define FILE_CACHE_IFKEY    0x04  // ifkey.txt
+#define FILE_CACHE_ALL      0x07
+
 /** Volatile controller status bits */
 struct ConStatus {
     byte enabled : 1;           // operation enable (when set, controller operation is enabled)
@@ -106,11 +141,68 @@ struct ConStatus {
     byte mas2 : 8;              // master2 station index
 };
 
+/** Per-station flow statistics */
+struct FlowStationStats {
+    ulong pulses;           // flow pulses attributed to the station's current (or last) run
+    uint16_t rate_pph;      // last measured flow rate (in pulses per hour)
+    uint16_t jitter_ms;     // pulse interval jitter during the last measurement (in ms)
+    uint16_t baseline_pph;  // smoothed flow rate baseline (in pulses per hour)
+};
+
+/** Daily log rollup, kept up to date by write_log and stored as logs/xxxxx.sum */
+struct DayRollup {
+    uint16_t day;           // day in epoch time (0: none loaded)
+    byte wl;                // last water level of the day (in %)
+    uint16_t alerts;        // number of flow alerts
+    ulong rd_secs;          // rain delay time ended during the day (in seconds)
+    ulong rs_secs;          // rain sensed time ended during the day (in seconds)
+    ulong flow;             // flow pulses counted by flow sense records
+    ulong run_secs[MAX_NUM_STATIONS]; // total station run time (in seconds)
+    uint16_t runs[MAX_NUM_STATIONS];  // number of station runs
+};
+
 extern const char wtopts_filename[];
 extern const char stns_filename[];
 extern const char ifkey_filename[];
-extern const char op_max[];
-extern const char op_json_names[];
+extern const char ifqueue_filename[];
+extern const char seqgrp_filename[];
+extern const char snap_filename[];
+
+/** Option registry entry (see OPTION_REGISTRY in defines.h) */
+struct OptionInfo {
+    char name[6];           // json name
+    char prompt[17];        // LCD prompt
+    byte max;               // maximum value (1: boolean option)
+    byte flags;             // OPT_xxx flags
+};
+
+extern const OptionInfo op_registry[];
+inline PGM_P op_name(byte oid)   { return op_registry[oid].name; }
+inline PGM_P op_prompt(byte oid) { return op_registry[oid].prompt; }
+inline byte op_max(byte oid)     { return pgm_read_byte(&op_registry[oid].max); }
+inline byte op_flags(byte oid)   { return pgm_read_byte(&op_registry[oid].flags); }
+
+/* Option name hash
+ * h = h*OPT_HASH_MUL + c over the name, folded to 8 bits. The multiplier is
+ * chosen so that no two option names share a bucket; a static_assert in
+ * OpenSprinkler.cpp fails the build if a new name collides. */
+#define OPT_HASH_MUL  435U
+#define OPT_HASH_SIZE 256
+
+constexpr uint16_t opt_hash_step(uint16_t h, char c) {
+  return (uint16_t)(h*OPT_HASH_MUL + (byte)c);
+}
+constexpr byte opt_hash_fold(uint16_t h) {
+  return (byte)(h ^ (h>>8));
+}
+constexpr uint16_t opt_hash_str(const char *s, uint16_t h) {
+  return *s ? opt_hash_str(s+1, opt_hash_step(h, *s)) : h;
+}
+constexpr byte opt_hash(const char *s) {
+  return opt_hash_fold(opt_hash_str(s, 0));
+}
+
+byte option_lookup(const char *name, int len);
 #ifdef ESP8266
 struct WiFiConfig {
     byte mode;
@@ -146,6 +238,9 @@ public:
 #endif
 
     static NVConData nvdata;
+    static GeoLocation geo;   // latitude/longitude
+    static byte seq_group[];  // sequential group of each station (0 to NUM_SEQ_GROUPS-1)
+    static byte seq_group_delay[]; // station delay of groups 1 and up (encoded like OPTION_STATION_DELAY_TIME)
     static ConStatus status;
     static ConStatus old_status;
     static byte nboards, nstations;
@@ -181,10 +276,19 @@ public:
     static void get_station_name(byte sid, char buf[]); // get station name
     static void set_station_name(byte sid, char buf[]); // set station name
     static uint16_t parse_rfstation_code(RFStationData *data, ulong *on, ulong *off); // parse rf code into on/off/time sections
-    static void switch_rfstation(RFStationData *data, bool turnon);  // switch rf station
-    static void switch_remotestation(RemoteStationData *data, bool turnon); // switch remote station
-    static void switch_gpiostation(GPIOStationData *data, bool turnon); // switch gpio station
-    static void switch_httpstation(HTTPStationData *data, bool turnon); // switch http station
+    static void switch_rfstation(byte sid, const SpecialStation *stn, bool turnon);  // switch rf station (queued)
+    static void switch_remotestation(const SpecialStation *stn, bool turnon); // switch remote station
+    static void switch_gpiostation(const SpecialStation *stn, bool turnon); // switch gpio station
+    static void switch_httpstation(char *data, bool turnon); // switch http station (data as split by http_split)
+    static const SpecialStation* get_special(byte sid); // parsed special data of a station
+    static const char* get_wtopts();  // weather options (wtopts.txt)
+#if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+    static char* get_ifkey();         // IFTTT key (ifkey.txt)
+#endif
+    static void file_cache_invalidate(byte which); // FILE_CACHE_xxx bits of files that were written
+#if !defined(ARDUINO)
+    static void file_cache_watch();   // pick up external edits of the cached files
+#endif
     static void station_attrib_bits_save(int addr, byte bits[]); // save station attribute bits to nvm
     static void station_attrib_bits_load(int addr, byte bits[]); // load station attribute bits from nvm
     static byte station_attrib_bits_read(int addr); // read one station attribte byte from nvm
@@ -192,6 +296,11 @@ public:
                                                     // -- options and data storeage
     static void nvdata_load();
     static void nvdata_save();
+    static void geo_load();
+    static void geo_save();
+    static void seq_groups_load();
+    static void seq_groups_save();
+    static int16_t seq_group_delay_time(byte grp); // station delay (in seconds) of a sequential group
 
     static void options_setup();
     static void options_load();
@@ -207,8 +316,13 @@ public:
     static void rainsensor_status();// update rainsensor status
     static bool programswitch_status(ulong); // get program switch status
 #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
-    static uint16_t read_current(); // read current sensing value
+    static uint16_t read_current(); // read current sensing value (cached by sample_current)
+    static void sample_current();   // take one background current sample, called from the main loop
     static uint16_t baseline_current; // resting state current
+    static uint16_t curr_min;       // rolling window minimum current (in mA)
+    static uint16_t curr_avg;       // rolling window mean current (in mA)
+    static uint16_t curr_max;       // rolling window maximum current (in mA)
+    static uint16_t curr_signature[MAX_NUM_STATIONS]; // learned per-station solenoid current (in mA)
 #endif
     static int detect_exp();        // detect the number of expansion boards
     static byte weekday_today();    // returns index of today's weekday (Monday is 0)
@@ -265,8 +379,17 @@ private:
     static void lcd_print_2digit(int v);  // print a integer in 2 digits
     static void lcd_start();
     static byte button_read_busy(byte pin_butt, byte waitmode, byte butt, byte is_holding);
+    static void special_load(byte sid, SpecialStation *c); // decode special data from stns.dat
 #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
     static byte engage_booster;
+    static float current_scale();   // analog reading to milli-amp conversion factor
+    static byte current_station();  // index of the single open station (masters aside), or 255
+    static uint16_t curr_samples[CURR_WINDOW_SIZE]; // raw current sample window
+    static byte curr_nsamples;      // number of valid samples in the window
+    static byte curr_pos;           // next write position in the window
+    static byte curr_window_sid;    // station the current window belongs to
+    static byte curr_window_bits[MAX_EXT_BOARDS+1]; // station bits the current window belongs to
+    static ulong curr_sample_lasttime;
 #endif
 
 #endif // LCD functions
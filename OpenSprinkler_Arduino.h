@@ -68,7 +68,11 @@ About:		This is a fork of Rays OpenSprinkler code thats amended to use alternati
     */
     #define MAX_EXT_BOARDS		2                       // maximum number of exp. boards (each expands 8 stations, plus the onboard 8 stations)
     #define MAX_NUM_STATIONS    ((1+MAX_EXT_BOARDS)*8)  // maximum number of stations (including the onboard 8 stations)
+    #if defined(ARDUINO) && !defined(ESP8266) && !defined(__AVR_ATmega1284P__) && !defined(__AVR_ATmega1284__)
     #define NVM_SIZE            2048                    // For AVR, nvm data is stored in EEPROM, ATmega644 has 2K EEPROM
+    #else
+    #define NVM_SIZE            4096                    // ATmega1284 has 4K EEPROM; ESP8266/RPI/BBB keep the 4K map (see defines.h)
+    #endif
 
     /*
     PINOUT AND DEFINES FOR OPENSPRINKLER_ARDUINO
@@ -52,11 +52,21 @@
 #define STATION_ATTR_FILENAME "stns.dat"      // station attributes data file
 #define WIFI_FILENAME         "wifi.dat"      // wifi credentials file
 #define IFTTT_KEY_FILENAME    "ifkey.txt"
+#define IFTTT_QUEUE_FILENAME  "ifqueue.dat"   // push notification outbox
+#define SEQ_GROUPS_FILENAME   "seqgrp.txt"    // sequential group of each station and group delays
+#define SNAPSHOT_FILENAME     "snap.txt"      // configuration snapshot being imported (hex)
 #define IFTTT_KEY_MAXSIZE     128
 #define STATION_SPECIAL_DATA_SIZE  (TMP_BUFFER_SIZE - 8)
 
+#define NUM_SEQ_GROUPS        4     // number of sequential groups (independent sequential chains)
+
 #define FLOWCOUNT_RT_WINDOW   30    // flow count window (for computing real-time flow rate), 30 seconds
 
+#define CURR_SAMPLE_INTERVAL  2     // background current sampling interval (in ms)
+#define CURR_WINDOW_SIZE      8     // number of current samples in the rolling window
+
+//#define EMIT_BENCHMARK      20    // /ja adds "ebench": emit_p against the typed writer, 20 rounds
+
 /** Station type macro defines */
 #define STN_TYPE_STANDARD    0x00
 #define STN_TYPE_RF          0x01
@@ -108,11 +118,12 @@
   */
 
 /** 4KB NVM (ATmega1284) data structure:
-  * |         |     |  ---STRING PARAMETERS---      |           |   ----STATION ATTRIBUTES-----      |          |
-  * | PROGRAM | CON | PWD | LOC | JURL | WURL | KEY | STN_NAMES | MAS | IGR | MAS2 | DIS | SEQ | SPE | OPTIONS  |
-  * |  (2433) |(12) |(36) |(48) | (48) | (48) |(24) |   (1344)  | (7) | (7) |  (7) | (7) | (7) | (7) |   (61)   |
-  * |         |     |     |     |      |      |     |           |     |     |      |     |     |     |          |
-  * 0       2433  2445   2481  2529  2577   2625   2649        3993  4000  4007   4014  4021  4028  4035      4096
+  * |         |     |  ---STRING PARAMETERS---      |           |   ----STATION ATTRIBUTES-----      |          |     |
+  * | PROGRAM | CON | PWD | LOC | JURL | WURL | KEY | STN_NAMES | MAS | IGR | MAS2 | DIS | SEQ | SPE | OPTIONS  | GEO |
+  * |  (2417) |(12) |(36) |(48) | (48) | (48) |(24) |   (1344)  | (7) | (7) |  (7) | (7) | (7) | (7) |   (69)   | (8) |
+  * |         |     |     |     |      |      |     |           |     |     |      |     |     |     |          |     |
+  * 0       2417  2429   2465  2513  2561   2609   2633        3977  3984  3991   3998  4005  4012  4019      4088  4096
+  * The options area leaves 16 bytes for options added later.
   */
 
   #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) // for 4KB NVM
@@ -123,7 +134,7 @@
     #define NVM_SIZE            4096  // For AVR, nvm data is stored in EEPROM, ATmega1284 has 4K EEPROM
     #define STATION_NAME_SIZE   24    // maximum number of characters in each station name
 
-    #define MAX_PROGRAMDATA     2433  // program data
+    #define MAX_PROGRAMDATA     2417  // program data
     #define MAX_NVCONDATA       12    // non-volatile controller data
     #define MAX_USER_PASSWORD   36    // user password
     #define MAX_LOCATION        48    // location string
@@ -154,6 +165,10 @@
   // These are kept the same as AVR for compatibility reasons
   // But they can be increased if needed
   #define NVM_FILENAME        "nvm.dat" // for RPI/BBB, nvm data is stored in a file
+  #define NVM_LOG_FILENAME    "nvm.log" // ESP8266: journal of nvm writes since the last compaction
+  #define NVM_TMP_FILENAME    "nvm.tmp" // ESP8266: base image being compacted
+  #define NVM_LOG_MAX         8192      // ESP8266: journal size that triggers a compaction
+  #define GZIP_WINDOW         2048      // deflate window for gzip JSON replies (undefine to disable)
 
   #define MAX_EXT_BOARDS    6  // maximum number of exp. boards (each expands 8 stations)
   #define MAX_NUM_STATIONS  ((1+MAX_EXT_BOARDS)*8)  // maximum number of stations
@@ -161,7 +176,7 @@
   #define NVM_SIZE            4096
   #define STATION_NAME_SIZE   24    // maximum number of characters in each station name
 
-  #define MAX_PROGRAMDATA     2433  // program data
+  #define MAX_PROGRAMDATA     2417  // program data (same map as the ATmega1284)
   #define MAX_NVCONDATA       12     // non-volatile controller data
   #define MAX_USER_PASSWORD   36    // user password
   #define MAX_LOCATION        48    // location string
@@ -187,6 +202,10 @@
 #define ADDR_NVM_STNSEQ        (ADDR_NVM_STNDISABLE+(MAX_EXT_BOARDS+1))// station sequential bits
 #define ADDR_NVM_STNSPE        (ADDR_NVM_STNSEQ+(MAX_EXT_BOARDS+1)) // station special bits (i.e. non-standard stations)
 #define ADDR_NVM_OPTIONS       (ADDR_NVM_STNSPE+(MAX_EXT_BOARDS+1))  // options
+#define NVM_GEOLOC_SIZE        8     // bytes reserved for the latitude/longitude block
+#define ADDR_NVM_GEOLOC        (NVM_SIZE-NVM_GEOLOC_SIZE) // latitude/longitude for local sunrise/sunset (fixed, at the top of nvm)
+#define MAX_NVM_OPTIONS        (ADDR_NVM_GEOLOC-ADDR_NVM_OPTIONS) // room for options below the geolocation block
+#define GEOLOC_TAG             0x5A  // marks a stored latitude/longitude as valid
 
 /** Default password, location string, weather key, script urls */
 #define DEFAULT_PASSWORD          "a6d82bced638de3def1e9bbb4983225c"  // md5 of 'opendoor'
@@ -196,70 +215,109 @@
 #define DEFAULT_WEATHER_URL       "weather.opensprinkler.com"
 #define DEFAULT_IFTTT_URL         "maker.ifttt.com"
 
-/** Macro define of each option
-  * Refer to OpenSprinkler.cpp for details on each option
-  */
+/** Option registry
+ * One line per option, in nvm order (new options go at the end so the
+ * existing nvm offsets stay put):
+ *   X(id, json name (at most 5 characters), maximum value, flags, LCD prompt (16 characters))
+ * The option enum, the option table and the name hash are all generated from
+ * this list, so adding an option is a matter of adding one line here (and its
+ * default value to OpenSprinkler::options[]).
+ * Refer to OpenSprinkler.cpp for details on each option
+ */
+#define OPTION_REGISTRY(X) \
+  X(FW_VERSION,         "fwv",   0,                OPT_RO|OPT_FW,               "Firmware version") \
+  X(TIMEZONE,           "tz",    108,              OPT_TIME,                    "Time zone (GMT):") \
+  X(USE_NTP,            "ntp",   1,                OPT_TIME|OPT_IPCFG,          "Enable NTP sync?") \
+  X(USE_DHCP,           "dhcp",  1,                OPT_NET|OPT_IPCFG,           "Enable DHCP?    ") \
+  X(STATIC_IP1,         "ip1",   255,              OPT_NET|OPT_IPCFG,           "Static.ip1:     ") \
+  X(STATIC_IP2,         "ip2",   255,              OPT_NET|OPT_IPCFG,           "Static.ip2:     ") \
+  X(STATIC_IP3,         "ip3",   255,              OPT_NET|OPT_IPCFG,           "Static.ip3:     ") \
+  X(STATIC_IP4,         "ip4",   255,              OPT_NET|OPT_IPCFG,           "Static.ip4:     ") \
+  X(GATEWAY_IP1,        "gw1",   255,              OPT_NET|OPT_IPCFG,           "Gateway.ip1:    ") \
+  X(GATEWAY_IP2,        "gw2",   255,              OPT_NET|OPT_IPCFG,           "Gateway.ip2:    ") \
+  X(GATEWAY_IP3,        "gw3",   255,              OPT_NET|OPT_IPCFG,           "Gateway.ip3:    ") \
+  X(GATEWAY_IP4,        "gw4",   255,              OPT_NET|OPT_IPCFG,           "Gateway.ip4:    ") \
+  X(HTTPPORT_0,         "hp0",   255,              OPT_NET,                     "HTTP Port:      ") \
+  X(HTTPPORT_1,         "hp1",   255,              OPT_NET,                     "----------------") \
+  X(HW_VERSION,         "hwv",   0,                OPT_RO|OPT_FW,               "Hardware version") \
+  X(EXT_BOARDS,         "ext",   MAX_EXT_BOARDS,   0,                           "# of exp. board:") \
+  X(SEQUENTIAL_RETIRED, "seq",   1,                OPT_RO,                      "----------------") \
+  X(STATION_DELAY_TIME, "sdt",   255,              OPT_WTIME,                   "Stn. delay (sec)") \
+  X(MASTER_STATION,     "mas",   MAX_NUM_STATIONS, 0,                           "Master 1 (Mas1):") \
+  X(MASTER_ON_ADJ,      "mton",  255,              OPT_WTIME,                   "Mas1  on adjust:") \
+  X(MASTER_OFF_ADJ,     "mtof",  255,              OPT_WTIME,                   "Mas1 off adjust:") \
+  X(SENSOR_TYPE,        "urs",   255,              0,                           "Sensor type:    ") \
+  X(RAINSENSOR_TYPE,    "rso",   1,                0,                           "Normally open?  ") \
+  X(WATER_PERCENTAGE,   "wl",    250,              0,                           "Watering level: ") \
+  X(DEVICE_ENABLE,      "den",   1,                OPT_RO,                      "Device enabled? ") \
+  X(IGNORE_PASSWORD,    "ipas",  1,                0,                           "Ignore password?") \
+  X(DEVICE_ID,          "devid", 255,              OPT_NET,                     "Device ID:      ") \
+  X(LCD_CONTRAST,       "con",   255,              0,                           "LCD contrast:   ") \
+  X(LCD_BACKLIGHT,      "lit",   255,              0,                           "LCD brightness: ") \
+  X(LCD_DIMMING,        "dim",   255,              0,                           "LCD dimming:    ") \
+  X(BOOST_TIME,         "bst",   250,              OPT_BOOST,                   "DC boost time:  ") \
+  X(USE_WEATHER,        "uwt",   255,              OPT_WEATHER,                 "Weather algo.:  ") \
+  X(NTP_IP1,            "ntp1",  255,              OPT_TIME,                    "NTP server.ip1: ") \
+  X(NTP_IP2,            "ntp2",  255,              OPT_TIME,                    "NTP server.ip2: ") \
+  X(NTP_IP3,            "ntp3",  255,              OPT_TIME,                    "NTP server.ip3: ") \
+  X(NTP_IP4,            "ntp4",  255,              OPT_TIME,                    "NTP server.ip4: ") \
+  X(ENABLE_LOGGING,     "lg",    1,                0,                           "Enable logging? ") \
+  X(MASTER_STATION_2,   "mas2",  MAX_NUM_STATIONS, 0,                           "Master 2 (Mas2):") \
+  X(MASTER_ON_ADJ_2,    "mton2", 255,              OPT_WTIME,                   "Mas2  on adjust:") \
+  X(MASTER_OFF_ADJ_2,   "mtof2", 255,              OPT_WTIME,                   "Mas2 off adjust:") \
+  X(FW_MINOR,           "fwm",   0,                OPT_RO|OPT_FW,               "Firmware minor: ") \
+  X(PULSE_RATE_0,       "fpr0",  255,              0,                           "Pulse rate:     ") \
+  X(PULSE_RATE_1,       "fpr1",  255,              0,                           "----------------") \
+  X(REMOTE_EXT_MODE,    "re",    1,                OPT_RO,                      "As remote ext.? ") \
+  X(DNS_IP1,            "dns1",  255,              0,                           "DNS server.ip1: ") \
+  X(DNS_IP2,            "dns2",  255,              0,                           "DNS server.ip2: ") \
+  X(DNS_IP3,            "dns3",  255,              0,                           "DNS server.ip3: ") \
+  X(DNS_IP4,            "dns4",  255,              0,                           "DNS server.ip4: ") \
+  X(SPE_AUTO_REFRESH,   "sar",   1,                0,                           "Special Refresh?") \
+  X(IFTTT_ENABLE,       "ife",   255,              0,                           "IFTTT Enable:   ") \
+  X(RESET,              "reset", 1,                OPT_RO,                      "Factory reset?  ") \
+  X(LANE_FLOW_LIMIT,    "lfl",   255,              0,                           "Flow limit:     ") \
+  X(LANE_CURR_LIMIT,    "lcl",   255,              OPT_CURR,                    "Current limit:  ")
+
+/** Option flags */
+#define OPT_RO        0x01  // cannot be set through /co nor by a snapshot import
+#define OPT_FW        0x02  // value comes from the firmware build, not from the user
+#define OPT_WTIME     0x04  // signed water time, see water_time_encode_signed()
+#define OPT_BOOST     0x08  // DC boost time, reported in ms (4 ms per unit)
+#define OPT_TIME      0x10  // a change restarts the time keeping
+#define OPT_NET       0x20  // a change restarts the network
+#define OPT_WEATHER   0x40  // a change triggers a weather call
+#define OPT_IPCFG     0x80  // network setup left to the OS on RPI/BBB/LINUX (not in /jo)
+#if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+#define OPT_CURR      0       // needs current sensing
+#else
+#define OPT_CURR      OPT_RO  // needs current sensing, which this board lacks: always 0
+#endif
+
+#define OPTION_ENUM(id, name, max, flags, prompt)  OPTION_##id,
 typedef enum {
-  OPTION_FW_VERSION = 0,
-  OPTION_TIMEZONE,
-  OPTION_USE_NTP,
-  OPTION_USE_DHCP,
-  OPTION_STATIC_IP1,
-  OPTION_STATIC_IP2,
-  OPTION_STATIC_IP3,
-  OPTION_STATIC_IP4,
-  OPTION_GATEWAY_IP1,
-  OPTION_GATEWAY_IP2,
-  OPTION_GATEWAY_IP3,
-  OPTION_GATEWAY_IP4,
-  OPTION_HTTPPORT_0,
-  OPTION_HTTPPORT_1,
-  OPTION_HW_VERSION,
-  OPTION_EXT_BOARDS,
-  OPTION_SEQUENTIAL_RETIRED,
-  OPTION_STATION_DELAY_TIME,
-  OPTION_MASTER_STATION,
-  OPTION_MASTER_ON_ADJ,
-  OPTION_MASTER_OFF_ADJ,
-  OPTION_SENSOR_TYPE,
-  OPTION_RAINSENSOR_TYPE,
-  OPTION_WATER_PERCENTAGE,
-  OPTION_DEVICE_ENABLE,
-  OPTION_IGNORE_PASSWORD,
-  OPTION_DEVICE_ID,
-  OPTION_LCD_CONTRAST,
-  OPTION_LCD_BACKLIGHT,
-  OPTION_LCD_DIMMING,
-  OPTION_BOOST_TIME,
-  OPTION_USE_WEATHER,
-  OPTION_NTP_IP1,
-  OPTION_NTP_IP2,
-  OPTION_NTP_IP3,
-  OPTION_NTP_IP4,
-  OPTION_ENABLE_LOGGING,
-  OPTION_MASTER_STATION_2,
-  OPTION_MASTER_ON_ADJ_2,
-  OPTION_MASTER_OFF_ADJ_2,
-  OPTION_FW_MINOR,
-  OPTION_PULSE_RATE_0,
-  OPTION_PULSE_RATE_1,
-  OPTION_REMOTE_EXT_MODE,
-  OPTION_DNS_IP1,
-  OPTION_DNS_IP2,
-  OPTION_DNS_IP3,
-  OPTION_DNS_IP4,
-  OPTION_SPE_AUTO_REFRESH,
-  OPTION_IFTTT_ENABLE,
-  OPTION_RESET,
+  OPTION_REGISTRY(OPTION_ENUM)
   NUM_OPTIONS	// total number of options
 } OS_OPTION_t;
 
+/** NTP servers */
+#define NTP_SERVER_CONFIGURED  0   // server set by OPTION_NTP_IP1..4
+#define NTP_SERVER_POOL        1   // pool.ntp.org
+
+/** Network health probe targets */
+#define NET_TARGET_GATEWAY     0
+#define NET_TARGET_WEATHER     1
+#define NET_TARGET_PEER        2   // first remote-extension peer
+#define NET_MAX_PEERS          2
+#define NET_NUM_TARGETS        (NET_TARGET_PEER+NET_MAX_PEERS)
+
 /** Log Data Type */
 #define LOGDATA_STATION    0x00
 #define LOGDATA_RAINSENSE  0x01
 #define LOGDATA_RAINDELAY  0x02
 #define LOGDATA_WATERLEVEL 0x03
 #define LOGDATA_FLOWSENSE  0x04
+#define LOGDATA_FLOWALERT  0x05
 
 #undef OS_HW_VERSION
 
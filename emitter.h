@@ -0,0 +1,140 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Typed reply writer header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EMITTER_H
+#define _EMITTER_H
+
+/* emit(bfill, a, b, ...) is the typed counterpart of bfill.emit_p().
+ * Instead of a "$D/$L/$S/$F/$E/$H" format string read at run time, the reply
+ * is given as a list of pieces, and the type of each piece selects its writer
+ * at compile time:
+ *   EMIT_P("text") string in program memory   ($F, and the literal parts of a format)
+ *   char *         string in RAM              ($S)
+ *   NvmStr(a)      zero-terminated string in nvm ($E)
+ *   Hex(b)         byte as two hex digits     ($H)
+ *   char           a single character
+ *   integers       decimal, signed or unsigned by type ($D, $L)
+ * A call writes all of its pieces or none of them: it returns the number
+ * of bytes written, or EMIT_OVERFLOW if the pieces do not fit in the reply
+ * buffer, so the caller can send what is buffered and emit them again. */
+
+#if defined(ARDUINO) && !defined(ESP8266)
+  #define EMIT_CAPACITY (ETHER_BUFFER_SIZE-0x36)  // the reply starts after the TCP/IP headers
+#else
+  #define EMIT_CAPACITY (ETHER_BUFFER_SIZE-1)     // keep room for the terminating zero
+#endif
+#define EMIT_OVERFLOW 0xFFFF
+
+struct PStr { PGM_P s; };
+struct NvmStr { const byte *s; NvmStr(int a) : s((const byte*)(size_t)a) {} };
+struct Hex { byte v; Hex(byte b) : v(b) {} };
+
+#define EMIT_P(x) PStr{PSTR(x)}
+
+/* Each emit_piece() returns the length of its piece and writes it only
+ * when write is set, so emit() can measure all pieces first. */
+
+static inline uint16_t emit_piece(BufferFiller &b, const char *s, bool write) {
+  uint16_t n = strlen(s);
+  if (write) b.emit_raw(s, n);
+  return n;
+}
+static inline uint16_t emit_piece(BufferFiller &b, char *s, bool write) { return emit_piece(b, (const char*)s, write); }
+
+static inline uint16_t emit_piece(BufferFiller &b, PStr p, bool write) {
+  char buf[16];
+  uint16_t n = 0;
+  byte k;
+  do {
+    for (k=0; k<sizeof(buf) && (buf[k] = pgm_read_byte(p.s+k)); k++);
+    if (write) b.emit_raw(buf, k);
+    n += k;
+    p.s += k;
+  } while (k == sizeof(buf));
+  return n;
+}
+
+static inline uint16_t emit_piece(BufferFiller &b, NvmStr e, bool write) {
+  char buf[16];
+  uint16_t n = 0;
+  byte k;
+  do {
+    for (k=0; k<sizeof(buf) && (buf[k] = nvm_read_byte(e.s+k)); k++);
+    if (write) b.emit_raw(buf, k);
+    n += k;
+    e.s += k;
+  } while (k == sizeof(buf));
+  return n;
+}
+
+static inline uint16_t emit_piece(BufferFiller &b, char c, bool write) {
+  if (write) b.emit_raw(&c, 1);
+  return 1;
+}
+
+static inline uint16_t emit_piece(BufferFiller &b, Hex h, bool write) {
+  char d[2];
+  d[0] = (h.v>>4) + ((h.v>>4) > 9 ? 'A'-10 : '0');
+  d[1] = (h.v&15) + ((h.v&15) > 9 ? 'A'-10 : '0');
+  if (write) b.emit_raw(d, 2);
+  return 2;
+}
+
+/** Decimal digits, written backwards from the end of a small buffer */
+static inline uint16_t emit_ulong(BufferFiller &b, unsigned long v, bool neg, bool write) {
+  char d[21];  // 64-bit unsigned long on Linux
+  char *q = d+sizeof(d);
+  do {
+    *--q = '0' + v%10;
+    v /= 10;
+  } while (v);
+  if (neg) *--q = '-';
+  uint16_t n = d+sizeof(d)-q;
+  if (write) b.emit_raw(q, n);
+  return n;
+}
+
+static inline uint16_t emit_piece(BufferFiller &b, unsigned long v, bool write) { return emit_ulong(b, v, false, write); }
+static inline uint16_t emit_piece(BufferFiller &b, unsigned int v, bool write) { return emit_ulong(b, v, false, write); }
+static inline uint16_t emit_piece(BufferFiller &b, unsigned short v, bool write) { return emit_ulong(b, v, false, write); }
+static inline uint16_t emit_piece(BufferFiller &b, unsigned char v, bool write) { return emit_ulong(b, v, false, write); }
+static inline uint16_t emit_piece(BufferFiller &b, long v, bool write) { return emit_ulong(b, v<0 ? 0UL-(unsigned long)v : v, v<0, write); }
+static inline uint16_t emit_piece(BufferFiller &b, int v, bool write) { return emit_piece(b, (long)v, write); }
+static inline uint16_t emit_piece(BufferFiller &b, short v, bool write) { return emit_piece(b, (long)v, write); }
+
+static inline uint16_t emit_pieces(BufferFiller &b, bool write) { return 0; }
+
+template<typename T, typename... Rest>
+static inline uint16_t emit_pieces(BufferFiller &b, bool write, T first, Rest... rest) {
+  uint16_t n = emit_piece(b, first, write);
+  return n + emit_pieces(b, write, rest...);
+}
+
+template<typename... Pieces>
+static inline uint16_t emit(BufferFiller &b, Pieces... pieces) {
+  uint16_t n = emit_pieces(b, false, pieces...);
+  if (b.position() + n > EMIT_CAPACITY) return EMIT_OVERFLOW;
+  emit_pieces(b, true, pieces...);
+  return n;
+}
+
+#endif  // _EMITTER_H
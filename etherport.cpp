@@ -173,6 +173,23 @@ EthernetClient::operator bool()
 	return m_sock != 0;
 }
 
+// check, without blocking, whether data is waiting to be read
+//  Returns 1 if a read would not block (data or a closed socket), 0 otherwise
+int EthernetClient::available()
+{
+	if (!m_sock)
+		return 0;
+	fd_set sock_set;
+	FD_ZERO(&sock_set);
+	FD_SET(m_sock, &sock_set);
+	struct timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 0;
+
+	select(m_sock + 1, &sock_set, NULL, NULL, &timeout);
+	return FD_ISSET(m_sock, &sock_set) ? 1 : 0;
+}
+
 // read data from the client into the buffer provided
 //  This function will block until either data is received OR a timeout happens.
 //  If an error occurs or a timeout happens, we set the disconnect flag on the socket
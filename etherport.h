@@ -49,6 +49,7 @@ public:
 	bool connected();
 	void stop();
 	int read(uint8_t *buf, size_t size);
+	int available();
 	size_t write(const uint8_t *buf, size_t size);
 	operator bool();
 	int GetSocket()
@@ -0,0 +1,198 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Streaming gzip compressor
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include "gzstream.h"
+#include "utils.h"
+
+#ifdef GZIP_WINDOW
+
+#define GZIP_HASH_SIZE  (1<<GZIP_HASH_BITS)
+#define GZIP_MAX_MATCH  258
+
+// deflate length codes 257..285: base length and extra bits
+static const uint16_t len_base[] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const byte len_extra[] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+// deflate distance codes 0..29: base distance and extra bits
+static const uint16_t dist_base[] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const byte dist_extra[] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+// CRC-32 (as used by gzip), one nibble at a time
+static const uint32_t crc_nibble[] = {
+  0x00000000,0x1db71064,0x3b6e20c8,0x26d930ac,0x76dc4190,0x6b6b51f4,0x4db26158,0x5005713c,
+  0xedb88320,0xf00f9344,0xd6d6a3e8,0xcb61b38c,0x9b64c2b0,0x86d3d2d4,0xa00ae278,0xbdbdf21c};
+
+static uint16_t gz_hash(const byte *p) {
+  return ((p[0]<<6) ^ (p[1]<<3) ^ p[2]) & (GZIP_HASH_SIZE-1);
+}
+
+bool GzipStream::begin(Sink out) {
+  if (win) free(win);
+  win = (byte*)malloc(2*GZIP_WINDOW + GZIP_HASH_SIZE*sizeof(int16_t));
+  if (!win) return false;
+  head = (int16_t*)(win + 2*GZIP_WINDOW);
+  for (int i=0; i<GZIP_HASH_SIZE; i++) head[i] = -1;
+  wpos = 0;
+  crc = 0xFFFFFFFFUL;
+  bitbuf = 0;
+  nbits = 0;
+  olen = 0;
+  sink = out;
+  in_bytes = out_bytes = cpu_us = 0;
+
+  // gzip header: magic, deflate, no flags, no time, no extra flags, unknown OS
+  static const byte header[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+  memcpy(obuf, header, sizeof(header));
+  olen = sizeof(header);
+  // a single final block with fixed Huffman codes
+  put_bits(1, 1);
+  put_bits(1, 2);
+  return true;
+}
+
+void GzipStream::write(const byte *data, int len) {
+  if (!win) return;
+  ulong t = micros();
+  in_bytes += len;
+  for (int i=0; i<len; i++) {
+    crc ^= data[i];
+    crc = (crc>>4) ^ crc_nibble[crc&15];
+    crc = (crc>>4) ^ crc_nibble[crc&15];
+  }
+  while (len > 0) {
+    int n = (len > GZIP_WINDOW) ? GZIP_WINDOW : len;
+    if (wpos + n > 2*GZIP_WINDOW) {
+      // keep the last GZIP_WINDOW bytes as match history
+      int shift = wpos - GZIP_WINDOW;
+      memmove(win, win+shift, GZIP_WINDOW);
+      wpos -= shift;
+      for (int i=0; i<GZIP_HASH_SIZE; i++)
+        head[i] = (head[i] >= shift) ? head[i]-shift : -1;
+    }
+    memcpy(win+wpos, data, n);
+    encode(n);
+    data += n;
+    len -= n;
+  }
+  cpu_us += micros() - t;
+}
+
+/** Encode the next len bytes of the window (greedy, one candidate per hash) */
+void GzipStream::encode(int len) {
+  int end = wpos + len;
+  while (wpos < end) {
+    int best = 0, dist = 0;
+    if (end - wpos >= 3) {
+      uint16_t h = gz_hash(win+wpos);
+      int cand = head[h];
+      head[h] = wpos;
+      if (cand >= 0 && wpos - cand <= GZIP_WINDOW) {
+        int max = end - wpos;
+        if (max > GZIP_MAX_MATCH) max = GZIP_MAX_MATCH;
+        int l = 0;
+        while (l < max && win[cand+l] == win[wpos+l]) l++;
+        if (l >= 3) {
+          best = l;
+          dist = wpos - cand;
+        }
+      }
+    }
+    if (best) {
+      put_match(best, dist);
+      for (int i=1; i<best; i++) {
+        if (end - (wpos+i) >= 3)  head[gz_hash(win+wpos+i)] = wpos+i;
+      }
+      wpos += best;
+    } else {
+      put_literal(win[wpos++]);
+    }
+  }
+}
+
+void GzipStream::end() {
+  if (!win) return;
+  ulong t = micros();
+  put_huff(0, 7);   // end of block (symbol 256)
+  if (nbits) put_bits(0, 8-nbits);
+  crc ^= 0xFFFFFFFFUL;
+  for (byte i=0; i<4; i++)  put_bits((crc>>(i*8)) & 0xFF, 8);
+  for (byte i=0; i<4; i++)  put_bits((in_bytes>>(i*8)) & 0xFF, 8);
+  flush_out();
+  free(win);
+  win = NULL;
+  cpu_us += micros() - t;
+}
+
+void GzipStream::put_bits(uint16_t v, byte n) {
+  bitbuf |= (uint32_t)v << nbits;
+  nbits += n;
+  while (nbits >= 8) {
+    obuf[olen++] = bitbuf & 0xFF;
+    bitbuf >>= 8;
+    nbits -= 8;
+    if (olen == GZIP_OUT_SIZE)  flush_out();
+  }
+}
+
+/** Huffman codes are stored most significant bit first */
+void GzipStream::put_huff(uint16_t code, byte n) {
+  uint16_t r = 0;
+  for (byte i=0; i<n; i++) {
+    r = (r<<1) | (code&1);
+    code >>= 1;
+  }
+  put_bits(r, n);
+}
+
+void GzipStream::put_literal(byte c) {
+  if (c < 144)  put_huff(0x30+c, 8);
+  else  put_huff(0x190+c-144, 9);
+}
+
+void GzipStream::put_match(int len, int dist) {
+  byte i = sizeof(len_extra)-1;
+  while (len_base[i] > len) i--;
+  uint16_t sym = 257+i;
+  if (sym < 280)  put_huff(sym-256, 7);
+  else  put_huff(0xC0+sym-280, 8);
+  if (len_extra[i])  put_bits(len-len_base[i], len_extra[i]);
+
+  i = sizeof(dist_extra)-1;
+  while (dist_base[i] > dist) i--;
+  put_huff(i, 5);
+  if (dist_extra[i])  put_bits(dist-dist_base[i], dist_extra[i]);
+}
+
+void GzipStream::flush_out() {
+  if (!olen) return;
+  ulong t = micros();
+  sink(obuf, olen);
+  cpu_us -= micros() - t;   // time on the wire is not compression time
+  out_bytes += olen;
+  olen = 0;
+}
+
+#endif  // GZIP_WINDOW
@@ -0,0 +1,72 @@
+/* OpenSprinkler Unified (AVR/RPI/BBB/LINUX) Firmware
+ * Copyright (C) 2015 by Ray Wang (ray@opensprinkler.com)
+ *
+ * Streaming gzip compressor header file
+ *
+ * This file is part of the OpenSprinkler library
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GZSTREAM_H
+#define _GZSTREAM_H
+
+#include "defines.h"
+
+#ifdef GZIP_WINDOW
+
+#define GZIP_HASH_BITS  9
+#define GZIP_OUT_SIZE   256   // compressed bytes staged before they are handed out
+
+/** Incremental gzip (deflate, fixed Huffman codes) compressor.
+ * Input can be fed in any number of pieces; each piece is encoded at once,
+ * with matches reaching back up to GZIP_WINDOW bytes into earlier pieces.
+ * Completed output bytes are passed to the sink as they fill up. */
+class GzipStream {
+public:
+  typedef void (*Sink)(const byte *data, int len);
+
+  GzipStream() : win(NULL) {}
+  bool begin(Sink out);   // allocate the window and emit the gzip header
+  void write(const byte *data, int len);
+  void end();             // emit the final block and trailer, release the window
+  bool active() const { return win != NULL; }
+
+  ulong in_bytes;         // uncompressed bytes so far
+  ulong out_bytes;        // compressed bytes so far
+  ulong cpu_us;           // time spent compressing (in us)
+
+private:
+  void encode(int len);
+  void put_bits(uint16_t v, byte n);
+  void put_huff(uint16_t code, byte n);
+  void put_literal(byte c);
+  void put_match(int len, int dist);
+  void flush_out();
+
+  byte *win;              // window (2*GZIP_WINDOW bytes), followed by the hash heads
+  int16_t *head;
+  int wpos;               // next byte of the window to encode
+  ulong crc;
+  uint32_t bitbuf;
+  byte nbits;
+  byte obuf[GZIP_OUT_SIZE];
+  int olen;
+  Sink sink;
+};
+
+#endif  // GZIP_WINDOW
+
+#endif  // _GZSTREAM_H
@@ -48,7 +48,6 @@
 #endif
 
 
-unsigned long getNtpTime();
 
 #else // header and defs for RPI/BBB
 
@@ -76,6 +75,7 @@ EthernetClient *m_client = 0;
 void reset_all_stations();
 void reset_all_stations_immediate();
 void push_message(byte type, uint32_t lval=0, float fval=0.f, const char* sval=NULL);
+void push_message_poll(ulong curr_time);
 void manual_start_program(byte, byte);
 void httpget_callback(byte, uint16_t, uint16_t);
 
@@ -88,7 +88,6 @@ void httpget_callback(byte, uint16_t, uint16_t);
 #define CHECK_WEATHER_TIMEOUT   3601    // Weather check interval: 1 hour
 #define CHECK_WEATHER_SUCCESS_TIMEOUT 86433L // Weather check success interval: 24 hrs
 #define LCD_BACKLIGHT_TIMEOUT   15      // LCD backlight timeout: 15 secs
-#define PING_TIMEOUT            200     // Ping test timeout: 200 ms
 
 extern char tmp_buffer[];       // scratch buffer
 
@@ -107,9 +106,56 @@ ProgramData pd;   // ProgramdData object
  * flow_stop - time when valve turns off (last rising edge pulse detected before off)
  * flow_gallons - total # of gallons+1 from flow_start to flow_stop
  * flow_last_gpm - last flow rate measured (averaged over flow_gallons) from last valve stopped (used to write to log file). */
-volatile ulong flow_begin, flow_start, flow_stop, flow_gallons;
-volatile ulong flow_count = 0;
+ulong flow_begin, flow_start, flow_stop, flow_gallons;
+ulong flow_count = 0;
 float flow_last_gpm=0;
+
+/* ====== Flow pulse capture ======
+ * flow_isr only time stamps debounced pulses into a single-producer /
+ * single-consumer ring. The main loop drains the ring with flow_poll(),
+ * which updates all flow counters outside of interrupt context, so they
+ * are never read half-updated. A pulse that finds the ring full loses its
+ * time stamp only: flow_poll still adds it to the counters.
+ * On Linux flow_isr runs on the gpio edge thread, right after poll() returns.
+ * flow_interval_ms - smoothed time between pulses (gives sub-second rate resolution)
+ * flow_jitter_ms - smoothed deviation of the pulse interval */
+#define FLOW_RING_SIZE  32    // must be a power of 2
+#if defined(ARDUINO)
+#define FLOW_RING_BARRIER()
+#else
+#define FLOW_RING_BARRIER() __sync_synchronize() // pulses come from the gpio edge thread
+#endif
+static volatile ulong flow_ring[FLOW_RING_SIZE]; // pulse time stamps (in ms)
+static volatile byte flow_ring_head = 0;  // written by flow_isr only
+static volatile byte flow_ring_tail = 0;  // written by flow_poll only
+volatile uint16_t flow_ring_overruns = 0; // pulses that found the ring full (counted, but not time stamped)
+ulong flow_last_ms = 0;
+ulong flow_interval_ms = 0;
+ulong flow_jitter_ms = 0;
+
+/* ====== Per-station flow accounting ======
+ * Pulses are counted against a segment: a stretch of time during which
+ * the same set of (non-master) stations is open. Each pulse only bumps
+ * the segment counter, so the cost per pulse is O(1). When the set of
+ * open stations changes, the segment is shared out among the stations
+ * that were open, and a segment with a single open station updates
+ * that station's rate baseline (EWMA).
+ * flow_leak - flow was seen while all valves were closed
+ * flow_high_bits - stations flowing far above their baseline */
+#define FLOW_LEAK_GRACE_MS   60000L // ignore pulses right after valves close (pipes draining)
+#define FLOW_LEAK_PULSES     3      // pulses with all valves closed before flagging a leak
+#define FLOW_MIN_SEGMENT_MS  60000L // minimum single-station run to measure a rate
+#define FLOW_ALERT_PERCENT   50     // deviation above baseline that raises an alert
+FlowStationStats flow_stn[MAX_NUM_STATIONS];
+byte flow_high_bits[MAX_EXT_BOARDS+1];
+byte flow_leak = 0;
+static byte flow_seg_bits[MAX_EXT_BOARDS+1];  // stations open during the current segment
+static byte flow_seg_nopen = 0;     // number of stations open during the current segment
+static byte flow_seg_sid = 0;       // the open station, if only one
+static ulong flow_seg_start = 0;    // segment start time (in ms)
+static ulong flow_seg_pulses = 0;   // pulses received during the segment
+static ulong flow_seg_leak = 0;     // pulses received after the leak grace period
+
 /** Flow sensor interrupt service routine */
 #ifdef ESP8266
 ICACHE_RAM_ATTR void flow_isr() // for ESP8266, ISR must be marked ICACHE_RAM_ATTR
@@ -121,16 +167,179 @@ void flow_isr()
   ulong curr = millis();
 
   if(curr-os.flowcount_time_ms < 50) return;  // debounce threshold: 50ms
-  flow_count++;
   os.flowcount_time_ms = curr;
 
-  /* RAH implementation of flow sensor */
-  if (flow_start==0) { flow_gallons=0; flow_start=curr;}  // if first pulse, record time
-  if ((curr-flow_start)<90000) { flow_gallons=0; } // wait 90 seconds before recording flow_begin
-  else {  if (flow_gallons==1)  {  flow_begin = curr;}}
-  flow_stop = curr; // get time in ms for stop
-  flow_gallons++;  // increment gallon count for each interrupt
-  /* End of RAH implementation of flow sensor */
+  byte head = flow_ring_head;
+  byte next = (head+1) & (FLOW_RING_SIZE-1);
+  if(next == flow_ring_tail) {  // ring is full, main loop is not keeping up
+    flow_ring_overruns++;
+    return;
+  }
+  flow_ring[head] = curr;
+  FLOW_RING_BARRIER();
+  flow_ring_head = next;
+}
+
+/** Pulses dropped from the ring since the last call */
+static uint16_t flow_take_overruns() {
+  static uint16_t seen = 0;
+#if defined(ARDUINO)
+  noInterrupts();
+  uint16_t n = flow_ring_overruns;
+  interrupts();
+#else
+  uint16_t n = flow_ring_overruns;
+#endif
+  uint16_t lost = n - seen;
+  seen = n;
+  return lost;
+}
+
+/** Fold a new sample into a smoothed (1/8 weight) value */
+static ulong flow_smooth(ulong avg, ulong v) {
+  return avg ? (avg*7+v)>>3 : v;
+}
+
+/** Rate of the current segment in pulses per hour */
+static uint16_t flow_seg_rate(ulong now_ms) {
+  ulong dur = now_ms - flow_seg_start;
+  if(!dur) return 0;
+  ulong rate = (ulong)((float)flow_seg_pulses*3600000.0f/(float)dur);
+  return (rate>65535UL) ? 65535 : (uint16_t)rate;
+}
+
+void write_log(byte type, ulong curr_time);
+
+/** Check the running segment for flow anomalies */
+static void flow_check_segment(ulong now_ms) {
+  if(flow_seg_nopen==0) {
+    if(!flow_leak && flow_seg_leak>=FLOW_LEAK_PULSES) {
+      flow_leak = 1;
+      write_log(LOGDATA_FLOWALERT, os.now_tz());
+    }
+  } else if(flow_seg_nopen==1 && now_ms-flow_seg_start>=FLOW_MIN_SEGMENT_MS) {
+    byte sid = flow_seg_sid;
+    byte bid = sid>>3, mask = 1<<(sid&0x07);
+    uint16_t base = flow_stn[sid].baseline_pph;
+    if(base && !(flow_high_bits[bid]&mask) &&
+       (ulong)flow_seg_rate(now_ms)*100 > (ulong)base*(100+FLOW_ALERT_PERCENT)) {
+      flow_high_bits[bid] |= mask;
+      write_log(LOGDATA_FLOWALERT, os.now_tz());
+    }
+  }
+}
+
+/** Close the current segment and start a new one with the given open stations */
+static void flow_commit_segment(ulong now_ms, const byte *bits) {
+  flow_check_segment(now_ms);
+  if(flow_seg_nopen==0) {
+    // a quiet closed-valve segment clears the leak flag
+    if(flow_seg_leak<FLOW_LEAK_PULSES && now_ms-flow_seg_start>FLOW_LEAK_GRACE_MS) flow_leak = 0;
+  } else {
+    ulong share = flow_seg_pulses / flow_seg_nopen;
+    ulong extra = flow_seg_pulses % flow_seg_nopen;
+    for(byte bid=0;bid<=MAX_EXT_BOARDS;bid++) {
+      byte sbits = flow_seg_bits[bid];
+      for(byte s=0;sbits;s++,sbits>>=1) {
+        if(!(sbits&1)) continue;
+        FlowStationStats *st = flow_stn+(bid<<3)+s;
+        st->pulses += share;
+        if(extra) { st->pulses++; extra--; }
+      }
+    }
+    if(flow_seg_nopen==1 && now_ms-flow_seg_start>=FLOW_MIN_SEGMENT_MS) {
+      FlowStationStats *st = flow_stn+flow_seg_sid;
+      st->rate_pph = flow_seg_rate(now_ms);
+      st->jitter_ms = (flow_jitter_ms>65535UL) ? 65535 : flow_jitter_ms;
+      if((ulong)st->rate_pph*100 <= (ulong)st->baseline_pph*(100+FLOW_ALERT_PERCENT))
+        flow_high_bits[flow_seg_sid>>3] &= ~(1<<(flow_seg_sid&0x07));
+      st->baseline_pph = flow_smooth(st->baseline_pph, st->rate_pph);
+    }
+  }
+  flow_seg_nopen = 0;
+  for(byte bid=0;bid<=MAX_EXT_BOARDS;bid++) {
+    byte sbits = bits[bid];
+    flow_seg_bits[bid] = sbits;
+    for(byte s=0;sbits;s++,sbits>>=1) {
+      if(sbits&1) { flow_seg_nopen++; flow_seg_sid = (bid<<3)+s; }
+    }
+  }
+  flow_seg_start = now_ms;
+  flow_seg_pulses = 0;
+  flow_seg_leak = 0;
+}
+
+/** Drain captured flow pulses
+ * Called from the main loop. Counts each pulse received so far and feeds
+ * it to the RAH gallon counter, then starts a new accounting segment if
+ * the set of open stations has changed.
+ */
+void flow_poll() {
+  uint16_t lost = flow_take_overruns();
+  byte head = flow_ring_head;
+  FLOW_RING_BARRIER();
+  ulong now_ms = millis();  // every pulse up to head is older than this
+  while(flow_ring_tail != head) {
+    ulong curr = flow_ring[flow_ring_tail];
+    FLOW_RING_BARRIER();
+    flow_ring_tail = (flow_ring_tail+1) & (FLOW_RING_SIZE-1);
+    flow_count++;
+
+    /* RAH implementation of flow sensor */
+    if (flow_start==0) { flow_gallons=0; flow_start=curr;}  // if first pulse, record time
+    if ((curr-flow_start)<90000) { flow_gallons=0; } // wait 90 seconds before recording flow_begin
+    else {  if (flow_gallons==1)  {  flow_begin = curr;}}
+    flow_stop = curr; // get time in ms for stop
+    flow_gallons++;  // increment gallon count for each interrupt
+    /* End of RAH implementation of flow sensor */
+
+    if(flow_last_ms) {
+      ulong dt = curr - flow_last_ms;
+      flow_jitter_ms = flow_smooth(flow_jitter_ms, (dt>flow_interval_ms)?(dt-flow_interval_ms):(flow_interval_ms-dt));
+      flow_interval_ms = flow_smooth(flow_interval_ms, dt);
+    }
+    flow_last_ms = curr;
+
+    flow_seg_pulses++;
+    if(!flow_seg_nopen && curr-flow_seg_start>FLOW_LEAK_GRACE_MS) flow_seg_leak++;
+  }
+
+  // pulses without a time stamp still count as volume
+  if(lost) {
+    flow_count += lost;
+    if(flow_start && flow_stop-flow_start>=90000) flow_gallons += lost;
+    flow_seg_pulses += lost;
+    if(!flow_seg_nopen && now_ms-flow_seg_start>FLOW_LEAK_GRACE_MS) flow_seg_leak += lost;
+  }
+
+  // the pulses above belong to the stations that were open until now
+  byte bits[MAX_EXT_BOARDS+1];
+  byte changed = 0;
+  for(byte bid=0;bid<=MAX_EXT_BOARDS;bid++) {
+    bits[bid] = os.station_bits[bid];
+    if(os.status.mas && (os.status.mas-1)>>3==bid) bits[bid] &= ~(1<<((os.status.mas-1)&0x07));
+    if(os.status.mas2 && (os.status.mas2-1)>>3==bid) bits[bid] &= ~(1<<((os.status.mas2-1)&0x07));
+    if(bits[bid]!=flow_seg_bits[bid]) changed = 1;
+  }
+  if(changed) flow_commit_segment(now_ms, bits);
+}
+
+/** Per-second flow check, called from the main loop */
+void flow_check() {
+  if(os.options[OPTION_SENSOR_TYPE]!=SENSOR_TYPE_FLOW) return;
+  flow_check_segment(millis());
+}
+
+/** Current flow rate in 1/100 pulses per minute
+ * If the sensor has been quiet for longer than the usual
+ * interval, the rate decays instead of holding its last value
+ */
+ulong flow_rate_x100() {
+  if(!flow_interval_ms) return 0;
+  ulong interval = flow_interval_ms;
+  ulong idle = millis() - flow_last_ms;
+  if(idle > interval) interval = idle;
+  return 6000000UL / interval;
 }
 
 #if defined(ARDUINO)
@@ -335,6 +544,7 @@ void do_setup() {
   delay(1000);
   os.begin();          // OpenSprinkler init
   os.options_setup();  // Setup options
+  sun_table_build();   // local sunrise/sunset table
 
   pd.init();            // ProgramData init
 
@@ -400,6 +610,7 @@ void do_setup() {
   initialiseEpoch();   // initialize time reference for millis() and micros()
   os.begin();          // OpenSprinkler init
   os.options_setup();  // Setup options
+  sun_table_build();   // local sunrise/sunset table
 
   pd.init();            // ProgramData init
 
@@ -418,9 +629,13 @@ void write_log(byte type, ulong curr_time);
 void schedule_all_stations(ulong curr_time);
 void turn_off_station(byte sid, ulong curr_time);
 void process_dynamic_events(ulong curr_time);
+void masters_update(ulong curr_time);
 void check_network();
+#if defined(ARDUINO) && !defined(ESP8266)
+void net_probe_poll(uint16_t plen);
+#endif
 void check_weather();
-void perform_ntp_sync();
+void perform_ntp_sync(uint16_t plen=0);
 void delete_log(char *name);
 
 #ifdef ESP8266
@@ -477,7 +692,13 @@ void do_loop()
     }
 #endif
 
+#if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+  // ====== Background current sampling ======
+  os.sample_current();
+#endif
 
+  // ====== Drain flow sensor pulses ======
+  flow_poll();
   
   // ====== Process Ethernet packets ======
 #if defined(ARDUINO)  // Process Ethernet packets for Arduino
@@ -544,15 +765,19 @@ void do_loop()
     }
     break;
   }
+  perform_ntp_sync();
   
   #else // AVR
   
-  uint16_t pos=ether.packetLoop(ether.packetReceive());
+  uint16_t plen=ether.packetReceive();
+  uint16_t pos=ether.packetLoop(plen);
   if (pos>0) {  // packet received
     // OPENSPRINKLER_ARDUINO_W5100
     // handle_web_request((char*)Ethernet::buffer+pos);
     handle_web_request((char*)ether.buffer + pos);
   }
+  perform_ntp_sync(pos>0 ? 0 : plen);  // a non-http packet may be the NTP answer
+  net_probe_poll(pos>0 ? 0 : plen);    // or a probe reply
     #ifdef OPENSPRINKLER_ARDUINO_WDT
       wdt_reset();  // reset watchdog timer
       wdt_timeout = 0;
@@ -591,6 +816,8 @@ void do_loop()
 #if defined(ARDUINO)
     if (!ui_state)
       os.lcd_print_time(os.now_tz());       // print time
+#else
+    os.file_cache_watch();
 #endif
 
     // ====== Check raindelay status ======
@@ -653,6 +880,8 @@ void do_loop()
     // we only need to check once every minute
     if (curr_minute != last_minute) {
       last_minute = curr_minute;
+      // refresh locally computed sunrise/sunset (if lat/lon are set)
+      sun_update(curr_time);
       // check through all programs
       for(pid=0; pid<pd.nprograms; pid++) {
         pd.read(pid, &prog);
@@ -682,15 +911,8 @@ void do_loop()
               if (water_time) {
                 // check if water time is still valid
                 // because it may end up being zero after scaling
-                q = pd.enqueue();
-                if (q) {
-                  q->st = 0;
-                  q->dur = water_time;
-                  q->sid = sid;
-                  q->pid = pid+1;
+                if (pd.admit(sid, pid+1, water_time, curr_time) != QUEUE_REJECTED) {
                   match_found = true;
-                } else {
-                  // queue is full
                 }
               }// if water_time
             }// if prog.durations[sid]
@@ -762,6 +984,7 @@ void do_loop()
 
               // RAH implementation of flow sensor
               flow_start=0;
+              flow_stn[sid].pulses = 0;
 
             } //if curr_time > scheduled_start_time
           } // if current station is not running
@@ -777,6 +1000,11 @@ void do_loop()
         }
       }
 
+      // move deferred runs into the freed slots
+      if (pd.ndeferred && pd.admit_deferred()) {
+        schedule_all_stations(curr_time);
+      }
+
       // process dynamic events
       process_dynamic_events(curr_time);
 
@@ -784,7 +1012,8 @@ void do_loop()
       os.apply_all_station_bits();
 
       // check through runtime queue, calculate the last stop time of sequential stations
-      pd.last_seq_stop_time = 0;
+      // in each sequential group
+      memset(pd.last_seq_stop_times, 0, sizeof(ulong)*NUM_SEQ_GROUPS);
       ulong sst;
       byte re=os.options[OPTION_REMOTE_EXT_MODE];
       q = pd.queue;
@@ -796,9 +1025,10 @@ void do_loop()
         // and the stop time must be larger than curr_time
         sst = q->st + q->dur;
         if (sst>curr_time) {
-          // only need to update last_seq_stop_time for sequential stations
+          // only need to update last_seq_stop_times for sequential stations
           if (os.station_attrib_bits_read(ADDR_NVM_STNSEQ+bid)&(1<<s) && !re) {
-            pd.last_seq_stop_time = (sst>pd.last_seq_stop_time ) ? sst : pd.last_seq_stop_time;
+            ulong *lst = pd.last_seq_stop_times+os.seq_group[sid];
+            if (sst>*lst) *lst = sst;
           }
         }
       }
@@ -825,54 +1055,8 @@ void do_loop()
       }
     }//if_some_program_is_running
 
-    // handle master
-    if (os.status.mas>0) {
-      int16_t mas_on_adj = water_time_decode_signed(os.options[OPTION_MASTER_ON_ADJ]);
-      int16_t mas_off_adj= water_time_decode_signed(os.options[OPTION_MASTER_OFF_ADJ]);
-      byte masbit = 0;
-      os.station_attrib_bits_load(ADDR_NVM_MAS_OP, (byte*)tmp_buffer);  // tmp_buffer now stores masop_bits
-      for(sid=0;sid<os.nstations;sid++) {
-        // skip if this is the master station
-        if (os.status.mas == sid+1) continue;
-        bid = sid>>3;
-        s = sid&0x07;
-        // if this station is running and is set to activate master
-        if ((os.station_bits[bid]&(1<<s)) && (tmp_buffer[bid]&(1<<s))) {
-          q=pd.queue+pd.station_qid[sid];
-          // check if timing is within the acceptable range
-          if (curr_time >= q->st + mas_on_adj &&
-              curr_time <= q->st + q->dur + mas_off_adj) {
-            masbit = 1;
-            break;
-          }
-        }
-      }
-      os.set_station_bit(os.status.mas-1, masbit);
-    }
-    // handle master2
-    if (os.status.mas2>0) {
-      int16_t mas_on_adj_2 = water_time_decode_signed(os.options[OPTION_MASTER_ON_ADJ_2]);
-      int16_t mas_off_adj_2= water_time_decode_signed(os.options[OPTION_MASTER_OFF_ADJ_2]);
-      byte masbit2 = 0;
-      os.station_attrib_bits_load(ADDR_NVM_MAS_OP_2, (byte*)tmp_buffer);  // tmp_buffer now stores masop2_bits
-      for(sid=0;sid<os.nstations;sid++) {
-        // skip if this is the master station
-        if (os.status.mas2 == sid+1) continue;
-        bid = sid>>3;
-        s = sid&0x07;
-        // if this station is running and is set to activate master
-        if ((os.station_bits[bid]&(1<<s)) && (tmp_buffer[bid]&(1<<s))) {
-          q=pd.queue+pd.station_qid[sid];
-          // check if timing is within the acceptable range
-          if (curr_time >= q->st + mas_on_adj_2 &&
-              curr_time <= q->st + q->dur + mas_off_adj_2) {
-            masbit2 = 1;
-            break;
-          }
-        }
-      }
-      os.set_station_bit(os.status.mas2-1, masbit2);
-    }    
+    // handle master valves
+    masters_update(curr_time);
 
     // process dynamic events
     process_dynamic_events(curr_time);
@@ -917,13 +1101,13 @@ void do_loop()
         flowcount_rt_start = flow_count;
       }
     }
+    flow_check();
 
     // perform ntp sync
     // instead of using curr_time, which may change due to NTP sync itself
     // we use Arduino's millis() method
     //if (curr_time % NTP_SYNC_INTERVAL == 0) os.status.req_ntpsync = 1;
     if((millis()/1000) % NTP_SYNC_INTERVAL==0) os.status.req_ntpsync = 1;
-    perform_ntp_sync();
 
     // check network connection
     if (curr_time && (curr_time % CHECK_NETWORK_INTERVAL==0))  os.status.req_network = 1;
@@ -947,6 +1131,7 @@ void do_loop()
       reboot_notification = 0;
       push_message(IFTTT_REBOOT);
     }
+    push_message_poll(curr_time);
 
     #ifdef OPENSPRINKLER_ARDUINO_HEARTBEAT
         digitalWrite(PIN_HEARTBEAT, curr_time % 2);
@@ -960,6 +1145,9 @@ void do_loop()
 
 /** Make weather query */
 void check_weather() {
+  // advance a weather request that is in progress
+  weather_poll();
+
   // do not check weather if
   // - network check has failed, or
   // - the controller is in remote extension mode
@@ -988,7 +1176,9 @@ void check_weather() {
  * and writes log record
  */
 void turn_off_station(byte sid, ulong curr_time) {
+  flow_poll();  // account for any pulses received while the station was open
   os.set_station_bit(sid, 0);
+  flow_poll();  // close the flow segment so the station's volume is up to date
 
   byte qid = pd.station_qid[sid];
   // ignore if we are turning off a station that's not running or scheduled to run
@@ -1021,6 +1211,45 @@ void turn_off_station(byte sid, ulong curr_time) {
   pd.station_qid[sid] = 0xFF;
 }
 
+/** Station masks for dynamic events
+ * One bit per station, one byte per board. Rebuilt only when the
+ * station configuration changes (station_cfg_serial), the master stations
+ * in os.status change or the number of boards changes, instead of
+ * re-reading NVM for every station. */
+struct StationMasks {
+  byte serial;    // station_cfg_serial the masks were built from
+  byte nboards;   // number of boards the masks were built for
+  byte mas, mas2; // master stations the masks were built for
+  byte eligible[MAX_EXT_BOARDS+1];  // existing, non-master stations
+  byte ignrain[MAX_EXT_BOARDS+1];   // stations that ignore rain
+  byte disabled[MAX_EXT_BOARDS+1];  // disabled stations
+  byte any_disabled;                // at least one eligible station is disabled
+};
+static StationMasks stn_masks;
+byte station_cfg_serial = 1;  // bumped whenever station attributes or options change
+
+static void station_masks_update() {
+  if (stn_masks.serial == station_cfg_serial && stn_masks.nboards == os.nboards &&
+      stn_masks.mas == os.status.mas && stn_masks.mas2 == os.status.mas2) return;
+  byte bid;
+  os.station_attrib_bits_load(ADDR_NVM_IGNRAIN, stn_masks.ignrain);
+  os.station_attrib_bits_load(ADDR_NVM_STNDISABLE, stn_masks.disabled);
+  stn_masks.any_disabled = 0;
+  for(bid=0;bid<os.nboards;bid++) {
+    stn_masks.eligible[bid] = 0xFF;
+  }
+  // exclude master stations, because they are handled separately
+  if (os.status.mas)  stn_masks.eligible[(os.status.mas-1)>>3]  &= ~(1<<((os.status.mas-1)&0x07));
+  if (os.status.mas2) stn_masks.eligible[(os.status.mas2-1)>>3] &= ~(1<<((os.status.mas2-1)&0x07));
+  for(bid=0;bid<os.nboards;bid++) {
+    stn_masks.any_disabled |= stn_masks.disabled[bid]&stn_masks.eligible[bid];
+  }
+  stn_masks.serial = station_cfg_serial;
+  stn_masks.nboards = os.nboards;
+  stn_masks.mas = os.status.mas;
+  stn_masks.mas2 = os.status.mas2;
+}
+
 /** Process dynamic events
  * such as rain delay, rain sensing
  * and turn off stations accordingly
@@ -1033,28 +1262,247 @@ void process_dynamic_events(ulong curr_time) {
     rain = true;
   }
 
-  byte sid, s, bid, qid, rbits;
+  station_masks_update();
+  // nothing can be stopped while enabled, not raining and no station is disabled
+  if (en && !rain && !stn_masks.any_disabled) return;
+
+  // stations running from a normal program (not a run-once or test program)
+  byte prog[MAX_EXT_BOARDS+1];
+  byte sid, bid, qid;
+  memset(prog, 0, os.nboards);
+  for(qid=0;qid<pd.nqueue;qid++) {
+    RuntimeQueueStruct *q = pd.queue+qid;
+    if (q->pid<99 && pd.station_qid[q->sid]==qid) prog[q->sid>>3] |= 1<<(q->sid&0x07);
+  }
+
+  // stop program stations if the controller is disabled, or if they are
+  // disabled, or if raining and the ignore rain bit is cleared
+  for(bid=0;bid<os.nboards;bid++) {
+    byte stop = prog[bid] & stn_masks.eligible[bid];
+    if (en) stop &= stn_masks.disabled[bid] | (rain ? ~stn_masks.ignrain[bid] : 0);
+    while (stop) {
+      byte s = 0;
+      while (!(stop&(1<<s))) s++;
+      stop &= stop-1;  // clear the lowest set bit
+      sid = (bid<<3)+s;
+      turn_off_station(sid, curr_time);
+    }
+  }
+}
+
+/** Master valve engine
+ * Each master (pump, booster pump, mainline valve) is described by a
+ * row in master_zones: which of os.status.mas/mas2 holds its station, its on/off
+ * adjustment options and the NVM address of its operation bits. Adding
+ * a master only takes another row.
+ * A master's state is re-evaluated over the runtime queue only when the
+ * station bits change, its configuration changes (station_cfg_serial) or the
+ * next on/off boundary is reached; in between the cached state is
+ * applied, so the per-second cost is O(masters). */
+struct MasterZone {
+  byte mas_sel;     // master station taken from os.status.mas (0) or os.status.mas2 (1)
+  byte opt_on_adj;  // option index of the on adjustment
+  byte opt_off_adj; // option index of the off adjustment
+  int  addr_op;     // nvm address of the master operation bits
+};
+
+static const MasterZone master_zones[] = {
+  {0, OPTION_MASTER_ON_ADJ,   OPTION_MASTER_OFF_ADJ,   ADDR_NVM_MAS_OP},
+  {1, OPTION_MASTER_ON_ADJ_2, OPTION_MASTER_OFF_ADJ_2, ADDR_NVM_MAS_OP_2}
+};
+#define NUM_MASTERS (sizeof(master_zones)/sizeof(MasterZone))
+
+struct MasterState {
+  byte sid;         // master station index cached at the last evaluation (1-based)
+  byte on;          // current master state
+  ulong next;       // next time at which the state may change
+  byte op_bits[MAX_EXT_BOARDS+1]; // stations that activate this master
+};
+
+static MasterState masters[NUM_MASTERS];
+static byte masters_sbits[MAX_EXT_BOARDS+1]; // station bits at the last evaluation
+static byte masters_serial = 0;  // station_cfg_serial at the last evaluation
+
+/** Station index (1-based, 0: none) of a master, as the rest of the firmware sees it */
+static byte master_sid(const MasterZone *z) {
+  return z->mas_sel ? os.status.mas2 : os.status.mas;
+}
+
+/** Evaluate one master over the runtime queue */
+static void master_eval(const MasterZone *z, MasterState *ms, ulong curr_time) {
+  int16_t on_adj = water_time_decode_signed(os.options[z->opt_on_adj]);
+  int16_t off_adj= water_time_decode_signed(os.options[z->opt_off_adj]);
+  ms->on = 0;
+  ms->next = 0xFFFFFFFFUL;
+  RuntimeQueueStruct *q = pd.queue;
+  for(byte qi=0;q<pd.queue+pd.nqueue;q++,qi++) {
+    byte sid = q->sid;
+    // skip the master itself, and queue elements not currently assigned to the station
+    if (ms->sid == sid+1 || pd.station_qid[sid] != qi) continue;
+    byte bid = sid>>3, mask = 1<<(sid&0x07);
+    if (!(ms->op_bits[bid]&mask)) continue;
+    ulong on = q->st + on_adj;
+    ulong off= q->st + q->dur + off_adj;
+    // if this station is running, check if timing is within the acceptable range
+    if ((os.station_bits[bid]&mask) && curr_time >= on && curr_time <= off) ms->on = 1;
+    ulong b[4] = {q->st, q->st+q->dur, on, off+1};
+    for(byte i=0;i<4;i++) {
+      if (b[i] > curr_time && b[i] < ms->next) ms->next = b[i];
+    }
+  }
+}
+
+/** Turn master valves on/off according to the running stations */
+void masters_update(ulong curr_time) {
+  byte m, bid;
+  bool changed = false;
   for(bid=0;bid<os.nboards;bid++) {
-    rbits = os.station_attrib_bits_read(ADDR_NVM_IGNRAIN+bid);
-    for(s=0;s<8;s++) {
-      sid=bid*8+s;
-
-      // ignore master stations because they are handled separately      
-      if (os.status.mas == sid+1) continue;
-      if (os.status.mas2== sid+1) continue;      
-      // If this is a normal program (not a run-once or test program)
-      // and either the controller is disabled, or
-      // if raining and ignore rain bit is cleared
-      // FIX ME
-      qid = pd.station_qid[sid];
-      if(qid==255) continue;
-      RuntimeQueueStruct *q = pd.queue + qid;
-
-      if ((q->pid<99) && (!en || (rain && !(rbits&(1<<s)))) ) {
-        turn_off_station(sid, curr_time);
+    if (os.station_bits[bid] != masters_sbits[bid]) changed = true;
+  }
+  for(m=0;m<NUM_MASTERS;m++) {
+    const MasterZone *z = master_zones+m;
+    MasterState *ms = masters+m;
+    byte msid = master_sid(z);
+    if (msid != ms->sid || masters_serial != station_cfg_serial) {
+      ms->sid = msid;
+      os.station_attrib_bits_load(z->addr_op, ms->op_bits);
+      ms->next = 0;
+    }
+    if (!msid) continue;
+    if (changed || curr_time >= ms->next) master_eval(z, ms, curr_time);
+    os.set_station_bit(msid-1, ms->on);
+  }
+  masters_serial = station_cfg_serial;
+  memcpy(masters_sbits, os.station_bits, os.nboards);
+}
+
+/** Lane scheduling
+ * When a flow limit (OPTION_LANE_FLOW_LIMIT) or a current limit
+ * (OPTION_LANE_CURR_LIMIT, boards with current sensing only) is set,
+ * sequential stations are no longer chained one after another. Instead
+ * every queued station gets a weight (its learned flow rate and solenoid
+ * current) and the sequential stations are packed, longest first, at the
+ * earliest time at which the sum of the weights of all stations running
+ * in parallel, concurrent ones included, stays within the limits.
+ * Concurrent stations still start right away; they only take capacity
+ * away from the sequential ones. A station that has not been measured
+ * yet takes the whole capacity.
+ * lane_seq_span / lane_span: makespan (in seconds) of the last batch
+ * with the old sequential plan and with the lane plan */
+#define LANE_FLOW 0
+#define LANE_CURR 1
+ulong lane_seq_span = 0;
+ulong lane_span = 0;
+// per-station weights and the placed intervals as (queue index<<1)|1 for a
+// start and (queue index<<1) for a free time, sorted by time with free times
+// ahead of starts at equal times. Static so the tables stay off the stack
+static uint16_t lane_w[RUNTIME_QUEUE_SIZE][2];
+static byte lane_seq[(RUNTIME_QUEUE_SIZE+7)/8];  // queue elements of sequential stations
+static uint16_t lane_ev[RUNTIME_QUEUE_SIZE*2];
+static uint16_t lane_nev;
+
+/** Weight of a station on one lane dimension, clamped to the capacity */
+static uint16_t lane_weight(byte sid, byte dim, uint16_t cap) {
+  ulong w = 0;
+  if (!cap) return 0;
+  if (dim==LANE_FLOW) {
+    ulong rate = os.options[OPTION_PULSE_RATE_1];
+    rate = (rate<<8)+os.options[OPTION_PULSE_RATE_0];
+    if (!flow_stn[sid].baseline_pph) return cap;
+    w = (ulong)flow_stn[sid].baseline_pph*rate/600; // in 0.1 gal or L per minute
+  }
+#if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+  else {
+    if (!os.curr_signature[sid]) return cap;
+    w = os.curr_signature[sid]/10;  // in 10 mA
+  }
+#endif
+  if (!w) w = 1;
+  return (w>cap) ? cap : (uint16_t)w;
+}
+
+/** Check if queue element i is already placed (running or scheduled) */
+static bool lane_placed(byte i) {
+  RuntimeQueueStruct *p = pd.queue+i;
+  return p->st && p->dur && (lane_w[i][LANE_FLOW]|lane_w[i][LANE_CURR]);
+}
+
+/** Check if queue element i belongs to a sequential station */
+static bool lane_is_seq(byte i) {
+  return lane_seq[i>>3]&(1<<(i&0x07));
+}
+
+/** Time at which queue element q frees its lane
+ * (stop time, plus its group's station delay for a sequential station) */
+static ulong lane_free_time(RuntimeQueueStruct *q, ulong st) {
+  if (!lane_is_seq(q-pd.queue)) return st+q->dur;
+  int16_t delay = os.seq_group_delay_time(os.seq_group[q->sid]);
+  return st+q->dur+((delay>0) ? delay : 0);
+}
+
+static ulong lane_ev_time(uint16_t e) {
+  RuntimeQueueStruct *p = pd.queue+(e>>1);
+  return (e&1) ? p->st : lane_free_time(p, p->st);
+}
+
+/** Insert the two events of placed queue element qi into the sorted list */
+static void lane_ev_insert(byte qi) {
+  byte k;
+  for(k=0;k<2;k++) {
+    uint16_t e = ((uint16_t)qi<<1)|k;
+    ulong t = lane_ev_time(e);
+    uint16_t i = lane_nev++;
+    for(;i>0;i--) {
+      ulong pt = lane_ev_time(lane_ev[i-1]);
+      if (pt<t || (pt==t && (lane_ev[i-1]&1)<=k)) break;
+      lane_ev[i] = lane_ev[i-1];
+    }
+    lane_ev[i] = e;
+  }
+}
+
+/** Earliest time >= start at which queue element qi can run within the lane limits.
+ * One sweep over the sorted events: every segment between two event times
+ * that would overflow a limit (or runs the same station) pushes the
+ * candidate start to the end of that segment */
+static ulong lane_earliest(byte qi, ulong start, const uint16_t *caps) {
+  RuntimeQueueStruct *q = pd.queue+qi;
+  ulong len = lane_free_time(q, 0);
+  ulong load[2] = {0, 0};
+  byte self = 0;
+  ulong c = start;
+  uint16_t k = 0;
+  byte d;
+  while (k<lane_nev) {
+    // apply all events at this time
+    ulong t = lane_ev_time(lane_ev[k]);
+    do {
+      uint16_t e = lane_ev[k];
+      RuntimeQueueStruct *p = pd.queue+(e>>1);
+      for(d=0;d<2;d++) {
+        if (e&1) load[d] += lane_w[e>>1][d];
+        else load[d] -= lane_w[e>>1][d];
+      }
+      if (p->sid==q->sid) {
+        if (e&1) self++;
+        else self--;
       }
+      k++;
+    } while (k<lane_nev && lane_ev_time(lane_ev[k])==t);
+    // the segment [t, next) now has a constant load
+    ulong next = (k<lane_nev) ? lane_ev_time(lane_ev[k]) : 0;
+    if (k<lane_nev && next<=c) continue;  // entirely before the candidate
+    if (c+len<=t) break;                  // the window closed before this segment
+    bool bad = (self>0);
+    for(d=0;d<2;d++) {
+      if (caps[d] && load[d]+lane_w[qi][d]>caps[d]) bad = true;
+    }
+    if (bad) {
+      if (k>=lane_nev) break;  // can't happen: nothing is left running after the last event
+      c = next;
     }
   }
+  return c;
 }
 
 /** Scheduler
@@ -1064,16 +1512,44 @@ void process_dynamic_events(ulong curr_time) {
 void schedule_all_stations(ulong curr_time) {
 
   ulong con_start_time = curr_time + 1;   // concurrent start time
-  ulong seq_start_time = con_start_time;  // sequential start time
-
-  int16_t station_delay = water_time_decode_signed(os.options[OPTION_STATION_DELAY_TIME]);
-  // if the sequential queue has stations running
-  if (pd.last_seq_stop_time > curr_time) {
-    seq_start_time = pd.last_seq_stop_time + station_delay;
+  ulong seq_start_time[NUM_SEQ_GROUPS];   // sequential start time of each group
+  int16_t station_delay[NUM_SEQ_GROUPS];  // station delay of each group
+  byte g;
+
+  for(g=0;g<NUM_SEQ_GROUPS;g++) {
+    station_delay[g] = os.seq_group_delay_time(g);
+    seq_start_time[g] = con_start_time;
+    // if the group's sequential queue has stations running
+    if (pd.last_seq_stop_times[g] > curr_time) {
+      seq_start_time[g] = pd.last_seq_stop_times[g] + station_delay[g];
+    }
   }
 
   RuntimeQueueStruct *q = pd.queue;
   byte re = os.options[OPTION_REMOTE_EXT_MODE];
+  byte qi;
+
+  // lane limits: flow in 0.1 gal or L per minute, current in 10 mA
+  uint16_t caps[2];
+  caps[LANE_FLOW] = (uint16_t)os.options[OPTION_LANE_FLOW_LIMIT]*10;
+  caps[LANE_CURR] = 0;
+#if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+  caps[LANE_CURR] = os.options[OPTION_LANE_CURR_LIMIT];
+#endif
+  bool lanes = (caps[LANE_FLOW] || caps[LANE_CURR]) && !re;
+  byte packed_groups = 0;
+  if (lanes) {
+    // weights of all stations in the queue, including running and concurrent ones
+    memset(lane_seq, 0, sizeof(lane_seq));
+    for(qi=0;qi<pd.nqueue;qi++) {
+      byte sid=pd.queue[qi].sid;
+      if (os.station_attrib_bits_read(ADDR_NVM_STNSEQ+(sid>>3))&(1<<(sid&0x07)))
+        lane_seq[qi>>3] |= 1<<(qi&0x07);
+      lane_w[qi][LANE_FLOW] = lane_weight(sid, LANE_FLOW, caps[LANE_FLOW]);
+      lane_w[qi][LANE_CURR] = lane_weight(sid, LANE_CURR, caps[LANE_CURR]);
+    }
+  }
+
   // go through runtime queue and calculate start time of each station
   for(;q<pd.queue+pd.nqueue;q++) {
     if(q->st) continue; // if this queue element has already been scheduled, skip
@@ -1083,12 +1559,18 @@ void schedule_all_stations(ulong curr_time) {
     byte s=sid&0x07;
 
     // if this is a sequential station and the controller is not in remote extension mode
-    // use sequential scheduling. station delay time apples
+    // use sequential scheduling within the station's group. station delay time apples
     if (os.station_attrib_bits_read(ADDR_NVM_STNSEQ+bid)&(1<<s) && !re) {
-      // sequential scheduling
-      q->st = seq_start_time;
-      seq_start_time += q->dur;
-      seq_start_time += station_delay; // add station delay time
+      g = os.seq_group[sid];
+      if (!lanes) {
+        // sequential scheduling
+        q->st = seq_start_time[g];
+      } else {
+        // packed into lanes below; keep track of what the sequential plan would take
+        packed_groups |= (1<<g);
+      }
+      seq_start_time[g] += q->dur;
+      seq_start_time[g] += station_delay[g]; // add station delay time
     } else {
       // otherwise, concurrent scheduling
       q->st = con_start_time;
@@ -1112,6 +1594,51 @@ void schedule_all_stations(ulong curr_time) {
       }
     }
   }
+
+  if (!lanes) return;
+
+  // sort the stations already placed (running, concurrent or from an earlier batch) once
+  lane_nev = 0;
+  for(qi=0;qi<pd.nqueue;qi++) {
+    if (lane_placed(qi)) lane_ev_insert(qi);
+  }
+
+  // pack the remaining sequential stations, longest first
+  ulong start = curr_time + 1;
+  ulong lane_end = start;
+  for(;;) {
+    byte best = 255;
+    for(qi=0;qi<pd.nqueue;qi++) {
+      q = pd.queue+qi;
+      if (q->st || !q->dur || !lane_is_seq(qi)) continue;
+      if (best==255 || q->dur>pd.queue[best].dur) best = qi;
+    }
+    if (best==255) break;
+    q = pd.queue+best;
+    ulong t = lane_earliest(best, start, caps);
+    q->st = t;
+    lane_ev_insert(best);
+    if (t+q->dur>lane_end) lane_end = t+q->dur;
+    DEBUG_PRINT("[");
+    DEBUG_PRINT(q->sid);
+    DEBUG_PRINT(":");
+    DEBUG_PRINT(q->st);
+    DEBUG_PRINT(",");
+    DEBUG_PRINT(q->dur);
+    DEBUG_PRINT("]");
+    DEBUG_PRINTLN(pd.nqueue);
+  }
+  if (packed_groups) {
+    // the sequential plan ends with the last group to finish
+    ulong seq_end = start;
+    for(g=0;g<NUM_SEQ_GROUPS;g++) {
+      if (!(packed_groups&(1<<g))) continue;
+      ulong e = seq_start_time[g]-station_delay[g];
+      if (e>seq_end) seq_end = e;
+    }
+    lane_seq_span = seq_end-start;
+    lane_span = lane_end-start;
+  }
 }
 
 /** Immediately reset all stations
@@ -1135,6 +1662,8 @@ void reset_all_stations() {
   for(;q<pd.queue+pd.nqueue;q++) {
     q->dur = 0;
   }
+  // drop runs waiting for room in the queue
+  pd.ndeferred = 0;
 }
 
 
@@ -1167,12 +1696,7 @@ void manual_start_program(byte pid, byte uwt) {
       dur = dur * os.options[OPTION_WATER_PERCENTAGE] / 100;
     }
     if(dur>0 && !(os.station_attrib_bits_read(ADDR_NVM_STNDISABLE+bid)&(1<<s))) {
-      RuntimeQueueStruct *q = pd.enqueue();
-      if (q) {
-        q->st = 0;
-        q->dur = dur;
-        q->sid = sid;
-        q->pid = 254;
+      if (pd.admit(sid, 254, dur, os.now_tz()) != QUEUE_REJECTED) {
         match_found = true;
       }
     }
@@ -1192,101 +1716,274 @@ void ip2string(char* str, byte ip[4]) {
   }
 }
 
-void push_message(byte type, uint32_t lval, float fval, const char* sval) {
-
 #if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
 
-  static const char* server = DEFAULT_IFTTT_URL;
-  static char key[IFTTT_KEY_MAXSIZE];
-  static char postval[TMP_BUFFER_SIZE];
+/* ====== Push notification outbox ======
+ * push_message() only appends a compact record to the outbox; the
+ * messages are rendered and sent by push_message_poll() from the main loop,
+ * one POST at a time. The outbox is mirrored to IFTTT_QUEUE_FILENAME
+ * (hex encoded, fixed size slots) so that pending messages and the retry
+ * backoff survive a reboot. Station-close events from the same minute are
+ * held until the minute is over and then batched into a single POST. */
+#define PUSH_QUEUE_SIZE     8     // number of outbox slots
+#define PUSH_TIMEOUT        5     // response timeout (in seconds)
+#define PUSH_RETRY_BASE     30    // first retry delay (in seconds)
+#define PUSH_RETRY_MAX      3600  // maximum retry delay (in seconds)
+#define PUSH_RETRY_LIMIT    8     // number of attempts before a message is dropped
+#define PUSH_FLAG_MANUAL    0x01  // program was scheduled manually
+
+struct PushRecord {
+  ulong time;     // event time
+  ulong lval;
+  long  ival;     // rounded fval
+  uint16_t aux;   // flow rate x100 (station runs)
+  byte type;
+  byte flags;
+};
+
+struct PushHeader {
+  byte head;      // slot of the oldest record
+  byte n;         // number of queued records
+  byte attempts;  // failed attempts for the record at head
+  byte loaded;    // (RAM only) outbox has been read from file
+  ulong retry_at; // earliest time for the next attempt
+};
+
+static PushHeader push_hdr;
+static PushRecord push_queue[PUSH_QUEUE_SIZE];
+
+#define PUSH_STATE_IDLE     0
+#define PUSH_STATE_WAIT     1
+static byte push_state = PUSH_STATE_IDLE;
+static byte push_sent = 0;      // number of records covered by the POST in flight
+static ulong push_timeout = 0;
+#if defined(ARDUINO) && !defined(ESP8266)
+static byte push_acked = 0;
+#elif defined(ESP8266)
+static WiFiClient push_client;
+#else
+static EthernetClient push_client;
+#endif
+
+static char push_hexchar(byte v) {
+  return (v<10) ? '0'+v : 'a'+(v-10);
+}
+
+static int push_hexval(char c) {
+  if(c>='0' && c<='9') return c-'0';
+  c |= 0x20;
+  if(c>='a' && c<='f') return c-'a'+10;
+  return -1;
+}
+
+/** Write a block to the outbox file, hex encoded */
+static void push_store(const void* data, byte size, int pos) {
+  char buf[2*sizeof(PushRecord)+1];
+  const byte* p = (const byte*)data;
+  for(byte i=0;i<size;i++) {
+    buf[2*i]   = push_hexchar(p[i]>>4);
+    buf[2*i+1] = push_hexchar(p[i]&0x0F);
+  }
+  buf[2*size] = 0;
+  write_to_file(ifqueue_filename, buf, 2*size, 2*pos, false);
+}
+
+/** Read a hex encoded block from the outbox file */
+static bool push_fetch(void* data, byte size, int pos) {
+  char buf[2*sizeof(PushRecord)+2];
+  buf[0] = 0;
+  read_from_file(ifqueue_filename, buf, 2*size+1, 2*pos);
+  if(strlen(buf)!=2*size) return false;
+  byte* p = (byte*)data;
+  for(byte i=0;i<size;i++) {
+    int h = push_hexval(buf[2*i]), l = push_hexval(buf[2*i+1]);
+    if(h<0 || l<0) return false;
+    p[i] = (h<<4) | l;
+  }
+  return true;
+}
+
+#define PUSH_HDR_POS     0
+#define PUSH_REC_POS(i)  (sizeof(PushHeader)+(i)*sizeof(PushRecord))
+
+static void push_save_header() {
+  push_store(&push_hdr, sizeof(PushHeader), PUSH_HDR_POS);
+}
+
+/** Load the outbox from file on first use */
+static void push_load() {
+  if(push_hdr.loaded) return;
+  if(!push_fetch(&push_hdr, sizeof(PushHeader), PUSH_HDR_POS) ||
+     push_hdr.head>=PUSH_QUEUE_SIZE || push_hdr.n>PUSH_QUEUE_SIZE) {
+    // no (valid) outbox yet: lay out the file at its full size
+    memset(&push_hdr, 0, sizeof(PushHeader));
+    memset(push_queue, 0, sizeof(push_queue));
+    push_save_header();
+    for(byte i=0;i<PUSH_QUEUE_SIZE;i++) {
+      push_store(&push_queue[i], sizeof(PushRecord), PUSH_REC_POS(i));
+    }
+  }
+  byte i;
+  for(i=0;i<push_hdr.n;i++) {
+    byte slot = (push_hdr.head+i)%PUSH_QUEUE_SIZE;
+    if(!push_fetch(&push_queue[slot], sizeof(PushRecord), PUSH_REC_POS(slot))) break;
+  }
+  push_hdr.n = i;  // drop anything after a damaged slot
+  push_hdr.loaded = 1;
+}
+
+/** Remove n records from the head of the outbox */
+static void push_dequeue(byte n) {
+  if(n>push_hdr.n) n = push_hdr.n;
+  push_hdr.head = (push_hdr.head+n)%PUSH_QUEUE_SIZE;
+  push_hdr.n -= n;
+  push_hdr.attempts = 0;
+  push_hdr.retry_at = 0;
+  push_save_header();
+}
+
+/** Record a failed attempt and back off */
+static void push_failed() {
+  if(++push_hdr.attempts>=PUSH_RETRY_LIMIT) {
+    DEBUG_PRINTLN(F("push: message dropped"));
+    push_dequeue(push_sent);
+    return;
+  }
+  ulong delay = (ulong)PUSH_RETRY_BASE<<(push_hdr.attempts-1);
+  if(delay>PUSH_RETRY_MAX) delay = PUSH_RETRY_MAX;
+  push_hdr.retry_at = os.now_tz()+delay;
+  push_save_header();
+}
+
+void push_message(byte type, uint32_t lval, float fval, const char* sval) {
 
   // check if this type of event is enabled for push notification
   if((os.options[OPTION_IFTTT_ENABLE]&type) == 0) return;
-  key[0] = 0;
-  read_from_file(ifkey_filename, key);
-  key[IFTTT_KEY_MAXSIZE-1]=0;
+  push_load();
 
-  if(strlen(key)==0) return;
+  if(push_hdr.n==PUSH_QUEUE_SIZE) {
+    // outbox is full: drop the oldest record, unless it is in flight
+    if(push_state==PUSH_STATE_WAIT) return;
+    push_dequeue(1);
+  }
+  byte slot = (push_hdr.head+push_hdr.n)%PUSH_QUEUE_SIZE;
+  PushRecord *r = push_queue+slot;
+  r->time = os.now_tz();
+  r->lval = lval;
+  r->ival = (fval<0) ? (long)(fval-0.5f) : (long)(fval+0.5f);
+  r->aux  = (type==IFTTT_STATION_RUN) ? (uint16_t)(flow_last_gpm*100) : 0;
+  r->type = type;
+  r->flags = sval ? PUSH_FLAG_MANUAL : 0;
+  push_store(r, sizeof(PushRecord), PUSH_REC_POS(slot));
+  push_hdr.n++;
+  push_save_header();
+}
 
-  #if defined(ARDUINO) && !defined(ESP8266)
-    uint16_t _port = ether.hisport; // make a copy of the original port
-    ether.hisport = 80;
-  #endif
+/** Render the message at the head of the outbox
+ * Returns the number of records covered by the message */
+static byte push_render(char* postval, ulong curr_time) {
+  const PushRecord *r = push_queue+push_hdr.head;
+  byte used = 1;
 
   strcpy_P(postval, PSTR("{\"value1\":\""));
 
-  switch(type) {
+  switch(r->type) {
 
     case IFTTT_STATION_RUN:
-      
-      strcat_P(postval, PSTR("Station "));
-      os.get_station_name(lval, postval+strlen(postval));
-      strcat_P(postval, PSTR(" closed. It ran for "));
-      itoa((int)fval/60, postval+strlen(postval), 10);
-      strcat_P(postval, PSTR(" minutes "));
-      itoa((int)fval%60, postval+strlen(postval), 10);
-      strcat_P(postval, PSTR(" seconds."));
-      if(os.options[OPTION_SENSOR_TYPE]==SENSOR_TYPE_FLOW) {
-        strcat_P(postval, PSTR(" Flow rate: "));
-        #if defined(ARDUINO)
-        dtostrf(flow_last_gpm,5,2,postval+strlen(postval));
-        #else
-        sprintf(tmp_buffer+strlen(tmp_buffer), "%5.2f", flow_last_gpm);
-        #endif
+      {
+      // batch the station-close events of the same minute
+      byte cnt = 1;
+      while(cnt<push_hdr.n) {
+        const PushRecord *q = push_queue+(push_hdr.head+cnt)%PUSH_QUEUE_SIZE;
+        if(q->type!=IFTTT_STATION_RUN || q->time/60!=r->time/60) break;
+        cnt++;
+      }
+      if(cnt==1) {
+        strcat_P(postval, PSTR("Station "));
+        os.get_station_name(r->lval, postval+strlen(postval));
+        strcat_P(postval, PSTR(" closed. It ran for "));
+        itoa((int)(r->ival/60), postval+strlen(postval), 10);
+        strcat_P(postval, PSTR(" minutes "));
+        itoa((int)(r->ival%60), postval+strlen(postval), 10);
+        strcat_P(postval, PSTR(" seconds."));
+        if(os.options[OPTION_SENSOR_TYPE]==SENSOR_TYPE_FLOW) {
+          strcat_P(postval, PSTR(" Flow rate: "));
+          itoa(r->aux/100, postval+strlen(postval), 10);
+          strcat(postval, ".");
+          if(r->aux%100<10) strcat(postval, "0");
+          itoa(r->aux%100, postval+strlen(postval), 10);
+        }
+        break;
+      }
+      strcat_P(postval, PSTR("Stations closed:"));
+      for(used=0;used<cnt;used++) {
+        const PushRecord *q = push_queue+(push_hdr.head+used)%PUSH_QUEUE_SIZE;
+        char *p = postval+strlen(postval);
+        // leave room for the entry (station name + run time) and the closing characters
+        if(p-postval+STATION_NAME_SIZE+16>TMP_BUFFER_SIZE) break;
+        strcpy_P(p, used?PSTR(", "):PSTR(" "));
+        os.get_station_name(q->lval, postval+strlen(postval));
+        strcat_P(postval, PSTR(" ("));
+        itoa((int)(q->ival/60), postval+strlen(postval), 10);
+        strcat_P(postval, PSTR("m "));
+        itoa((int)(q->ival%60), postval+strlen(postval), 10);
+        strcat_P(postval, PSTR("s)"));
+      }
+      strcat(postval, ".");
       }
       break;
 
     case IFTTT_PROGRAM_SCHED:
 
-      if(sval) strcat_P(postval, PSTR("Manually scheduled "));
+      if(r->flags&PUSH_FLAG_MANUAL) strcat_P(postval, PSTR("Manually scheduled "));
       else strcat_P(postval, PSTR("Automatically scheduled "));
       strcat_P(postval, PSTR("Program "));
       {
         ProgramStruct prog;
-        pd.read(lval, &prog);
-        if(lval<pd.nprograms) strcat(postval, prog.name);
+        pd.read(r->lval, &prog);
+        if(r->lval<pd.nprograms) strcat(postval, prog.name);
       }
       strcat_P(postval, PSTR(" with "));
-      itoa((int)fval, postval+strlen(postval), 10);
+      itoa((int)r->ival, postval+strlen(postval), 10);
       strcat_P(postval, PSTR("% water level."));
       break;
 
     case IFTTT_RAINSENSOR:
 
-      strcat_P(postval, (lval==LOGDATA_RAINDELAY) ? PSTR("Rain delay ") : PSTR("Rain sensor "));
-      strcat_P(postval, ((int)fval)?PSTR("activated."):PSTR("de-activated"));
+      strcat_P(postval, (r->lval==LOGDATA_RAINDELAY) ? PSTR("Rain delay ") : PSTR("Rain sensor "));
+      strcat_P(postval, (r->ival)?PSTR("activated."):PSTR("de-activated"));
 
       break;
 
     case IFTTT_FLOWSENSOR:
       strcat_P(postval, PSTR("Flow count: "));
-      itoa(lval, postval+strlen(postval), 10);
+      ultoa(r->lval, postval+strlen(postval), 10);
       strcat_P(postval, PSTR(", volume: "));
       {
       uint32_t volume = os.options[OPTION_PULSE_RATE_1];
       volume = (volume<<8)+os.options[OPTION_PULSE_RATE_0];
-      volume = lval*volume;
-      itoa(volume/100, postval+strlen(postval), 10);
+      volume = r->lval*volume;
+      ultoa(volume/100, postval+strlen(postval), 10);
       strcat(postval, ".");
       itoa(volume%100, postval+strlen(postval), 10);
       }
       break;
 
     case IFTTT_WEATHER_UPDATE:
-      if(lval>0) {
+      if(r->lval>0) {
         strcat_P(postval, PSTR("External IP updated: "));
-        byte ip[4] = {(byte)((lval>>24)&0xFF),
-                      (byte)((lval>>16)&0xFF),
-                      (byte)((lval>>8)&0xFF),
-                      (byte)(lval&0xFF)};
+        byte ip[4] = {(byte)((r->lval>>24)&0xFF),
+                      (byte)((r->lval>>16)&0xFF),
+                      (byte)((r->lval>>8)&0xFF),
+                      (byte)(r->lval&0xFF)};
         ip2string(postval, ip);
       }
-      if(fval>=0) {
+      if(r->ival>=0) {
         strcat_P(postval, PSTR("Water level updated: "));
-        itoa((int)fval, postval+strlen(postval), 10);
+        itoa((int)r->ival, postval+strlen(postval), 10);
         strcat_P(postval, PSTR("%."));
       }
-        
+
       break;
 
     case IFTTT_REBOOT:
@@ -1301,8 +1998,6 @@ void push_message(byte type, uint32_t lval, float fval, const char* sval) {
         #else
         ip2string(postval, ether.myip);
         #endif
-        //strcat(postval, ":");
-        //itoa(_port, postval+strlen(postval), 10);
       #else
         strcat_P(postval, PSTR("Process restarted."));
       #endif
@@ -1310,15 +2005,90 @@ void push_message(byte type, uint32_t lval, float fval, const char* sval) {
   }
 
   strcat_P(postval, PSTR("\"}"));
+  return used;
+}
+
+#if defined(ARDUINO) && !defined(ESP8266)
+static void push_callback(byte status, uint16_t off, uint16_t len) {
+  push_acked = 1;
+}
+#endif
+
+/** Check if a push POST is waiting for its reply */
+bool push_busy() {
+  return push_state==PUSH_STATE_WAIT;
+}
+
+#else
+
+void push_message(byte type, uint32_t lval, float fval, const char* sval) {}
+bool push_busy() { return false; }
+
+#endif
+
+/** Background step of the push notification outbox
+ * Called once per second. Starts at most one POST per call and never
+ * waits for the response: the reply (or timeout) is picked up by a later call. */
+void push_message_poll(ulong curr_time) {
+
+#if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+
+  static const char* server = DEFAULT_IFTTT_URL;
+  static char postval[TMP_BUFFER_SIZE];
+
+  push_load();
+
+  if(push_state==PUSH_STATE_WAIT) {
+    bool done;
+    #if defined(ARDUINO) && !defined(ESP8266)
+    done = push_acked;
+    #else
+    done = push_client.available()>0;
+    if(done) {
+      while(push_client.available() && push_client.read((uint8_t*)ether_buffer, ETHER_BUFFER_SIZE)>0) {}
+    }
+    #endif
+    if(done || curr_time>=push_timeout) {
+      #if !defined(ARDUINO) || defined(ESP8266)
+      push_client.stop();
+      #endif
+      push_state = PUSH_STATE_IDLE;
+      if(done) push_dequeue(push_sent);
+      else push_failed();
+    }
+    return;
+  }
 
-  //DEBUG_PRINTLN(postval);
+  if(!push_hdr.n) return;
+  #if defined(ARDUINO) && !defined(ESP8266)
+  // EtherCard has a single outgoing client: let the weather request finish first
+  if(weather_diag.state!=WEATHER_STATE_IDLE) return;
+  #endif
+  // a clock step backwards must not stall the outbox
+  if(push_hdr.retry_at>curr_time+PUSH_RETRY_MAX) push_hdr.retry_at = curr_time;
+  if(curr_time<push_hdr.retry_at) return;
+  // hold station-close events until their minute is over, so they can be batched
+  const PushRecord *r = push_queue+push_hdr.head;
+  if(r->type==IFTTT_STATION_RUN && r->time/60==curr_time/60) return;
+
+  char *key = os.get_ifkey();
+  if(strlen(key)==0) {
+    // nowhere to deliver the messages
+    push_dequeue(push_hdr.n);
+    return;
+  }
+
+  push_sent = push_render(postval, curr_time);
+  push_timeout = curr_time+PUSH_TIMEOUT;
 
 #if defined(ARDUINO)
 
   #ifdef ESP8266
-  WiFiClient client;
-  if(!client.connect(server, 80)) return;
-  
+  if(!push_client.connect(server, 80)) {
+    push_failed();
+    return;
+  }
+
   char postBuffer[1500];
   sprintf(postBuffer, "POST /trigger/sprinkler/with/key/%s HTTP/1.0\r\n"
                       "Host: %s\r\n"
@@ -1326,48 +2096,46 @@ void push_message(byte type, uint32_t lval, float fval, const char* sval) {
                       "Content-Length: %d\r\n"
                       "Content-Type: application/json\r\n"
                       "\r\n%s", key, server, strlen(postval), postval);
-  client.write((uint8_t *)postBuffer, strlen(postBuffer));
-
-  time_t timeout = os.now_tz() + 5; // 5 seconds timeout
-  while(!client.available() && os.now_tz() < timeout) {
-  }
+  push_client.write((uint8_t *)postBuffer, strlen(postBuffer));
 
-  bzero(ether_buffer, ETHER_BUFFER_SIZE);
-  
-  while(client.available()) {
-    client.read((uint8_t*)ether_buffer, ETHER_BUFFER_SIZE);
-  }
-  client.stop();
-  //DEBUG_PRINTLN(ether_buffer);
-    
   #else
-  if(!ether.dnsLookup(server, true)) {
-    // if DNS lookup fails, use default IP
-    ether.hisip[0] = 54;
-    ether.hisip[1] = 172;
-    ether.hisip[2] = 244;
-    ether.hisip[3] = 116;
+  // resolve the server once; the reply is picked up by the main loop's packetLoop
+  static byte push_ip[4] = {0,0,0,0};
+  if(!push_ip[0]) {
+    if(ether.dnsLookup(server, true)) {
+      memcpy(push_ip, ether.hisip, 4);
+    } else {
+      // if DNS lookup fails, use default IP
+      push_ip[0] = 54;
+      push_ip[1] = 172;
+      push_ip[2] = 244;
+      push_ip[3] = 116;
+    }
   }
+  memcpy(ether.hisip, push_ip, 4);
 
-  ether.httpPostVar(PSTR("/trigger/sprinkler/with/key/"), PSTR(DEFAULT_IFTTT_URL), key, postval, httpget_callback);
-  for(int l=0;l<100;l++)  ether.packetLoop(ether.packetReceive());
+  uint16_t _port = ether.hisport; // make a copy of the original port
+  ether.hisport = 80;
+  push_acked = 0;
+  ether.httpPostVar(PSTR("/trigger/sprinkler/with/key/"), PSTR(DEFAULT_IFTTT_URL), key, postval, push_callback);
   ether.hisport = _port;
   #endif
-  
+
 #else
 
-  EthernetClient client;
   struct hostent *host;
 
   host = gethostbyname(server);
   if (!host) {
     DEBUG_PRINT("can't resolve http station - ");
     DEBUG_PRINTLN(server);
+    push_failed();
     return;
   }
 
-  if (!client.connect((uint8_t*)host->h_addr, 80)) {
-    client.stop();
+  if (!push_client.connect((uint8_t*)host->h_addr, 80)) {
+    push_client.stop();
+    push_failed();
     return;
   }
 
@@ -1378,26 +2146,12 @@ void push_message(byte type, uint32_t lval, float fval, const char* sval) {
                       "Content-Length: %d\r\n"
                       "Content-Type: application/json\r\n"
                       "\r\n%s", key, host->h_name, strlen(postval), postval);
-  client.write((uint8_t *)postBuffer, strlen(postBuffer));
+  push_client.write((uint8_t *)postBuffer, strlen(postBuffer));
 
-  bzero(ether_buffer, ETHER_BUFFER_SIZE);
-
-  time_t timeout = now() + 5; // 5 seconds timeout
-  while(now() < timeout) {
-    int len=client.read((uint8_t *)ether_buffer, ETHER_BUFFER_SIZE);
-    if (len<=0) {
-      if(!client.connected())
-        break;
-      else
-        continue;
-    }
-    httpget_callback(0, 0, ETHER_BUFFER_SIZE);
-  }
+#endif
 
-  client.stop();
+  push_state = PUSH_STATE_WAIT;
 
-#endif
-  
 #endif
 }
 
@@ -1435,13 +2189,119 @@ static const char log_type_names[] PROGMEM =
     "rs\0"
     "rd\0"
     "wl\0"
-    "fl\0";
+    "fl\0"
+    "fa\0";
+
+/** Daily rollup buffer: the current log day, also borrowed by /jr to read other days */
+DayRollup rollup;
+static bool rollup_new = false;  // the rollup has not been stored as a whole yet
+
+/** Generate rollup file name (logs/xxxxx.sum) */
+void make_rollup_name(ulong day) {
+  ultoa(day, tmp_buffer, 10);
+  make_logfile_name(tmp_buffer);
+  strcpy_P(tmp_buffer+strlen(tmp_buffer)-3, PSTR("sum"));
+}
+
+/** Read the stored rollup of a day into the rollup buffer
+ * Returns false (and leaves no day loaded) if the day has no (valid) rollup
+ */
+bool read_rollup(ulong day) {
+  make_rollup_name(day);
+  int n = 0;
+#if defined(ARDUINO)
+  if (!os.status.has_sd)  { rollup.day = 0; return false; }
+  #ifdef ESP8266
+  File file = SPIFFS.open(tmp_buffer, "r");
+  if(file) {
+    n = file.read((byte*)&rollup, sizeof(DayRollup));
+    file.close();
+  }
+  #else
+  SdFile file;
+  if(file.open(tmp_buffer, O_READ)) {
+    n = file.read(&rollup, sizeof(DayRollup));
+    file.close();
+  }
+  #endif
+#else
+  FILE *file = fopen(get_filename_fullpath(tmp_buffer), "rb");
+  if(file) {
+    n = fread(&rollup, 1, sizeof(DayRollup), file);
+    fclose(file);
+  }
+#endif
+  if (n == sizeof(DayRollup) && rollup.day == day)  return true;
+  rollup.day = 0;
+  return false;
+}
+
+/** Load the rollup of a day into RAM, or start a new one */
+static void rollup_load(ulong day) {
+  if (rollup.day == day)  return;
+  rollup_new = false;
+  if (!read_rollup(day)) {
+    memset(&rollup, 0, sizeof(DayRollup));
+    rollup.day = day;
+    rollup.wl = 255;  // no water level record yet
+    rollup_new = true;
+  }
+}
+
+/** Store the changed fields of the RAM rollup (the log folder already exists)
+ * A new rollup is written as a whole, otherwise only field (and field2) are
+ * rewritten in place */
+static void rollup_save(const void *field, byte n, const void *field2=NULL, byte n2=0) {
+  make_rollup_name(rollup.day);
+  if (rollup_new) {
+    field = &rollup;
+    n = sizeof(DayRollup);
+    field2 = NULL;
+  }
+  uint16_t off = (const byte*)field-(const byte*)&rollup;
+  uint16_t off2 = field2 ? (const byte*)field2-(const byte*)&rollup : 0;
+#if defined(ARDUINO)
+  #ifdef ESP8266
+  File file = SPIFFS.open(tmp_buffer, rollup_new ? "w" : "r+");
+  if(!file) return;
+  file.seek(off, SeekSet);
+  file.write((const byte*)field, n);
+  if (field2) {
+    file.seek(off2, SeekSet);
+    file.write((const byte*)field2, n2);
+  }
+  #else
+  SdFile file;
+  if(!file.open(tmp_buffer, rollup_new ? (O_CREAT | O_WRITE | O_TRUNC) : O_WRITE)) return;
+  file.seekSet(off);
+  file.write(field, n);
+  if (field2) {
+    file.seekSet(off2);
+    file.write(field2, n2);
+  }
+  #endif
+  file.close();
+#else
+  FILE *file = fopen(get_filename_fullpath(tmp_buffer), rollup_new ? "wb" : "rb+");
+  if(!file) return;
+  fseek(file, off, SEEK_SET);
+  fwrite(field, 1, n, file);
+  if (field2) {
+    fseek(file, off2, SEEK_SET);
+    fwrite(field2, 1, n2, file);
+  }
+  fclose(file);
+#endif
+  rollup_new = false;
+}
 
 /** write run record to log on SD card */
 void write_log(byte type, ulong curr_time) {
 
   if (!os.options[OPTION_ENABLE_LOGGING]) return;
 
+  rollup_load(curr_time / 86400);
+
   // file name will be logs/xxxxx.tx where xxxxx is the day in epoch time
   ultoa(curr_time / 86400, tmp_buffer, 10);
   make_logfile_name(tmp_buffer);
@@ -1492,6 +2352,8 @@ void write_log(byte type, ulong curr_time) {
   
   // Step 2: prepare data buffer
   strcpy_P(tmp_buffer, PSTR("["));
+  void *changed = NULL;  // rollup field changed by this record
+  byte nchanged = 0;
 
   if(type == LOGDATA_STATION) {
     itoa(pd.lastrun.program, tmp_buffer+strlen(tmp_buffer), 10);
@@ -1500,10 +2362,25 @@ void write_log(byte type, ulong curr_time) {
     strcat_P(tmp_buffer, PSTR(","));
     // duration is unsigned integer
     ultoa((ulong)pd.lastrun.duration, tmp_buffer+strlen(tmp_buffer), 10);
+    if (pd.lastrun.station < MAX_NUM_STATIONS) {
+      rollup.run_secs[pd.lastrun.station] += pd.lastrun.duration;
+      rollup.runs[pd.lastrun.station]++;
+      changed = rollup.run_secs+pd.lastrun.station;
+      nchanged = sizeof(ulong);
+    }
   } else {
     ulong lvalue;
     if(type==LOGDATA_FLOWSENSE) {
       lvalue = (flow_count>os.flowcount_log_start)?(flow_count-os.flowcount_log_start):0;
+      rollup.flow += lvalue;
+      changed = &rollup.flow;
+      nchanged = sizeof(rollup.flow);
+    } else if(type==LOGDATA_FLOWALERT) {
+      rollup.alerts++;
+      changed = &rollup.alerts;
+      nchanged = sizeof(rollup.alerts);
+      // leak: pulses seen with all valves closed; otherwise: measured rate (pulses per hour)
+      lvalue = flow_seg_nopen ? flow_seg_rate(millis()) : flow_seg_leak;
     } else {
       lvalue = 0;
     }
@@ -1523,6 +2400,23 @@ void write_log(byte type, ulong curr_time) {
       case LOGDATA_WATERLEVEL:
         lvalue = os.options[OPTION_WATER_PERCENTAGE];
         break;
+      case LOGDATA_FLOWALERT:
+        // station index (1-based) running above its baseline, or 0 for a leak
+        lvalue = flow_seg_nopen ? flow_seg_sid+1 : 0;
+        break;
+    }
+    if (type==LOGDATA_RAINSENSE) {
+      rollup.rs_secs += lvalue;
+      changed = &rollup.rs_secs;
+      nchanged = sizeof(rollup.rs_secs);
+    } else if (type==LOGDATA_RAINDELAY) {
+      rollup.rd_secs += lvalue;
+      changed = &rollup.rd_secs;
+      nchanged = sizeof(rollup.rd_secs);
+    } else if (type==LOGDATA_WATERLEVEL) {
+      rollup.wl = lvalue;
+      changed = &rollup.wl;
+      nchanged = sizeof(rollup.wl);
     }
     ultoa(lvalue, tmp_buffer+strlen(tmp_buffer), 10);
   }
@@ -1536,6 +2430,9 @@ void write_log(byte type, ulong curr_time) {
     #else
     sprintf(tmp_buffer+strlen(tmp_buffer), "%5.2f", flow_last_gpm);
     #endif
+    // flow pulses attributed to the station during this run
+    strcat_P(tmp_buffer, PSTR(","));
+    ultoa(flow_stn[pd.lastrun.station].pulses, tmp_buffer+strlen(tmp_buffer), 10);
   }
   strcat_P(tmp_buffer, PSTR("]\r\n"));
 
@@ -1550,6 +2447,12 @@ void write_log(byte type, ulong curr_time) {
   fwrite(tmp_buffer, 1, strlen(tmp_buffer), file);
   fclose(file);
 #endif
+
+  if (type == LOGDATA_STATION && changed) {
+    rollup_save(changed, nchanged, rollup.runs+pd.lastrun.station, sizeof(uint16_t));
+  } else if (changed || rollup_new) {
+    rollup_save(changed, nchanged);
+  }
 }
 
 
@@ -1558,6 +2461,7 @@ void write_log(byte type, ulong curr_time) {
  */
 void delete_log(char *name) {
   if (!os.options[OPTION_ENABLE_LOGGING]) return;
+  rollup.day = 0;  // reload the rollup on the next record
 #if defined(ARDUINO)
   if (!os.status.has_sd) return;
 
@@ -1570,8 +2474,10 @@ void delete_log(char *name) {
     }
   } else {
     // delete a single log file
+    ulong day = atol(name);  // name may live in tmp_buffer
     make_logfile_name(name);
-    if(!SPIFFS.exists(tmp_buffer)) return;
+    SPIFFS.remove(tmp_buffer);
+    make_rollup_name(day);
     SPIFFS.remove(tmp_buffer);
   }
   #else
@@ -1585,9 +2491,11 @@ void delete_log(char *name) {
     }
   } else {
     // delete a single log file
+    ulong day = atol(name);  // name may live in tmp_buffer
     make_logfile_name(name);
-    if (!sd.exists(tmp_buffer))  return;
-    sd.remove(tmp_buffer);
+    if (sd.exists(tmp_buffer))  sd.remove(tmp_buffer);
+    make_rollup_name(day);
+    if (sd.exists(tmp_buffer))  sd.remove(tmp_buffer);
   }
   #endif
   
@@ -1597,8 +2505,11 @@ void delete_log(char *name) {
     rmdir(get_filename_fullpath(LOG_PREFIX));
     return;
   } else {
+    ulong day = atol(name);  // name may live in tmp_buffer
     make_logfile_name(name);
     remove(get_filename_fullpath(tmp_buffer));
+    make_rollup_name(day);
+    remove(get_filename_fullpath(tmp_buffer));
   }
 #endif
 }
@@ -1608,88 +2519,247 @@ void delete_log(char *name) {
  * to check if it's still online.
  * If not, it re-initializes Ethernet controller.
  */
-void check_network() {
 #if defined(ARDUINO) && !defined(ESP8266)
-  // do not perform network checking if the controller has just started, or if a program is running
-  if (os.status.program_busy) {return;}
+/* ====== Network health probe ======
+ * One ICMP echo is sent every NET_PROBE_INTERVAL seconds, alternating between
+ * the gateway and the other targets (weather host, remote-extension peers).
+ * net_probe_poll() picks up the reply or the timeout without waiting, so the
+ * probe also runs while a program is busy. Each target keeps the results of its
+ * last NET_WINDOW probes and a smoothed round trip time; the reconnect decision
+ * is taken from the gateway window. As before, a safe reboot follows only after
+ * the gateway has been unreachable for about an hour (NET_REBOOT_DOWNTIME). */
+#define NET_WINDOW          16    // probe results kept per target
+#define NET_PROBE_INTERVAL  30    // seconds between probes
+#define NET_PROBE_TIMEOUT   1000  // reply timeout (in ms)
+#define NET_RECONNECT_HOLDOFF 600 // minimum time between reconnects (in seconds)
+#define NET_REBOOT_DOWNTIME (6UL*CHECK_NETWORK_INTERVAL) // gateway loss that triggers a safe reboot (in seconds)
+
+NetTarget net_targets[NET_NUM_TARGETS];
+static byte net_probe_target = 255;   // target of the probe in flight (255: none)
+static byte net_probe_next = NET_TARGET_WEATHER;
+static ulong net_probe_start = 0;
+static ulong net_reconnect_time = 0;
+static ulong net_probe_last = 0;      // millis() of the last probe
+static ulong net_down_since = 0;      // millis() of the first gateway loss in a row (0: gateway up)
+
+/** Number of lost probes in a target's window */
+byte net_losses(const NetTarget *t) {
+  uint16_t bits = t->lost;
+  if (t->n<NET_WINDOW) bits &= (1<<t->n)-1;
+  byte c = 0;
+  for (; bits; bits&=bits-1) c++;
+  return c;
+}
 
-  // check network condition periodically
-  if (os.status.req_network) {
-    os.status.req_network = 0;
-    // change LCD icon to indicate it's checking network
-    if (!ui_state) {
-      os.lcd.setCursor(15, 1);
-      os.lcd.write(4);
+/** Collect the distinct remote-extension peers from the station attributes */
+static void net_scan_peers() {
+  byte np = 0;
+  memset(net_targets+NET_TARGET_PEER, 0, sizeof(NetTarget)*NET_MAX_PEERS);
+  for (byte sid=0; sid<os.nstations && np<NET_MAX_PEERS; sid++) {
+    const SpecialStation *stn = os.get_special(sid);
+    if (stn->type!=STN_TYPE_REMOTE) continue;
+    ulong ip = stn->remote.ip;
+    byte cip[4] = {(byte)(ip>>24), (byte)((ip>>16)&0xff), (byte)((ip>>8)&0xff), (byte)(ip&0xff)};
+    byte i;
+    for (i=0; i<np; i++) {
+      if (!memcmp(net_targets[NET_TARGET_PEER+i].ip, cip, 4)) break;
     }
+    if (i==np) memcpy(net_targets[NET_TARGET_PEER+np++].ip, cip, 4);
+  }
+}
 
-    // ping gateway ip
-    ether.clientIcmpRequest(ether.gwip);
+/** Record a probe result and act on the gateway statistics */
+static void net_record(byte target, bool lost, uint16_t rtt) {
+  NetTarget *t = net_targets+target;
+  t->lost = (t->lost<<1) | (lost?1:0);
+  if (t->n<NET_WINDOW) t->n++;
+  if (!lost) t->rtt = t->rtt ? (uint16_t)(((ulong)t->rtt*3+rtt)/4) : rtt;
+  if (target!=NET_TARGET_GATEWAY) return;
+
+  // network_fails keeps the number of consecutive gateway losses (for the LCD icon and callers)
+  byte consec = 0;
+  while (consec<t->n && ((t->lost>>consec)&1)) consec++;
+  os.status.network_fails = (consec>6) ? 6 : consec;
+
+  if (!lost) {
+    net_down_since = 0;
+  } else if (!net_down_since) {
+    net_down_since = millis() | 1;
+  }
 
-    ulong start = millis();
-    boolean failed = true;
-    // wait at most PING_TIMEOUT milliseconds for ping result
-    do {
-      ether.packetLoop(ether.packetReceive());
-      if (ether.packetLoopIcmpCheckReply(ether.gwip)) {
-        failed = false;
+  byte losses = net_losses(t);
+  if (lost && millis()-net_down_since>=NET_REBOOT_DOWNTIME*1000UL) {
+    // the gateway has been unreachable for too long: mark for safe restart
+    os.status.safe_reboot = 1;
+  } else if (lost && t->n>=4 && losses*2>=t->n) {
+    // half or more of the recent probes lost: try to reconnect
+    ulong now_t = os.now_tz();
+    if (!net_reconnect_time || now_t-net_reconnect_time>=NET_RECONNECT_HOLDOFF) {
+      net_reconnect_time = now_t;
+      os.start_network();
+    }
+  }
+}
+
+/** Check the probe in flight; plen is the length of the packet just received */
+void net_probe_poll(uint16_t plen) {
+  if (net_probe_target==255) return;
+  ulong rtt = millis()-net_probe_start;
+  bool replied;
+  #ifdef OPENSPRINKLER_ARDUINO_W5100
+  replied = ether.packetLoopIcmpCheckReply(net_targets[net_probe_target].ip);
+  #else
+  // EtherCard: the reply is in the packet just received
+  replied = plen && ether.packetLoopIcmpCheckReply(net_targets[net_probe_target].ip);
+  #endif
+  if (replied) {
+    net_record(net_probe_target, false, (uint16_t)rtt);
+    net_probe_target = 255;
+  } else if (rtt>=NET_PROBE_TIMEOUT) {
+    net_record(net_probe_target, true, 0);
+    net_probe_target = 255;
+  }
+}
+#endif
+
+void check_network() {
+#if defined(ARDUINO) && !defined(ESP8266)
+  // refresh the probe targets periodically
+  if (os.status.req_network) {
+    os.status.req_network = 0;
+    memcpy(net_targets[NET_TARGET_WEATHER].ip, weather_diag.ip, 4);
+    net_scan_peers();
+  }
+  memcpy(net_targets[NET_TARGET_GATEWAY].ip, ether.gwip, 4);
+
+  // paced by millis(), so a clock step or slew cannot skip a probe
+  if (net_probe_target!=255 || millis()-net_probe_last<NET_PROBE_INTERVAL*1000UL) return;
+  net_probe_last = millis();
+
+  // every other probe goes to the gateway, the others rotate over the remaining targets
+  static bool gateway_turn = true;
+  byte target = NET_TARGET_GATEWAY;
+  if (!gateway_turn) {
+    for (byte i=0; i<NET_NUM_TARGETS-1; i++) {
+      byte t = net_probe_next;
+      net_probe_next = (net_probe_next+1<NET_NUM_TARGETS) ? net_probe_next+1 : NET_TARGET_WEATHER;
+      if (net_targets[t].ip[0]) {
+        target = t;
         break;
       }
-    } while(millis() - start < PING_TIMEOUT);
-    if (failed)  {
-      os.status.network_fails++;
-      // clamp it to 6
-      if (os.status.network_fails > 6) os.status.network_fails = 6;
-    }
-    else os.status.network_fails=0;
-    // if failed more than 6 times, restart
-    if (os.status.network_fails>=6) {
-      // mark for safe restart
-      os.status.safe_reboot = 1;
-    } else if (os.status.network_fails>2) {
-      // if failed more than twice, try to reconnect    
-      if (os.start_network())
-        os.status.network_fails=0;
     }
   }
+  gateway_turn = !gateway_turn;
+  if (!net_targets[target].ip[0]) return;
+  if (target==NET_TARGET_GATEWAY && !ui_state) {
+    // change LCD icon to indicate it's checking network
+    os.lcd.setCursor(15, 1);
+    os.lcd.write(4);
+  }
+
+  net_probe_target = target;
+  net_probe_start = millis();
+  ether.clientIcmpRequest(net_targets[target].ip);
 #else
   // nothing to do for other platforms
 #endif
 }
 
-/** Perform NTP sync */
-void perform_ntp_sync() {
+/** Perform NTP sync
+ * The exchange is advanced one step per call (once per loop) and never
+ * waits: a request is sent, the answer is checked on later calls, and after
+ * NTP_TIMEOUT_MS the next server is tried. A small clock error is slewed
+ * by one second at a time, so no scheduled minute is skipped or repeated;
+ * only a large error (or an unset clock) is stepped. */
+#define NTP_ATTEMPTS     4     // requests per sync, alternating configured server and pool
+#define NTP_TIMEOUT_MS   1000  // wait for each answer (in ms)
+#define NTP_SLEW_LIMIT   120   // errors up to this (in seconds) are slewed
+#define NTP_SLEW_PERIOD  4000  // slew by 1 second at most every NTP_SLEW_PERIOD ms
+
+#if defined(ARDUINO)
+bool ntp_send(byte server);
+ulong ntp_receive(uint16_t plen);
+
+static byte ntp_attempt = 0;   // 0: idle, otherwise current attempt number
+static ulong ntp_expire = 0;
+static long ntp_slew = 0;      // remaining error to slew (in seconds)
+static ulong ntp_slew_last = 0;
+static bool ntp_deferred = false;  // a large step is waiting for the running program to end
+#endif
+
+void perform_ntp_sync(uint16_t plen) {
 #if defined(ARDUINO)
-  // do not perform sync if this option is disabled, or if network is not available, or if a program is running
-  if (!os.options[OPTION_USE_NTP] || os.status.program_busy) return;
+  // slew the clock towards the last NTP time
+  if (ntp_slew && millis()-ntp_slew_last>=NTP_SLEW_PERIOD) {
+    byte sec = now()%60;
+    // never step backwards over a minute boundary, or the scheduler sees the minute twice
+    if (ntp_slew>0 || (sec>=2 && sec<=57)) {
+      long step = (ntp_slew>0) ? 1 : -1;
+      adjustTime(step);
+      ntp_slew -= step;
+      ntp_slew_last = millis();
+      if (!ntp_slew) RTC.set(now());
+    }
+  }
+
+  if (ntp_attempt) {
+    ulong t = ntp_receive(plen);
+    if (t>0) {
+      ntp_attempt = 0;
+      // check if rtc is uninitialized
+      // 978307200 is Jan 1, 2001, 00:00:00
+      boolean rtc_zero = (now()<=978307200);
+      long offset = (long)(t-now());
+      if (!rtc_zero && offset>=-NTP_SLEW_LIMIT && offset<=NTP_SLEW_LIMIT) {
+        ntp_slew = offset;
+        if (!ntp_slew) RTC.set(now());
+      } else if (!os.status.program_busy || rtc_zero) {
+        ntp_slew = 0;
+        setTime(t);
+        RTC.set(t);
+        // if rtc was uninitialized and now it is, restart
+        if(rtc_zero && now()>978307200) {
+          os.reboot_dev();
+        }
+      } else {
+        // do not step the clock under a running program, sync again once it ends
+        ntp_deferred = true;
+      }
+      DEBUG_PRINTLN(F("NTP (OK)")); // OPENSPRINKLER_ARDUINO_DEBUG
+    } else if ((long)(millis()-ntp_expire)>=0) {
+      // no answer: try the next server
+      if (ntp_attempt>=NTP_ATTEMPTS) {
+        ntp_attempt = 0;
+        DEBUG_PRINTLN(F("NTP (failed)")); // OPENSPRINKLER_ARDUINO_DEBUG
+      } else {
+        ntp_send((ntp_attempt%2) ? NTP_SERVER_POOL : NTP_SERVER_CONFIGURED);
+        ntp_attempt++;
+        ntp_expire = millis()+NTP_TIMEOUT_MS;
+      }
+    }
+    return;
+  }
+
+  if (ntp_deferred && !os.status.program_busy) {
+    ntp_deferred = false;
+    os.status.req_ntpsync = 1;
+  }
+  // do not perform sync if this option is disabled, or if network is not available
+  if (!os.options[OPTION_USE_NTP] || !os.status.req_ntpsync) return;
   #ifdef ESP8266
   if (os.get_wifi_mode()!=WIFI_MODE_STA || WiFi.status()!=WL_CONNECTED || os.state!=OS_STATE_CONNECTED) return;
   #else
   if (os.status.network_fails>0) return;
   #endif
 
-  if (os.status.req_ntpsync) {
-    // check if rtc is uninitialized
-    // 978307200 is Jan 1, 2001, 00:00:00
-    boolean rtc_zero = (now()<=978307200);
-    
-    os.status.req_ntpsync = 0;
-    DEBUG_PRINT(F("NTP Syncing... ")); // OPENSPRINKLER_ARDUINO_DEBUG
-    if (!ui_state) {
-      os.lcd_print_line_clear_pgm(PSTR("NTP Syncing"),1);
-    }
-    ulong t = getNtpTime();
-    if (t>0) {
-      setTime(t);
-      RTC.set(t);
-      // if rtc was uninitialized and now it is, restart
-      if(rtc_zero && now()>978307200) {
-        os.reboot_dev();
-      }
-      DEBUG_PRINTLN(F("(OK)")); // OPENSPRINKLER_ARDUINO_DEBUG
-    }
-    else
-        DEBUG_PRINTLN(F("(failed)")); // OPENSPRINKLER_ARDUINO_DEBUG
+  os.status.req_ntpsync = 0;
+  DEBUG_PRINT(F("NTP Syncing... ")); // OPENSPRINKLER_ARDUINO_DEBUG
+  if (!ui_state) {
+    os.lcd_print_line_clear_pgm(PSTR("NTP Syncing"),1);
   }
+  ntp_send(NTP_SERVER_CONFIGURED);
+  ntp_attempt = 1;
+  ntp_expire = millis()+NTP_TIMEOUT_MS;
 #else
   // nothing to do here
   // Linux will do this for you
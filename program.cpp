@@ -36,17 +36,26 @@ byte ProgramData::nqueue = 0;
 RuntimeQueueStruct ProgramData::queue[RUNTIME_QUEUE_SIZE];
 byte ProgramData::station_qid[MAX_NUM_STATIONS];
 LogStruct ProgramData::lastrun;
-ulong ProgramData::last_seq_stop_time;
+ulong ProgramData::last_seq_stop_times[NUM_SEQ_GROUPS];
+RuntimeQueueStruct ProgramData::deferred[RUNTIME_DEFER_SIZE];
+byte ProgramData::ndeferred = 0;
+QueueStats ProgramData::qstats;
+
+byte ProgramData::order[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::rec_addr[MAX_NUMBER_PROGRAMS];
+uint16_t ProgramData::heap_end;
+uint16_t ProgramData::heap_live;
 
 void ProgramData::init() {
 	reset_runtime();
-  load_count();
+  load();
 }
 
 void ProgramData::reset_runtime() {
   memset(station_qid, 0xFF, MAX_NUM_STATIONS);  // reset station qid to 0xFF
   nqueue = 0;
-  last_seq_stop_time = 0;
+  memset(last_seq_stop_times, 0, sizeof(last_seq_stop_times));
+  ndeferred = 0;
 }
 
 /** Insert a new element to the queue
@@ -62,6 +71,96 @@ RuntimeQueueStruct* ProgramData::enqueue() {
   }
 }
 
+static byte queue_priority(byte pid) {
+  if (pid==99)  return QUEUE_PRIO_MANUAL;
+  if (pid>=254) return QUEUE_PRIO_RUNONCE;
+  return QUEUE_PRIO_PROGRAM;
+}
+
+/** Add a station run to the queue
+ * If the queue is full, the run is
+ * 1) merged into a pending (not yet started) run of the same station, or
+ * 2) swapped with the lowest-priority pending run, if that has a lower
+ *    priority; the displaced run is deferred, or
+ * 3) deferred until the queue has room, or
+ * 4) rejected if the deferred list is full as well.
+ * Returns one of the QUEUE_ admission results.
+ */
+byte ProgramData::admit(byte sid, byte pid, uint16_t dur, ulong curr_time) {
+  RuntimeQueueStruct *q = enqueue();
+  if (q) {
+    q->st = 0;
+    q->dur = dur;
+    q->sid = sid;
+    q->pid = pid;
+    qstats.admitted++;
+    return QUEUE_ADMITTED;
+  }
+
+  byte prio = queue_priority(pid);
+  byte i, victim = 255;
+  for(i=0;i<nqueue;i++) {
+    q = queue+i;
+    if (!q->dur || (q->st && q->st<=curr_time)) continue;  // skip removed or started runs
+    if (q->sid==sid) {
+      ulong d = (ulong)q->dur+dur;
+      q->dur = (d>65535UL) ? 65535 : (uint16_t)d;
+      if (prio>queue_priority(q->pid)) q->pid = pid;
+      q->st = 0;  // reschedule, as the longer run may no longer fit its slot
+      qstats.merged++;
+      return QUEUE_MERGED;
+    }
+    if (queue_priority(q->pid)<prio &&
+        (victim==255 || queue_priority(q->pid)<queue_priority(queue[victim].pid))) {
+      victim = i;
+    }
+  }
+
+  if (ndeferred>=RUNTIME_DEFER_SIZE) {
+    qstats.rejected++;
+    return QUEUE_REJECTED;
+  }
+  q = deferred+(ndeferred++);
+  qstats.deferred++;
+  if (victim!=255) {
+    // defer the lower-priority run and take over its slot
+    *q = queue[victim];
+    q->st = 0;
+    if (station_qid[q->sid]==victim) station_qid[q->sid] = 0xFF;
+    q = queue+victim;
+    q->st = 0;
+    q->dur = dur;
+    q->sid = sid;
+    q->pid = pid;
+    qstats.admitted++;
+    return QUEUE_ADMITTED;
+  }
+  q->st = 0;
+  q->dur = dur;
+  q->sid = sid;
+  q->pid = pid;
+  return QUEUE_DEFERRED;
+}
+
+/** Move deferred elements, highest priority first, into free queue slots
+ * Returns the number of elements moved.
+ */
+byte ProgramData::admit_deferred() {
+  byte moved = 0;
+  while (ndeferred && nqueue<RUNTIME_QUEUE_SIZE) {
+    byte i, best = 0;
+    for(i=1;i<ndeferred;i++) {
+      if (queue_priority(deferred[i].pid)>queue_priority(deferred[best].pid)) best = i;
+    }
+    queue[nqueue++] = deferred[best];
+    // keep the remaining deferred elements in arrival order
+    for(i=best;i<ndeferred-1;i++) deferred[i] = deferred[i+1];
+    ndeferred--;
+    moved++;
+  }
+  return moved;
+}
+
 /** Remove an element from the queue
  * This function copies the last element of
  * the queue to overwrite the requested
@@ -91,9 +190,280 @@ void ProgramData::dequeue(byte qid) {
   DEBUG_PRINTLN("");
 }
 
-/** Load program count from NVM */
-void ProgramData::load_count() {
+/** Encode a program into a record, returns the record length */
+static byte program_encode(const ProgramStruct *buf, byte *rec) {
+  byte *p = rec+2;
+  memcpy(p, buf, PROGRAM_HEADER_SIZE);
+  p += PROGRAM_HEADER_SIZE;
+  byte *bits = p;
+  memset(bits, 0, PROGRAM_BITMAP_SIZE);
+  p += PROGRAM_BITMAP_SIZE;
+  for (byte sid=0; sid<MAX_NUM_STATIONS; sid++) {
+    uint16_t dur = buf->durations[sid];
+    if (!dur) continue;
+    bits[sid>>3] |= 1<<(sid&0x07);
+    *p++ = dur&0xFF;
+    *p++ = dur>>8;
+  }
+  byte n = 0;
+  while (n<PROGRAM_NAME_SIZE && buf->name[n]) n++;
+  memcpy(p, buf->name, n);
+  p += n;
+  rec[0] = p-rec;
+  return rec[0];
+}
+
+/** Decode a record into a program */
+static void program_decode(const byte *rec, ProgramStruct *buf) {
+  const byte *p = rec+2, *end = rec+rec[0];
+  memset(buf, 0, PROGRAMSTRUCT_SIZE);
+  memcpy(buf, p, PROGRAM_HEADER_SIZE);
+  p += PROGRAM_HEADER_SIZE;
+  const byte *bits = p;
+  p += PROGRAM_BITMAP_SIZE;
+  for (byte sid=0; sid<MAX_NUM_STATIONS; sid++) {
+    if (!(bits[sid>>3]&(1<<(sid&0x07)))) continue;
+    buf->durations[sid] = p[0] | ((uint16_t)p[1]<<8);
+    p += 2;
+  }
+  if (end>p) memcpy(buf->name, p, (end-p>PROGRAM_NAME_SIZE) ? PROGRAM_NAME_SIZE : end-p);
+}
+
+/** Load program count, order table and record addresses from NVM */
+void ProgramData::load() {
+  if (nvm_read_byte((byte *) ADDR_PROGRAMTYPEVERSION) != PROGRAM_TYPE_VERSION) upgrade();
   nprograms = nvm_read_byte((byte *) ADDR_PROGRAMCOUNTER);
+  if (nprograms > MAX_NUMBER_PROGRAMS) nprograms = 0;
+  nvm_read_block(order, (const void *)ADDR_PROGRAMORDER, MAX_NUMBER_PROGRAMS);
+
+  // walk the heap to find each record
+  memset(rec_addr, 0, sizeof(rec_addr));
+  heap_live = 0;
+  uint16_t addr = ADDR_PROGRAMHEAP;
+  while (addr+2 <= ADDR_PROGRAMEND) {
+    byte len = nvm_read_byte((byte *) addr);
+    if (len<2 || addr+len>ADDR_PROGRAMEND) break;
+    byte id = nvm_read_byte((byte *)(addr+1));
+    if (id<MAX_NUMBER_PROGRAMS) {
+      // a modify interrupted before it freed the old copy: keep the later one
+      if (rec_addr[id]) release_record(rec_addr[id]);
+      rec_addr[id] = addr;
+      heap_live += len;
+    }
+    addr += len;
+  }
+  heap_end = addr;
+
+  byte i;
+  for (i=0; i<nprograms; i++) {
+    if (order[i]>=MAX_NUMBER_PROGRAMS || !rec_addr[order[i]]) {
+      nprograms = i;  // damaged table: keep the programs before the bad entry
+      save_count();
+      break;
+    }
+  }
+  // drop records no program refers to (e.g. an interrupted add)
+  for (byte id=0; id<MAX_NUMBER_PROGRAMS; id++) {
+    if (!rec_addr[id]) continue;
+    for (i=0; i<nprograms && order[i]!=id; i++);
+    if (i==nprograms) release(id);
+  }
+}
+
+static_assert(NUM_OPTIONS+UPGRADE_RECORD+PROGRAM_RECORD_MAX <= MAX_NVM_OPTIONS, "no room for the program conversion journal");
+
+static byte upgrade_get(byte i) {
+  return nvm_read_byte((byte *)(ADDR_PROGRAMUPGRADE+i));
+}
+
+static void upgrade_set(byte i, byte v) {
+  nvm_write_byte((byte *)(ADDR_PROGRAMUPGRADE+i), v);
+}
+
+/** Address of converted record j (0: the first one, at the top of the
+ * program area). While slots are converted, each record is followed by
+ * a copy of its length, so the records can be walked down from the top. */
+static uint16_t upgrade_record(byte j) {
+  uint16_t addr = ADDR_PROGRAMEND;
+  for (byte i=0; ; i++) {
+    addr -= nvm_read_byte((byte *)(addr-1))+1;
+    if (i==j) return addr;
+  }
+}
+
+/** Copy a record into the journal before it is written over old data;
+ * it is marked in flight as record index i */
+static void upgrade_log(const byte *rec, byte i) {
+  nvm_write_block(rec, (void *)(ADDR_PROGRAMUPGRADE+UPGRADE_RECORD), rec[0]);
+  upgrade_set(UPGRADE_INFLIGHT, i+1);
+}
+
+/** Convert programs stored in fixed-size slots (type version 12, or
+ * back to back before that) to records. Records are first written
+ * from the top of the program area down, starting with the highest
+ * slot, so no slot is overwritten before it has been read; they are
+ * then moved down to the start of the heap.
+ * The conversion survives a power loss: the type version byte is set to
+ * a conversion marker first, every record is copied to the journal
+ * before it goes over old data and the journal counts the records done,
+ * so the next boot resumes where the conversion stopped. */
+void ProgramData::upgrade() {
+  ProgramStruct prog;
+  byte rec[PROGRAM_RECORD_MAX];
+  byte ver = nvm_read_byte((byte *) ADDR_PROGRAMTYPEVERSION);
+  byte c, m, k;
+  uint16_t top, w;
+  if (ver != PROGRAM_UPGRADE_MOVE) {
+    if ((ver&0xFE) != PROGRAM_UPGRADE_SLOTS) {
+      upgrade_set(UPGRADE_CONVERTED, 0);
+      upgrade_set(UPGRADE_MOVED, 0);
+      upgrade_set(UPGRADE_INFLIGHT, 0);
+      ver = PROGRAM_UPGRADE_SLOTS | (ver==12);
+      nvm_write_byte((byte *) ADDR_PROGRAMTYPEVERSION, ver);
+    }
+    byte n = nvm_read_byte((byte *) ADDR_PROGRAMCOUNTER);
+    byte maxn;
+    unsigned int base;
+    if (ver&1) {
+      maxn = (MAX_PROGRAMDATA-2)/(PROGRAMSTRUCT_SIZE+1);
+      base = ADDR_PROGRAMORDER+maxn;
+    } else {
+      maxn = (MAX_PROGRAMDATA-2)/PROGRAMSTRUCT_SIZE;
+      base = ADDR_PROGRAMORDER;
+    }
+    if (n>maxn) n = 0;
+    if (n>MAX_NUMBER_PROGRAMS) n = MAX_NUMBER_PROGRAMS;
+    // slot of each program
+    for (k=0; k<n; k++) {
+      order[k] = (ver&1) ? nvm_read_byte((byte *)(ADDR_PROGRAMORDER+k)) : k;
+    }
+    // resume after the records already converted
+    c = upgrade_get(UPGRADE_CONVERTED);
+    top = c ? upgrade_record(c-1) : ADDR_PROGRAMEND;
+    int slot = c ? order[nvm_read_byte((byte *)(top+1))] : maxn;
+    if (upgrade_get(UPGRADE_INFLIGHT) == c+1) {
+      // finish the record that was being written from its journal copy
+      nvm_read_block(rec, (const void *)(ADDR_PROGRAMUPGRADE+UPGRADE_RECORD), 1);
+      nvm_read_block(rec, (const void *)(ADDR_PROGRAMUPGRADE+UPGRADE_RECORD), rec[0]);
+      slot = order[rec[1]];
+      top -= rec[0]+1;
+      nvm_write_block(rec, (void *)top, rec[0]);
+      nvm_write_byte((byte *)(top+rec[0]), rec[0]);
+      upgrade_set(UPGRADE_CONVERTED, ++c);
+    }
+    for (slot--; slot>=0; slot--) {
+      for (k=0; k<n && order[k]!=slot; k++);
+      if (k==n) continue;
+      unsigned int addr = base + (unsigned int)slot * PROGRAMSTRUCT_SIZE;
+      nvm_read_block(&prog, (const void *)addr, PROGRAMSTRUCT_SIZE);
+      byte len = program_encode(&prog, rec);
+      rec[1] = k;
+      if (top-len-1 < addr || top-len-1 < ADDR_PROGRAMHEAP) continue;  // no room: drop the program
+      upgrade_log(rec, c);
+      top -= len+1;
+      nvm_write_block(rec, (void *)top, len);
+      nvm_write_byte((byte *)(top+len), len);
+      upgrade_set(UPGRADE_CONVERTED, ++c);
+    }
+    upgrade_set(UPGRADE_INFLIGHT, 0);
+    nvm_write_byte((byte *) ADDR_PROGRAMTYPEVERSION, PROGRAM_UPGRADE_MOVE);
+  }
+
+  // move the records down to the start of the heap, lowest first,
+  // dropping the length copies
+  c = upgrade_get(UPGRADE_CONVERTED);
+  m = upgrade_get(UPGRADE_MOVED);
+  w = ADDR_PROGRAMHEAP;
+  for (k=0; k<m; k++) w += nvm_read_byte((byte *) w);
+  for (; m<c; m++) {
+    if (upgrade_get(UPGRADE_INFLIGHT) == m+1) {
+      nvm_read_block(rec, (const void *)(ADDR_PROGRAMUPGRADE+UPGRADE_RECORD), 1);
+      nvm_read_block(rec, (const void *)(ADDR_PROGRAMUPGRADE+UPGRADE_RECORD), rec[0]);
+    } else {
+      uint16_t r = upgrade_record(c-1-m);
+      nvm_read_block(rec, (const void *)r, 1);
+      nvm_read_block(rec, (const void *)r, rec[0]);
+      upgrade_log(rec, m);
+    }
+    nvm_write_block(rec, (void *)w, rec[0]);
+    w += rec[0];
+    upgrade_set(UPGRADE_MOVED, m+1);
+  }
+  if (w<ADDR_PROGRAMEND) nvm_write_byte((byte *) w, 0);
+
+  // programs keep their order; dropped ones are left out
+  memset(rec_addr, 0, sizeof(rec_addr));
+  for (uint16_t addr=ADDR_PROGRAMHEAP; addr<w; addr+=nvm_read_byte((byte *) addr)) {
+    rec_addr[nvm_read_byte((byte *)(addr+1))] = addr;
+  }
+  m = 0;
+  for (k=0; k<MAX_NUMBER_PROGRAMS; k++) {
+    if (rec_addr[k]) order[m++] = k;
+  }
+  nvm_write_block(order, (void *)ADDR_PROGRAMORDER, m);
+  nprograms = m;
+  save_count();
+  upgrade_set(UPGRADE_INFLIGHT, 0);
+  nvm_write_byte((byte *) ADDR_PROGRAMTYPEVERSION, PROGRAM_TYPE_VERSION);
+}
+
+/** Move live records in [from, end) down to the start of the heap */
+void ProgramData::compact(uint16_t from, uint16_t end) {
+  byte rec[PROGRAM_RECORD_MAX];
+  uint16_t r = from, w = ADDR_PROGRAMHEAP;
+  heap_live = 0;
+  while (r+2 <= end) {
+    byte len = nvm_read_byte((byte *) r);
+    if (len<2 || r+len>end) break;
+    byte id = nvm_read_byte((byte *)(r+1));
+    if (id<MAX_NUMBER_PROGRAMS) {
+      if (r!=w) {
+        nvm_read_block(rec, (const void *)r, len);
+        nvm_write_block(rec, (void *)w, len);
+        rec_addr[id] = w;
+      }
+      w += len;
+      heap_live += len;
+    }
+    r += len;
+  }
+  heap_end = w;
+  if (w<ADDR_PROGRAMEND) nvm_write_byte((byte *) w, 0);
+}
+
+/** Write a record for id at the end of the heap, compacting if needed
+ * The caller must check heap_free() first. */
+byte ProgramData::store(byte id, byte *rec) {
+  byte len = rec[0];
+  rec[1] = id;
+  if (heap_end+len > ADDR_PROGRAMEND) compact(ADDR_PROGRAMHEAP, heap_end);
+  if (heap_end+len > ADDR_PROGRAMEND) return 0;
+  // write the new end marker first, so the heap is never left open-ended
+  if (heap_end+len < ADDR_PROGRAMEND) nvm_write_byte((byte *)(heap_end+len), 0);
+  nvm_write_block(rec, (void *)heap_end, len);
+  rec_addr[id] = heap_end;
+  heap_end += len;
+  heap_live += len;
+  return 1;
+}
+
+/** Mark the record at addr as deleted */
+void ProgramData::release_record(uint16_t addr) {
+  heap_live -= nvm_read_byte((byte *) addr);
+  nvm_write_byte((byte *)(addr+1), PROGRAM_RECORD_FREE);
+}
+
+/** Mark the record of id as deleted */
+void ProgramData::release(byte id) {
+  uint16_t addr = rec_addr[id];
+  if (!addr) return;
+  release_record(addr);
+  rec_addr[id] = 0;
+}
+
+/** Bytes left for program records */
+uint16_t ProgramData::heap_free() {
+  return (ADDR_PROGRAMEND-ADDR_PROGRAMHEAP)-heap_live;
 }
 
 /** Save program count to NVM */
@@ -101,73 +471,106 @@ void ProgramData::save_count() {
   nvm_write_byte((byte *) ADDR_PROGRAMCOUNTER, nprograms);
 }
 
+/** Save order table entries [from, to) to NVM */
+void ProgramData::save_order(byte from, byte to) {
+  if (to > from) nvm_write_block(order+from, (void *)(ADDR_PROGRAMORDER+from), to-from);
+}
+
 /** Erase all program data */
 void ProgramData::eraseall() {
   nprograms = 0;
   save_count();
+  memset(rec_addr, 0, sizeof(rec_addr));
+  heap_end = ADDR_PROGRAMHEAP;
+  heap_live = 0;
+  nvm_write_byte((byte *) ADDR_PROGRAMHEAP, 0);
 }
 
 /** Read a program from NVM*/
 void ProgramData::read(byte pid, ProgramStruct *buf) {
   if (pid >= nprograms) return;
-  if (0) {
-    // todo: handle SD card
-  } else {
-    unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)pid * PROGRAMSTRUCT_SIZE;
-    nvm_read_block((void*)buf, (const void *)addr, PROGRAMSTRUCT_SIZE);  
+  byte rec[PROGRAM_RECORD_MAX];
+  uint16_t addr = rec_addr[order[pid]];
+  nvm_read_block(rec, (const void *)addr, nvm_read_byte((byte *) addr));
+  program_decode(rec, buf);
+}
+
+/** Copy the raw record of a program (used by configuration export) */
+byte ProgramData::read_record(byte pid, byte *rec) {
+  if (pid >= nprograms) return 0;
+  uint16_t addr = rec_addr[order[pid]];
+  byte len = nvm_read_byte((byte *) addr);
+  nvm_read_block(rec, (const void *)addr, len);
+  return len;
+}
+
+/** Check a record from outside NVM and decode it */
+byte ProgramData::decode_record(const byte *rec, ProgramStruct *buf) {
+  byte len = rec[0];
+  if (len < 2+PROGRAM_HEADER_SIZE+PROGRAM_BITMAP_SIZE || len > PROGRAM_RECORD_MAX) return 0;
+  const byte *bits = rec+2+PROGRAM_HEADER_SIZE;
+  byte n = 0;
+  for (byte sid=0; sid<MAX_NUM_STATIONS; sid++) {
+    if (bits[sid>>3]&(1<<(sid&0x07))) n++;
   }
+  int name_len = len-(2+PROGRAM_HEADER_SIZE+PROGRAM_BITMAP_SIZE+2*n);
+  if (name_len < 0 || name_len > PROGRAM_NAME_SIZE) return 0;
+  program_decode(rec, buf);
+  return 1;
 }
 
 /** Add a program */
 byte ProgramData::add(ProgramStruct *buf) {
-  if (0) {
-    // todo: handle SD card
-  } else {
-    if (nprograms >= MAX_NUMBER_PROGRAMS)  return 0;
-    unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)nprograms * PROGRAMSTRUCT_SIZE;
-    nvm_write_block((const void*)buf, (void *)addr, PROGRAMSTRUCT_SIZE);
-    nprograms ++;
-    save_count();
-  }
+  if (nprograms >= MAX_NUMBER_PROGRAMS)  return 0;
+  byte rec[PROGRAM_RECORD_MAX];
+  if (program_encode(buf, rec) > heap_free()) return 0;
+  // find a free record id
+  byte id = 0;
+  while (rec_addr[id]) id++;
+  store(id, rec);
+  order[nprograms] = id;
+  save_order(nprograms, nprograms+1);
+  nprograms ++;
+  save_count();   // the count is written last, so an interrupted add leaves no partial program
   return 1;
 }
 
 /** Move a program up (i.e. swap a program with the one above it) */
 void ProgramData::moveup(byte pid) {
   if(pid >= nprograms || pid == 0) return;
-
-  if(0) {
-    // todo: handle SD card
-  } else {
-    // swap program pid-1 and pid
-    unsigned int src = ADDR_PROGRAMDATA + (unsigned int)(pid-1) * PROGRAMSTRUCT_SIZE;
-    unsigned int dst = src + PROGRAMSTRUCT_SIZE;
-#if defined(ARDUINO) // NVM write for Arduino
-    byte tmp;
-    for(int i=0;i<PROGRAMSTRUCT_SIZE;i++,src++,dst++) {
-      tmp = nvm_read_byte((byte *)src);
-      nvm_write_byte((byte *)src, nvm_read_byte((byte *)dst));
-      nvm_write_byte((byte *)dst, tmp);
-    }
-#else // NVM write for RPI/BBB
-    ProgramStruct tmp1, tmp2;
-    nvm_read_block(&tmp1, (void *)src, PROGRAMSTRUCT_SIZE);
-    nvm_read_block(&tmp2, (void *)dst, PROGRAMSTRUCT_SIZE);
-    nvm_write_block(&tmp1, (void *)dst, PROGRAMSTRUCT_SIZE);
-    nvm_write_block(&tmp2, (void *)src, PROGRAMSTRUCT_SIZE);
-#endif // NVM write
-  }
+  // swap the record ids of program pid-1 and pid
+  byte tmp = order[pid-1];
+  order[pid-1] = order[pid];
+  order[pid] = tmp;
+  save_order(pid-1, pid+1);
 }
 
 /** Modify a program */
 byte ProgramData::modify(byte pid, ProgramStruct *buf) {
   if (pid >= nprograms)  return 0;
-  if (0) {
-    // handle SD card
-  } else {
-    unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)pid * PROGRAMSTRUCT_SIZE;
-    nvm_write_block((const void*)buf, (void *)addr, PROGRAMSTRUCT_SIZE);
+  byte rec[PROGRAM_RECORD_MAX];
+  byte id = order[pid];
+  uint16_t addr = rec_addr[id];
+  byte len = program_encode(buf, rec);
+  byte old_len = nvm_read_byte((byte *) addr);
+  if (len == old_len || (len > heap_free() && len+2 <= old_len)) {
+    // same size, or smaller with no room for a second copy: rewrite in
+    // place, turning the leftover tail into a deleted record first
+    rec[1] = id;
+    if (len < old_len) {
+      byte gap[2] = {(byte)(old_len-len), PROGRAM_RECORD_FREE};
+      nvm_write_block(gap, (void *)(addr+len), 2);
+      heap_live -= old_len-len;
+    }
+    nvm_write_block(rec, (void *)addr, len);
+    return 1;
   }
+  // the new record is written before the old one is freed, so both must fit
+  if (len > heap_free()) return 0;
+  if (heap_end+len > ADDR_PROGRAMEND) compact(ADDR_PROGRAMHEAP, heap_end);
+  addr = rec_addr[id];  // compaction may have moved the old record
+  store(id, rec);
+  release_record(addr);
   return 1;
 }
 
@@ -175,19 +578,12 @@ byte ProgramData::modify(byte pid, ProgramStruct *buf) {
 byte ProgramData::del(byte pid) {
   if (pid >= nprograms)  return 0;
   if (nprograms == 0) return 0;
-  if (0) {
-    // handle SD card
-  } else {
-    ProgramStruct copy;
-    unsigned int addr = ADDR_PROGRAMDATA + (unsigned int)(pid+1) * PROGRAMSTRUCT_SIZE;
-    // erase by copying backward
-    for (; addr < ADDR_PROGRAMDATA + nprograms * PROGRAMSTRUCT_SIZE; addr += PROGRAMSTRUCT_SIZE) {
-      nvm_read_block((void*)&copy, (const void *)addr, PROGRAMSTRUCT_SIZE);  
-      nvm_write_block((const void*)&copy, (void *)(addr-PROGRAMSTRUCT_SIZE), PROGRAMSTRUCT_SIZE);
-    }
-    nprograms --;
-    save_count();
-  }
+  // free the record and close the gap in the order table
+  release(order[pid]);
+  for (byte i=pid; i<nprograms-1; i++) order[i] = order[i+1];
+  nprograms --;
+  save_count();
+  save_order(pid, nprograms);
   return 1;
 }
 
@@ -29,16 +29,20 @@
 #if defined(ARDUINO)
   #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) // for 4KB NVM
     #define PROGRAM_NAME_SIZE   20
-    #define RUNTIME_QUEUE_SIZE  MAX_NUM_STATIONS
   #else
     #define PROGRAM_NAME_SIZE   16
-    #define RUNTIME_QUEUE_SIZE  MAX_NUM_STATIONS
   #endif
 #else
   #define PROGRAM_NAME_SIZE   20
+#endif
+
+// runtime queue capacity (may be overridden at compile time, must be below 255)
+#ifndef RUNTIME_QUEUE_SIZE
   #define RUNTIME_QUEUE_SIZE  MAX_NUM_STATIONS
 #endif
+#define RUNTIME_DEFER_SIZE    8   // elements held back while the runtime queue is full
 
+#include <stddef.h>
 #include "OpenSprinkler.h"
 
 /** Log data structure */
@@ -115,18 +119,47 @@ protected:
 
 };
 
-/** Program data nvm addresses */
+/** Program data nvm layout
+ * | type version | count | order table | record heap |
+ * The order table maps each logical program index to a record id, so
+ * reordering or deleting a program only rewrites table bytes.
+ * Programs are stored as variable-length records in the heap:
+ *   [length][id][flags, days, start times][station bitmap][non-zero durations][name]
+ * Id 0xFF marks a deleted record and length 0 ends the heap. New and
+ * resized records are appended; the heap is compacted when the end is
+ * reached. */
 #define PROGRAMSTRUCT_SIZE         (sizeof(ProgramStruct))
+#define PROGRAM_HEADER_SIZE        (offsetof(ProgramStruct, durations))
+#define PROGRAM_BITMAP_SIZE        (MAX_EXT_BOARDS+1)
+#define PROGRAM_RECORD_MIN         (2+PROGRAM_HEADER_SIZE+PROGRAM_BITMAP_SIZE+2)  // one station, no name
+#define PROGRAM_RECORD_MAX         (2+PROGRAM_HEADER_SIZE+PROGRAM_BITMAP_SIZE+2*MAX_NUM_STATIONS+PROGRAM_NAME_SIZE)
+#define PROGRAM_RECORD_FREE        0xFF  // id of a deleted record
 #define ADDR_PROGRAMTYPEVERSION     ADDR_NVM_PROGRAMS
 #define ADDR_PROGRAMCOUNTER        (ADDR_NVM_PROGRAMS+1)
-#define ADDR_PROGRAMDATA           (ADDR_NVM_PROGRAMS+2)
+#define ADDR_PROGRAMORDER          (ADDR_NVM_PROGRAMS+2)  // order table (one record id per program)
 
 // maximum number of programs, restricted by internal NVM size
-#define MAX_NUMBER_PROGRAMS        ((MAX_PROGRAMDATA-2)/PROGRAMSTRUCT_SIZE)
+// (the actual limit depends on how many stations each program uses)
+// and by the queue pids: program index i runs as pid i+1, and pid 99 is
+// taken by manual station runs (254 by run-once), so at most 98 programs
+#define MAX_NVM_PROGRAMS           ((MAX_PROGRAMDATA-2)/(PROGRAM_RECORD_MIN+1))
+#define MAX_NUMBER_PROGRAMS        ((MAX_NVM_PROGRAMS<98) ? MAX_NVM_PROGRAMS : 98)
+#define ADDR_PROGRAMHEAP           (ADDR_PROGRAMORDER+MAX_NUMBER_PROGRAMS)
+#define ADDR_PROGRAMEND            (ADDR_NVM_PROGRAMS+MAX_PROGRAMDATA)
 
 extern OpenSprinkler os;
 
-#define PROGRAM_TYPE_VERSION  11
+#define PROGRAM_TYPE_VERSION  13  // 12: slot order table, 13: variable-length records
+#define PROGRAM_UPGRADE_SLOTS 0x80  // type version while slots are converted (| 1: from version 12)
+#define PROGRAM_UPGRADE_MOVE  0xC0  // type version while converted records move to the heap
+
+/** Conversion journal, in the spare option room:
+ * | records converted | records moved | record in flight (index+1, 0: none) | copy of that record | */
+#define ADDR_PROGRAMUPGRADE   (ADDR_NVM_OPTIONS+NUM_OPTIONS)
+#define UPGRADE_CONVERTED     0
+#define UPGRADE_MOVED         1
+#define UPGRADE_INFLIGHT      2
+#define UPGRADE_RECORD        3
 
 class RuntimeQueueStruct {
 public:
@@ -136,6 +169,25 @@ public:
   byte  pid;
 };
 
+/** Runtime queue priorities (derived from the program index) */
+#define QUEUE_PRIO_PROGRAM    0   // scheduled program
+#define QUEUE_PRIO_RUNONCE    1   // run-once or manually started program (pid 254)
+#define QUEUE_PRIO_MANUAL     2   // manual station run (pid 99)
+
+/** Runtime queue admission results */
+#define QUEUE_ADMITTED        0   // added to the queue
+#define QUEUE_MERGED          1   // added to a pending run of the same station
+#define QUEUE_DEFERRED        2   // held back until the queue has room
+#define QUEUE_REJECTED        3   // dropped: queue and deferred list are full
+
+/** Runtime queue admission counters */
+struct QueueStats {
+  ulong admitted;
+  ulong merged;
+  ulong deferred;
+  ulong rejected;
+};
+
 class ProgramData {
 public:  
   static RuntimeQueueStruct queue[];
@@ -143,11 +195,16 @@ public:
   static byte station_qid[];  // this array stores the queue element index for each scheduled station
   static byte nprograms;      // number of programs
   static LogStruct lastrun;
-  static ulong last_seq_stop_time;  // the last stop time of a sequential station
-  
+  static ulong last_seq_stop_times[]; // the last stop time of a sequential station, per sequential group
+  static RuntimeQueueStruct deferred[]; // elements waiting for room in the queue
+  static byte ndeferred;      // number of deferred elements
+  static QueueStats qstats;   // admission counters
+
   static void reset_runtime();
   static RuntimeQueueStruct* enqueue(); // this returns a pointer to the next available slot in the queue
   static void dequeue(byte qid);  // this removes an element from the queue
+  static byte admit(byte sid, byte pid, uint16_t dur, ulong curr_time); // add a run, applying the overflow policy
+  static byte admit_deferred(); // move deferred elements into free queue slots
 
   static void init();
   static void eraseall();
@@ -158,9 +215,22 @@ public:
   static byte del(byte pid);
   static void drem_to_relative(byte days[2]); // absolute to relative reminder conversion
   static void drem_to_absolute(byte days[2]);
+  static uint16_t heap_free();  // bytes left for program records
+  static byte read_record(byte pid, byte *rec);  // raw record of a program, returns its length
+  static byte decode_record(const byte *rec, ProgramStruct *buf); // returns 0 if the record is malformed
 private:  
-  static void load_count();
+  static byte order[];          // record id of each program
+  static uint16_t rec_addr[];   // nvm address of each record id (0: unused id)
+  static uint16_t heap_end;     // end of the last record
+  static uint16_t heap_live;    // bytes taken by live records
+  static void load();
+  static void upgrade();
   static void save_count();
+  static void save_order(byte from, byte to);
+  static byte store(byte id, byte *rec);
+  static void release(byte id);
+  static void release_record(uint16_t addr);
+  static void compact(uint16_t from, uint16_t end);
 };
 
 #endif  // _PROGRAM_H
@@ -24,6 +24,9 @@
 #include "OpenSprinkler.h"
 #include "program.h"
 #include "server.h"
+#include "emitter.h"
+#include "weather.h"
+#include "gzstream.h"
 
 // External variables defined in main ion file
 #if defined(ARDUINO)
@@ -38,7 +41,8 @@
     extern ulong restart_timeout;
     extern char ether_buffer[];
 
-    #define handle_return(x) {if(x==HTML_OK) server_send_html(ether_buffer); else server_send_result(x); return;}
+    void server_send_ok();
+    #define handle_return(x) {if(x==HTML_OK) server_send_ok(); else server_send_result(x); return;}
 
   #else
 
@@ -49,6 +53,7 @@
   #endif
 
   static uint8_t ntpclientportL = 123; // Default NTP client port
+  void ip2string(char* str, byte ip[4]);
 
 #else
 
@@ -67,6 +72,19 @@ extern char tmp_buffer[];
 extern OpenSprinkler os;
 extern ProgramData pd;
 extern ulong flow_count;
+extern ulong flow_jitter_ms;
+extern volatile uint16_t flow_ring_overruns;
+extern byte flow_leak;
+extern byte flow_high_bits[];
+extern FlowStationStats flow_stn[];
+extern byte station_cfg_serial;
+extern ulong lane_seq_span;
+extern ulong lane_span;
+#if defined(ARDUINO) && !defined(ESP8266)
+extern NetTarget net_targets[];
+byte net_losses(const NetTarget *t);
+#endif
+ulong flow_rate_x100();
 
 #ifndef ESP8266
 static byte return_code;
@@ -86,6 +104,8 @@ void delete_log(char *name);
 void reset_all_stations_immediate();
 void reset_all_stations();
 void make_logfile_name(char *name);
+extern DayRollup rollup;
+bool read_rollup(ulong day);
 
 /* Check available space (number of bytes) in the Ethernet buffer */
 int available_ether_buffer() {
@@ -103,6 +123,7 @@ int available_ether_buffer() {
 #define HTML_RFCODE_ERROR      0x13
 #define HTML_PAGE_NOT_FOUND    0x20
 #define HTML_NOT_PERMITTED     0x30
+#define HTML_QUEUE_FULL        0x31
 #define HTML_UPLOAD_FAILED     0x40
 #define HTML_REDIRECT_HOME     0xFF
 
@@ -131,6 +152,66 @@ static const char htmlContentJSON[] PROGMEM =
   "Connection: close\r\n"
 ;
 
+static const char htmlContentGzip[] PROGMEM =
+  "Content-Encoding: gzip\r\n"
+;
+
+#ifdef GZIP_WINDOW
+/* gzip replies
+ * A handler calls gzip_begin() before its header when the client accepts gzip;
+ * from then on send_packet() compresses the buffer instead of sending it. */
+static GzipStream gz;
+static ulong gz_last[3];  // last compressed reply: [bytes in, bytes out, compression time (us)]
+#ifndef ESP8266
+static bool gz_accepted;  // the current request sent Accept-Encoding: gzip
+#endif
+
+static void gzip_sink(const byte *data, int len) {
+#ifdef ESP8266
+  wifi_server->client().write(data, len);
+#else
+  m_client->write(data, len);
+#endif
+}
+#endif
+
+/** Compress the reply of the current request, if the client accepts gzip */
+static void gzip_begin() {
+#ifdef GZIP_WINDOW
+#ifdef ESP8266
+  if (wifi_server->header("Accept-Encoding").indexOf("gzip") < 0)  return;
+#else
+  if (!gz_accepted)  return;
+#endif
+  gz.begin(gzip_sink);
+#endif
+}
+
+#if !defined(ARDUINO) || defined(ESP8266)
+static bool gzip_active() {
+#ifdef GZIP_WINDOW
+  return gz.active();
+#else
+  return false;
+#endif
+}
+
+void rewind_ether_buffer();
+
+/** Compress the buffered reply, and finish the stream if final */
+static void gzip_packet(bool final) {
+#ifdef GZIP_WINDOW
+  gz.write((const byte*)ether_buffer, (int)bfill.position());
+  rewind_ether_buffer();
+  if (!final)  return;
+  gz.end();
+  gz_last[0] = gz.in_bytes;
+  gz_last[1] = gz.out_bytes;
+  gz_last[2] = gz.cpu_us;
+#endif
+}
+#endif
+
 static const char htmlMobileHeader[] PROGMEM =
   "<meta name=\"viewport\" content=\"width=device-width,initial-scale=1.0,minimum-scale=1.0,user-scalable=no\">\r\n"
 ;
@@ -150,8 +231,15 @@ void print_html_standard_header() {
 
 void print_json_header(bool bracket=true) {
 #ifdef ESP8266
-  wifi_server->sendHeader("Cache-Control", "max-age=0, no-cache, no-store, must-revalidate");
-  wifi_server->sendHeader("Content-Type", "application/json");
+  if (gzip_active()) {
+    // the header goes out as is, the body through the compressor
+    bfill.emit_p(PSTR("$F$F$F$F$F\r\n"), html200OK, htmlContentJSON, htmlAccessControl, htmlNoCache, htmlContentGzip);
+    wifi_server->sendContent(ether_buffer);
+    rewind_ether_buffer();
+  } else {
+    wifi_server->sendHeader("Cache-Control", "max-age=0, no-cache, no-store, must-revalidate");
+    wifi_server->sendHeader("Content-Type", "application/json");
+  }
 #else
   bfill.emit_p(PSTR("$F$F$F$F\r\n"), html200OK, htmlContentJSON, htmlAccessControl, htmlNoCache);
 #endif
@@ -255,6 +343,12 @@ void send_packet(bool final=false) {
     bfill=ether.tcpOffset();
   }
 #else
+  if (gzip_active()) {
+    gzip_packet(final);
+    if(final)
+      wifi_server->client().stop();
+    return;
+  }
   if(final || available_ether_buffer()<250) {
     wifi_server->sendContent(ether_buffer);
     if(final)
@@ -279,6 +373,13 @@ void print_json_header(bool bracket=true) {
   m_client->write((const uint8_t *)htmlContentJSON, strlen(htmlContentJSON));
   m_client->write((const uint8_t *)htmlNoCache, strlen(htmlNoCache));
   m_client->write((const uint8_t *)htmlAccessControl, strlen(htmlAccessControl));
+  if (gzip_active()) {
+    // the body goes through the compressor
+    m_client->write((const uint8_t *)htmlContentGzip, strlen(htmlContentGzip));
+    m_client->write((const uint8_t *)"\r\n", 2);
+    if(bracket) bfill.emit_p(PSTR("{"));
+    return;
+  }
   if(bracket) m_client->write((const uint8_t *)"\r\n{", 3);
   else m_client->write((const uint8_t *)"\r\n", 2);
 }
@@ -329,6 +430,12 @@ void rewind_ether_buffer() {
 }
 
 void send_packet(bool final=false) {
+  if (gzip_active()) {
+    gzip_packet(final);
+    if (final)
+      m_client->stop();
+    return;
+  }
   m_client->write((const uint8_t *)ether_buffer, strlen(ether_buffer));
   if (final)
     m_client->stop();
@@ -338,6 +445,15 @@ void send_packet(bool final=false) {
 
 #endif
 
+/** Add pieces to the reply (see emitter.h); when they do not fit, send
+ * the buffered part first. Returns false if they still do not fit. */
+template<typename... Pieces>
+static bool reply_emit(Pieces... pieces) {
+  if (emit(bfill, pieces...) != EMIT_OVERFLOW) return true;
+  send_packet();
+  return emit(bfill, pieces...) != EMIT_OVERFLOW;
+}
+
 /** Convert a single hex digit character to its integer value */
 unsigned char h2int(char c)
 {
@@ -384,6 +500,12 @@ void server_send_html(String html) {
   wifi_server->send(200, "text/html", html);
 }
 
+/** Send the buffered reply */
+void server_send_ok() {
+  if (gzip_active())  send_packet(true);
+  else  server_send_html(ether_buffer);
+}
+
 void server_send_json(String json) {
   wifi_server->send(200, "application/json", json);
 }
@@ -564,7 +686,7 @@ boolean check_password(char *p)
   if(fwv_on_fail) {
     rewind_ether_buffer();
     print_json_header();
-    bfill.emit_p(PSTR("\"$F\":$D}"), op_json_names+0, os.options[0]);
+    bfill.emit_p(PSTR("\"$F\":$D}"), op_name(0), os.options[0]);
     server_send_html(ether_buffer);
   } else {
     server_send_result(HTML_UNAUTHORIZED);
@@ -578,13 +700,11 @@ void server_json_stations_attrib(const char* name, int addr)
 {
   byte *attrib = (byte*)tmp_buffer;
   os.station_attrib_bits_load(addr, attrib);
-  bfill.emit_p(PSTR("\"$F\":["), name);
+  reply_emit('"', PStr{name}, EMIT_P("\":["));
   for(byte i=0;i<os.nboards;i++) {
-    bfill.emit_p(PSTR("$D"), attrib[i]);
-    if(i!=os.nboards-1)
-      bfill.emit_p(PSTR(","));
+    reply_emit(attrib[i], (i!=os.nboards-1)?',':']');
   }
-  bfill.emit_p(PSTR("],"));
+  reply_emit(',');
 }
 
 void server_json_stations_main()
@@ -594,6 +714,18 @@ void server_json_stations_main()
   server_json_stations_attrib(PSTR("masop2"), ADDR_NVM_MAS_OP_2);
   server_json_stations_attrib(PSTR("stn_dis"), ADDR_NVM_STNDISABLE);
   server_json_stations_attrib(PSTR("stn_seq"), ADDR_NVM_STNSEQ);
+
+  // sequential group of each station, and station delay (in seconds) of each group
+  byte sid;
+  bfill.emit_p(PSTR("\"stn_grp\":["));
+  for(sid=0;sid<os.nstations;sid++) {
+    reply_emit(os.seq_group[sid]);
+    if(sid!=os.nstations-1) reply_emit(',');
+  }
+  bfill.emit_p(PSTR("],\"grp_sdt\":["));
+  for(byte g=0;g<NUM_SEQ_GROUPS;g++) {
+    bfill.emit_p((g!=NUM_SEQ_GROUPS-1)?PSTR("$D,"):PSTR("$D],"), os.seq_group_delay_time(g));
+  }
   
   // only output stn_spe if it's supported
   if (os.status.has_sd) {
@@ -601,12 +733,11 @@ void server_json_stations_main()
   }
 
   bfill.emit_p(PSTR("\"snames\":["));
-  byte sid;
   for(sid=0;sid<os.nstations;sid++) {
     os.get_station_name(sid, tmp_buffer);
-    bfill.emit_p(PSTR("\"$S\""), tmp_buffer);
+    reply_emit('"', tmp_buffer, '"');
     if(sid!=os.nstations-1)
-      bfill.emit_p(PSTR(","));
+      reply_emit(',');
     if (available_ether_buffer()<80) {
       send_packet();
     }
@@ -682,6 +813,9 @@ void server_change_stations_attrib(char *p, char header, int addr)
  * d?: disable sation bit field
  * q?: station sequeitnal bit field
  * p?: station special flag bit field
+ * grp: sequential group of each station, one digit per station (e.g. 0011)
+ * gdl: station delay (in seconds) of groups 1 and up, comma separated
+ *      (group 0 uses the station delay option)
  */
 void server_change_stations() {
 #ifdef ESP8266
@@ -709,7 +843,31 @@ void server_change_stations() {
   // only parse station special bits if it's supported
   if(os.status.has_sd) {
     server_change_stations_attrib(p, 'p', ADDR_NVM_STNSPE); // special
+    os.file_cache_invalidate(FILE_CACHE_STNS);
+  }
+  station_cfg_serial++;  // station attributes changed
+
+  // sequential groups
+  byte grp_changed = 0;
+  if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("grp"), true)) {
+    for(sid=0;sid<os.nstations && tmp_buffer[sid];sid++) {
+      if ((byte)(tmp_buffer[sid]-'0')>=NUM_SEQ_GROUPS) handle_return(HTML_DATA_OUTOFBOUND);
+    }
+    for(sid=0;sid<os.nstations && tmp_buffer[sid];sid++) {
+      os.seq_group[sid] = tmp_buffer[sid]-'0';
+    }
+    grp_changed = 1;
+  }
+  if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("gdl"), true)) {
+    char *s = tmp_buffer;
+    for(byte g=0;g<NUM_SEQ_GROUPS-1 && *s;g++) {
+      os.seq_group_delay[g] = water_time_encode_signed(atoi(s));
+      while(*s && *s!=',') s++;
+      if (*s==',') s++;
+    }
+    grp_changed = 1;
   }
+  if (grp_changed) os.seq_groups_save();
 
   /* handle special data */
   if(findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("sid"), true)) {
@@ -743,6 +901,7 @@ void server_change_stations() {
 #endif
 
       write_to_file(stns_filename, tmp_buffer, strlen(tmp_buffer)+1, stepsize*sid, false);
+      os.file_cache_invalidate(FILE_CACHE_STNS);
 
     } else {
 
@@ -844,6 +1003,7 @@ void server_change_runonce() {
   byte sid, bid, s;
   uint16_t dur;
   boolean match_found = false;
+  boolean rejected = false;
   for(sid=0;sid<os.nstations;sid++) {
     dur=parse_listdata(&pv);
     bid=sid>>3;
@@ -851,13 +1011,10 @@ void server_change_runonce() {
     // if non-zero duration is given
     // and if the station has not been disabled
     if (dur>0 && !(os.station_attrib_bits_read(ADDR_NVM_STNDISABLE+bid)&(1<<s))) {
-      RuntimeQueueStruct *q = pd.enqueue();
-      if (q) {
-        q->st = 0;
-        q->dur = water_time_resolve(dur);
-        q->pid = 254;
-        q->sid = sid;
+      if (pd.admit(sid, 254, water_time_resolve(dur), os.now_tz()) != QUEUE_REJECTED) {
         match_found = true;
+      } else {
+        rejected = true;
       }
     }
   }
@@ -865,6 +1022,7 @@ void server_change_runonce() {
     schedule_all_stations(os.now_tz());
     handle_return(HTML_SUCCESS);
   }
+  if(rejected) handle_return(HTML_QUEUE_FULL);
 
   handle_return(HTML_DATA_MISSING);
 }
@@ -1027,27 +1185,24 @@ void server_change_program() {
 }
 
 void server_json_options_main() {
-  byte oid;
+  byte oid, flags;
   for(oid=0;oid<NUM_OPTIONS;oid++) {
-    #if !defined(ARDUINO) // do not send the following parameters for non-Arduino platforms
-    if (oid==OPTION_USE_NTP     || oid==OPTION_USE_DHCP    ||
-        oid==OPTION_STATIC_IP1  || oid==OPTION_STATIC_IP2  || oid==OPTION_STATIC_IP3  || oid==OPTION_STATIC_IP4  ||
-        oid==OPTION_GATEWAY_IP1 || oid==OPTION_GATEWAY_IP2 || oid==OPTION_GATEWAY_IP3 || oid==OPTION_GATEWAY_IP4)
-        continue;
+    flags = op_flags(oid);
+    #if !defined(ARDUINO) // do not send the network setup for non-Arduino platforms
+    if (flags & OPT_IPCFG) continue;
     #endif
     int32_t v=os.options[oid];
-    if (oid==OPTION_MASTER_OFF_ADJ || oid==OPTION_MASTER_OFF_ADJ_2 ||
-        oid==OPTION_MASTER_ON_ADJ  || oid==OPTION_MASTER_ON_ADJ_2 ||
-        oid==OPTION_STATION_DELAY_TIME) {
+    if (flags & OPT_WTIME) {
       v=water_time_decode_signed(v);
     }
     #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
-    if (oid==OPTION_BOOST_TIME) {
+    if (flags & OPT_BOOST) {
       if (os.hw_type==HW_TYPE_AC) continue;
       else v<<=2;
     }
     #else
-    if (oid==OPTION_BOOST_TIME) continue;
+    if (flags & OPT_BOOST) continue;
+    if (oid==OPTION_LANE_CURR_LIMIT) continue;  // no current sensing
     #endif
 
     if (oid==OPTION_SEQUENTIAL_RETIRED) continue;
@@ -1064,11 +1219,9 @@ void server_json_options_main() {
     #endif
 #endif
 
-    // each json name takes 5 characters
-    strncpy_P0(tmp_buffer, op_json_names+oid*5, 5);
-    bfill.emit_p(PSTR("\"$S\":$D"), tmp_buffer, v);
+    reply_emit('"', PStr{op_name(oid)}, EMIT_P("\":"), v);
     if(oid!=NUM_OPTIONS-1)
-      bfill.emit_p(PSTR(","));
+      reply_emit(',');
   }
 
   bfill.emit_p(PSTR(",\"dexp\":$D,\"mexp\":$D,\"hwt\":$D}"), os.detect_exp(), MAX_EXT_BOARDS, os.hw_type);
@@ -1086,38 +1239,41 @@ void server_json_options() {
   handle_return(HTML_OK);
 }
 
+/** Output one program record */
+static void emit_program(const ProgramStruct *prog) {
+  byte i;
+  byte bytedata = *(char*)prog;
+  reply_emit('[', bytedata, ',', prog->days[0], ',', prog->days[1], EMIT_P(",["));
+  // start times data
+  for (i=0;i<MAX_NUM_STARTTIMES;i++) {
+    reply_emit(prog->starttimes[i], (i<MAX_NUM_STARTTIMES-1)?',':']');
+  }
+  reply_emit(',', '[');
+  // station water time
+  for (i=0; i<os.nstations; i++) {
+    reply_emit(prog->durations[i], (i<os.nstations-1)?',':']');
+  }
+  // program name
+  strncpy(tmp_buffer, prog->name, PROGRAM_NAME_SIZE);
+  tmp_buffer[PROGRAM_NAME_SIZE] = 0;  // make sure the string ends
+  reply_emit(',', '"', tmp_buffer, '"', ']');
+}
+
 void server_json_programs_main() {
 
-  bfill.emit_p(PSTR("\"nprogs\":$D,\"nboards\":$D,\"mnp\":$D,\"mnst\":$D,\"pnsize\":$D,\"pd\":["),
-               pd.nprograms, os.nboards, MAX_NUMBER_PROGRAMS, MAX_NUM_STARTTIMES, PROGRAM_NAME_SIZE);
-  byte pid, i;
+  // pfree: bytes left for program records
+  bfill.emit_p(PSTR("\"nprogs\":$D,\"nboards\":$D,\"mnp\":$D,\"mnst\":$D,\"pnsize\":$D,\"pfree\":$D,\"pd\":["),
+               pd.nprograms, os.nboards, MAX_NUMBER_PROGRAMS, MAX_NUM_STARTTIMES, PROGRAM_NAME_SIZE, pd.heap_free());
+  byte pid;
   ProgramStruct prog;
   for(pid=0;pid<pd.nprograms;pid++) {
     pd.read(pid, &prog);
     if (prog.type == PROGRAM_TYPE_INTERVAL && prog.days[1] > 1) {
       pd.drem_to_relative(prog.days);
     }
-
-    byte bytedata = *(char*)(&prog);
-    bfill.emit_p(PSTR("[$D,$D,$D,["), bytedata, prog.days[0], prog.days[1]);
-    // start times data
-    for (i=0;i<(MAX_NUM_STARTTIMES-1);i++) {
-      bfill.emit_p(PSTR("$D,"), prog.starttimes[i]);
-    }
-    bfill.emit_p(PSTR("$D],["), prog.starttimes[i]);  // this is the last element
-    // station water time
-    for (i=0; i<os.nstations-1; i++) {
-      bfill.emit_p(PSTR("$L,"),(unsigned long)prog.durations[i]);
-    }
-    bfill.emit_p(PSTR("$L],\""),(unsigned long)prog.durations[i]); // this is the last element
-    // program name
-    strncpy(tmp_buffer, prog.name, PROGRAM_NAME_SIZE);
-    tmp_buffer[PROGRAM_NAME_SIZE] = 0;  // make sure the string ends
-    bfill.emit_p(PSTR("$S"), tmp_buffer);
+    emit_program(&prog);
     if(pid!=pd.nprograms-1) {
-      bfill.emit_p(PSTR("\"],"));
-    } else {
-      bfill.emit_p(PSTR("\"]"));
+      reply_emit(',');
     }
     // push out a packet if available
     // buffer size is getting small
@@ -1136,6 +1292,7 @@ void server_json_programs() {
   rewind_ether_buffer();
 #endif
 
+  gzip_begin();
   print_json_header();
   server_json_programs_main();
   handle_return(HTML_OK);
@@ -1183,11 +1340,68 @@ void server_json_controller_main() {
   if(os.status.has_curr_sense) {
     uint16_t current = os.read_current();
     if(!os.status.program_busy && current<os.baseline_current) current=0;
-    bfill.emit_p(PSTR("\"curr\":$D,"), current);
+    bfill.emit_p(PSTR("\"curr\":$D,\"cstat\":[$D,$D,$D],\"csig\":["), current, os.curr_min, os.curr_avg, os.curr_max);
+    for(sid=0;sid<os.nstations;sid++) {
+      bfill.emit_p(PSTR("$D"), os.curr_signature[sid]);
+      if(sid!=os.nstations-1) bfill.emit_p(PSTR(","));
+    }
+    bfill.emit_p(PSTR("],"));
   }
 #endif
   if(os.options[OPTION_SENSOR_TYPE]==SENSOR_TYPE_FLOW) {
-    bfill.emit_p(PSTR("\"flcrt\":$L,\"flwrt\":$D,"), os.flowcount_rt, FLOWCOUNT_RT_WINDOW);
+    bfill.emit_p(PSTR("\"flcrt\":$L,\"flwrt\":$D,\"flrate\":$L,\"fljit\":$L,\"flovr\":$L,\"flleak\":$D,\"flhi\":["),
+                 os.flowcount_rt, FLOWCOUNT_RT_WINDOW, flow_rate_x100(), flow_jitter_ms, (ulong)flow_ring_overruns, flow_leak);
+    for(bid=0;bid<os.nboards;bid++) {
+      bfill.emit_p(PSTR("$D"), flow_high_bits[bid]);
+      if(bid!=os.nboards-1) bfill.emit_p(PSTR(","));
+    }
+    // per-station [volume (pulses), last rate, baseline rate (pulses per hour)]
+    bfill.emit_p(PSTR("],\"flstn\":["));
+    for(sid=0;sid<os.nstations;sid++) {
+      FlowStationStats *st = flow_stn+sid;
+      bfill.emit_p(PSTR("[$L,$D,$D]"), st->pulses, st->rate_pph, st->baseline_pph);
+      bfill.emit_p((sid<os.nstations-1)?PSTR(","):PSTR("],"));
+      if(available_ether_buffer() < 80) {
+        send_packet();
+      }
+    }
+  }
+#if defined(ARDUINO)
+  // number of bytes sent to the display since boot
+  bfill.emit_p(PSTR("\"lcdb\":$L,"), os.lcd.bus_bytes());
+#endif
+
+  // latitude/longitude (in 1/100 degree) used for local sunrise/sunset
+  if (os.geo.tag==GEOLOC_TAG) {
+    bfill.emit_p(PSTR("\"geo\":[$D,$D],"), os.geo.lat, os.geo.lon);
+  }
+
+#if defined(ARDUINO) && !defined(ESP8266)
+  // network probe targets (gateway, weather host, peers): [probes, lost, rtt (ms)]
+  bfill.emit_p(PSTR("\"net\":["));
+  for (byte i=0; i<NET_NUM_TARGETS; i++) {
+    NetTarget *t = net_targets+i;
+    bfill.emit_p(PSTR("[$D,$D,$D]"), t->n, net_losses(t), t->rtt);
+    bfill.emit_p((i<NET_NUM_TARGETS-1)?PSTR(","):PSTR("],"));
+  }
+#endif
+
+  // weather pipeline [state, failures, last step (us), longest step (us)]
+  bfill.emit_p(PSTR("\"wtdiag\":[$D,$D,$L,$L],"), weather_diag.state, weather_diag.fails,
+               weather_diag.last_us, weather_diag.max_us);
+
+#ifdef GZIP_WINDOW
+  // last gzip reply [bytes in, bytes out, compression time (us)]
+  bfill.emit_p(PSTR("\"gzs\":[$L,$L,$L],"), gz_last[0], gz_last[1], gz_last[2]);
+#endif
+
+  // runtime queue [capacity, queued, deferred, admitted, merged, deferred total, rejected]
+  bfill.emit_p(PSTR("\"qstat\":[$D,$D,$D,$L,$L,$L,$L],"), RUNTIME_QUEUE_SIZE, pd.nqueue, pd.ndeferred,
+               pd.qstats.admitted, pd.qstats.merged, pd.qstats.deferred, pd.qstats.rejected);
+
+  // makespan (in seconds) of the last lane-packed batch: [sequential plan, lane plan]
+  if (lane_span) {
+    bfill.emit_p(PSTR("\"lanes\":[$L,$L],"), lane_seq_span, lane_span);
   }
 
   bfill.emit_p(PSTR("\"sbits\":["));
@@ -1214,13 +1428,13 @@ void server_json_controller_main() {
     }
   }
 
-  if(read_from_file(wtopts_filename, tmp_buffer)) {
-    bfill.emit_p(PSTR(",\"wto\":{$S}"), tmp_buffer);
+  if(os.status.has_sd) {
+    bfill.emit_p(PSTR(",\"wto\":{$S}"), os.get_wtopts());
   }
   
 #if !defined(ARDUINO) || defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
-  if(read_from_file(ifkey_filename, tmp_buffer)) {
-    bfill.emit_p(PSTR(",\"ifkey\":\"$S\""), tmp_buffer);
+  if(os.status.has_sd) {
+    bfill.emit_p(PSTR(",\"ifkey\":\"$S\""), os.get_ifkey());
   }
 #endif
 
@@ -1386,16 +1600,104 @@ void server_change_scripturl() {
   handle_return(HTML_REDIRECT_HOME);
 }
 
+/** Set the controller latitude/longitude (in degrees)
+ * Returns false if out of range */
+static bool set_geolocation(float lat, float lon) {
+  if (lat<-90 || lat>90 || lon<-180 || lon>180) return false;
+  int16_t la = (int16_t)(lat*100+(lat<0?-0.5f:0.5f));
+  int16_t lo = (int16_t)(lon*100+(lon<0?-0.5f:0.5f));
+  if (os.geo.tag==GEOLOC_TAG && os.geo.lat==la && os.geo.lon==lo) return true;
+  os.geo.lat = la;
+  os.geo.lon = lo;
+  os.geo.tag = GEOLOC_TAG;
+  os.geo_save();
+  sun_table_build();
+  sun_update(os.now_tz());
+  return true;
+}
+
 /**
  * Change options
- * Command: /co?pw=xxx&o?=x&loc=x&wtkey=x&ttt=x
+ * Command: /co?pw=xxx&o?=x&loc=x&lat=x&lon=x&wtkey=x&ttt=x
  *
  * pw:  password
- * o?:  option name (? is option index)
- * loc: location
+ * o?:  option name (? is option index); the option's json name (e.g. tz=x) works too
+ *      a bool o? option is set by its presence (and cleared by its absence),
+ *      a bool json name takes its value (e.g. ntp=0)
+ * loc: location (a location in the form "lat,lon" also sets lat/lon)
+ * lat/lon: latitude/longitude in degrees, for local sunrise/sunset (empty lat clears them)
  * wtkey: weather underground api key
  * ttt: manual time (applicable only if ntp=0)
  */
+/** Options that cannot be set through /co (nor by a snapshot import) */
+static bool option_settable(byte oid) {
+  return !(op_flags(oid) & OPT_RO);
+}
+
+/** Check if a /co key is a legacy o? key (? is the option index) */
+static bool option_key_legacy(const char *key, int len) {
+  return len>=2 && len<=3 && key[0]=='o' && key[1]>='0' && key[1]<='9';
+}
+
+/** Option index of a /co key: o? (? is the option index) or the option's json name */
+static byte option_of_key(const char *key, int len) {
+  if (option_key_legacy(key, len)) {
+    byte oid = 0;
+    for (byte i=1; i<len; i++) {
+      if (key[i]<'0' || key[i]>'9')  return NUM_OPTIONS;
+      oid = oid*10 + (key[i]-'0');
+    }
+    return (oid<NUM_OPTIONS) ? oid : NUM_OPTIONS;
+  }
+  return option_lookup(key, len);
+}
+
+/** Set an option from its submitted value, returns false if the value is out of bound
+ * A bool option submitted as o? is set by its presence alone; by json name it takes the value */
+static bool option_set(byte oid, const char *val, bool legacy) {
+  byte max_value = op_max(oid);
+  if (max_value==1 && legacy) {
+    os.options[oid] = 1;  // if the bool variable is detected, set to 1
+    return true;
+  }
+  int32_t v = atol(val);
+  if (op_flags(oid) & OPT_WTIME)  v = water_time_encode_signed(v);
+  #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
+  if (os.hw_type==HW_TYPE_DC && (op_flags(oid) & OPT_BOOST))  v>>=2;
+  #endif
+  if (v<0 || v>max_value)  return false;
+  os.options[oid] = v;
+  return true;
+}
+
+/** Side effects of changed options (shared by /co and the snapshot import)
+ * prev: option values before the change */
+static void options_changed(const byte *prev, bool weather_change) {
+  bool time_change = false;
+  bool network_change = false;
+  for (byte oid=0; oid<NUM_OPTIONS; oid++) {
+    if (os.options[oid] != prev[oid]) {	// if value has changed
+      byte flags = op_flags(oid);
+      if (flags & OPT_TIME)     time_change = true;
+      if (flags & OPT_NET)      network_change = true;
+      if (flags & OPT_WEATHER)  weather_change = true;
+    }
+  }
+
+  if(time_change) {
+    os.status.req_ntpsync = 1;
+  }
+
+  if(weather_change) {
+    os.checkwt_lasttime = 0;  // force weather update
+  }
+
+  if(network_change) {
+    // network related options have changed
+    // this would require a restart to take effect
+  }
+}
+
 void server_change_options()
 {
 #ifdef ESP8266
@@ -1406,57 +1708,53 @@ void server_change_options()
 #endif
 
   // temporarily save some old options values
-	bool time_change = false;
 	bool weather_change = false;
-	bool network_change = false;
 
   // !!! p and bfill share the same buffer, so don't write
   // to bfill before you are done analyzing the buffer !!!
   // process option values
   byte err = 0;
-  byte prev_value;
-  byte max_value;
-  for (byte oid=0; oid<NUM_OPTIONS; oid++) {
-
-    // skip options that cannot be set through /co command
-    if (oid==OPTION_RESET || oid==OPTION_DEVICE_ENABLE ||
-        oid==OPTION_FW_VERSION || oid==OPTION_HW_VERSION ||
-        oid==OPTION_FW_MINOR || oid==OPTION_SEQUENTIAL_RETIRED ||
-        oid==OPTION_REMOTE_EXT_MODE)
-      continue;
-    prev_value = os.options[oid];
-    max_value = pgm_read_byte(op_max+oid);
-    if (max_value==1)  os.options[oid] = 0;  // set a bool variable to 0 first
-    char tbuf2[5] = {'o', 0, 0, 0, 0};
-    itoa(oid, tbuf2+1, 10);
-    if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, tbuf2)) {
-      if (max_value==1) {
-        os.options[oid] = 1;  // if the bool variable is detected, set to 1
-      } else {
-		    int32_t v = atol(tmp_buffer);
-		    if (oid==OPTION_MASTER_OFF_ADJ || oid==OPTION_MASTER_OFF_ADJ_2 ||
-		        oid==OPTION_MASTER_ON_ADJ  || oid==OPTION_MASTER_ON_ADJ_2  ||
-		        oid==OPTION_STATION_DELAY_TIME) {
-		      v=water_time_encode_signed(v);
-		    } // encode station delay time
-        #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || defined(ESP8266)
-        if(os.hw_type==HW_TYPE_DC && oid==OPTION_BOOST_TIME) {
-           v>>=2;
-        }
-        #endif
-        if (v>=0 && v<=max_value) {
-          os.options[oid] = v;
-		    } else {
-		      err = 1;
-		    }
-		  }
+  byte oid;
+  byte prev[NUM_OPTIONS];
+  memcpy(prev, os.options, NUM_OPTIONS);
+  byte submitted[(NUM_OPTIONS+7)/8];  // options present in the request
+  memset(submitted, 0, sizeof(submitted));
+  bool legacy = false;
+  // one lookup per submitted key, instead of a search for every option
+#ifdef ESP8266
+  for (int i=0; i<wifi_server->args(); i++) {
+    String key = wifi_server->argName(i);
+    bool lk = option_key_legacy(key.c_str(), key.length());
+    oid = option_of_key(key.c_str(), key.length());
+    if (oid>=NUM_OPTIONS || !option_settable(oid))  continue;
+    if (!option_set(oid, wifi_server->arg(i).c_str(), lk))  err = 1;
+    submitted[oid>>3] |= 1<<(oid&0x07);
+    if (lk)  legacy = true;
+  }
+#else
+  const char *s = p;
+  while (*s && *s!=' ' && *s!='\n') {
+    const char *key = s;
+    while (*s && *s!=' ' && *s!='\n' && *s!='&' && *s!='=') s++;
+    int len = s-key;
+    if (*s=='=') {
+      bool lk = option_key_legacy(key, len);
+      oid = option_of_key(key, len);
+      if (oid<NUM_OPTIONS && option_settable(oid)) {
+        if (!option_set(oid, s+1, lk))  err = 1;
+        submitted[oid>>3] |= 1<<(oid&0x07);
+        if (lk)  legacy = true;
+      }
     }
-    if (os.options[oid] != prev_value) {	// if value has changed
-    	if (oid==OPTION_TIMEZONE || oid==OPTION_USE_NTP)    time_change = true;
-    	if (oid>=OPTION_NTP_IP1 && oid<=OPTION_NTP_IP4)     time_change = true;
-    	if (oid>=OPTION_USE_DHCP && oid<=OPTION_HTTPPORT_1) network_change = true;
-    	if (oid==OPTION_DEVICE_ID)  network_change = true;
-      if (oid==OPTION_USE_WEATHER) weather_change = true;
+    while (*s && *s!=' ' && *s!='\n' && *s!='&') s++;
+    if (*s=='&') s++;
+  }
+#endif
+  if (legacy) {
+    // the o? form only submits the bool options that are set, so clear the others
+    for (oid=0; oid<NUM_OPTIONS; oid++) {
+      if (option_settable(oid) && op_max(oid)==1 && !(submitted[oid>>3]&(1<<(oid&0x07))))
+        os.options[oid] = 0;
     }
   }
 
@@ -1467,8 +1765,30 @@ void server_change_options()
       nvm_write_block(tmp_buffer, (void*)ADDR_NVM_LOCATION, strlen(tmp_buffer)+1);
       weather_change = true;
     }
+    // a "lat,lon" location gives the coordinates directly
+    char *end, *end2;
+    float lat = strtod(tmp_buffer, &end);
+    if (end!=tmp_buffer && *end==',') {
+      float lon = strtod(end+1, &end2);
+      if (end2!=end+1 && *end2==0 && !set_geolocation(lat, lon)) err = 1;
+    }
   }
   uint8_t keyfound = 0;
+  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("lat"), true, &keyfound)) {
+    float lat = atof(tmp_buffer);
+    if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("lon"), true)) {
+      if (!set_geolocation(lat, atof(tmp_buffer))) err = 1;
+    } else {
+      err = 1;
+    }
+  } else if (keyfound && os.geo.tag==GEOLOC_TAG) {
+    // clear the coordinates: sunrise/sunset come from the weather script again
+    os.geo.tag = 0;
+    os.geo_save();
+    sun_table_build();
+    weather_change = true;
+  }
+  keyfound = 0;
   if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("wtkey"), true, &keyfound)) {
     urlDecode(tmp_buffer);
     tmp_buffer[MAX_WEATHER_KEY-1]=0;
@@ -1485,9 +1805,11 @@ void server_change_options()
     urlDecode(tmp_buffer);
     tmp_buffer[TMP_BUFFER_SIZE-1]=0;
     write_to_file(ifkey_filename, tmp_buffer, strlen(tmp_buffer));
+    os.file_cache_invalidate(FILE_CACHE_IFKEY);
   } else if (keyfound) {
     tmp_buffer[0]=0;
     write_to_file(ifkey_filename, tmp_buffer, strlen(tmp_buffer));
+    os.file_cache_invalidate(FILE_CACHE_IFKEY);
   }  
   // if not using NTP and manually setting time
   if (!os.options[OPTION_USE_NTP] && findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("ttt"), true)) {
@@ -1505,24 +1827,14 @@ void server_change_options()
     tmp_buffer[TMP_BUFFER_SIZE-1]=0;
     // store weather key
     write_to_file(wtopts_filename, tmp_buffer, strlen(tmp_buffer));
+    os.file_cache_invalidate(FILE_CACHE_WTOPTS);
     weather_change = true;
   }
   if (err)  handle_return(HTML_DATA_OUTOFBOUND);
 
   os.options_save();
-
-  if(time_change) {
-    os.status.req_ntpsync = 1;
-  }
-
-  if(weather_change) {
-    os.checkwt_lasttime = 0;  // force weather update
-  }
-
-  if(network_change) {
-    // network related options have changed
-    // this would require a restart to take effect
-  }
+  station_cfg_serial++;  // master and station options may have changed
+  options_changed(prev, weather_change);
 
   handle_return(HTML_SUCCESS);
 }
@@ -1564,8 +1876,8 @@ void server_json_status_main() {
   byte sid;
 
   for (sid=0;sid<os.nstations;sid++) {
-    bfill.emit_p(PSTR("$D"), (os.station_bits[(sid>>3)]>>(sid&0x07))&1);
-    if(sid!=os.nstations-1) bfill.emit_p(PSTR(","));
+    reply_emit((byte)((os.station_bits[(sid>>3)]>>(sid&0x07))&1));
+    if(sid!=os.nstations-1) reply_emit(',');
   }
   //bfill.emit_p(PSTR("],\"nstations\":$D}"), os.nstations);
 #ifdef OPENSPRINKLER_BME280 // Utilisation d'un capteur BME280 I2C
@@ -1646,24 +1958,18 @@ void server_change_manual() {
       if ((os.status.mas==sid+1) || (os.status.mas2==sid+1))
         handle_return(HTML_NOT_PERMITTED);
 
-      RuntimeQueueStruct *q = NULL;
       byte sqi = pd.station_qid[sid];
       // check if the station already has a schedule
       if (sqi!=0xFF) {  // if we, we will overwrite the schedule
-        q = pd.queue+sqi;
-      } else {  // otherwise create a new queue element
-        q = pd.enqueue();
-      }
-      // if the queue is not full
-      if (q) {
+        RuntimeQueueStruct *q = pd.queue+sqi;
         q->st = 0;
         q->dur = timer;
         q->sid = sid;
         q->pid = 99;  // testing stations are assigned program index 99
-        schedule_all_stations(curr_time);
-      } else {
-        handle_return(HTML_NOT_PERMITTED);
+      } else if (pd.admit(sid, 99, timer, curr_time) == QUEUE_REJECTED) {  // otherwise add a new run
+        handle_return(HTML_QUEUE_FULL);
       }
+      schedule_all_stations(curr_time);
     } else {
       handle_return(HTML_DATA_MISSING);
     }
@@ -1742,13 +2048,18 @@ void server_json_log() {
   if (findKeyVal(p, type, 4, PSTR("type"), true))
     type_specified = true;
 
+  gzip_begin();
 #ifdef ESP8266
   // as the log data can be large, we will use ESP8266's sendContent function to
   // send multiple packets of data, instead of the standard way of using send().
   rewind_ether_buffer();
-  bfill.emit_p(PSTR("$F$F$F$F\r\n"), html200OK, htmlContentJSON, htmlAccessControl, htmlNoCache);
-  wifi_server->sendContent(ether_buffer);
-  rewind_ether_buffer();
+  if (gzip_active()) {
+    print_json_header(false);
+  } else {
+    bfill.emit_p(PSTR("$F$F$F$F\r\n"), html200OK, htmlContentJSON, htmlAccessControl, htmlNoCache);
+    wifi_server->sendContent(ether_buffer);
+    rewind_ether_buffer();
+  }
 #else
   print_json_header(false);
 #endif
@@ -1836,6 +2147,87 @@ void server_json_log() {
   handle_return(HTML_OK);
 #endif
 }
+/**
+ * Get daily rollups
+ * Command: /jr?start=x&end=x&hist=x
+ *
+ * hist, start, end: same as /jl
+ * Each day with log data outputs one record:
+ * d: day (epoch time / 86400), wl: last water level (-1: none),
+ * rd/rs: rain delay / rain sensed seconds, fl: flow pulses (see fpr),
+ * fa: flow alerts, st: [station index, run seconds, run count] of watered stations
+ */
+void server_json_rollup() {
+
+#ifdef ESP8266
+  char* p = NULL;
+  if(!process_password()) return;
+#else
+  char* p = get_buffer;
+#endif
+
+  if (!os.status.has_sd)  handle_return(HTML_PAGE_NOT_FOUND);
+
+  unsigned int start, end;
+
+  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("hist"), true)) {
+    int hist = atoi(tmp_buffer);
+    if (hist< 0 || hist > 365) handle_return(HTML_DATA_OUTOFBOUND);
+    end = os.now_tz() / 86400L;
+    start = end - hist;
+  } else {
+    if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("start"), true)) handle_return(HTML_DATA_MISSING);
+    start = atol(tmp_buffer) / 86400L;
+    if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("end"), true)) handle_return(HTML_DATA_MISSING);
+    end = atol(tmp_buffer) / 86400L;
+    if ((start>end) || (end-start)>365)  handle_return(HTML_DATA_OUTOFBOUND);
+  }
+
+#ifdef ESP8266
+  rewind_ether_buffer();
+  bfill.emit_p(PSTR("$F$F$F$F\r\n"), html200OK, htmlContentJSON, htmlAccessControl, htmlNoCache);
+  wifi_server->sendContent(ether_buffer);
+  rewind_ether_buffer();
+#else
+  print_json_header(false);
+#endif
+
+  bfill.emit_p(PSTR("{\"fpr\":$D,\"days\":["),
+               (os.options[OPTION_PULSE_RATE_1]<<8)+os.options[OPTION_PULSE_RATE_0]);
+
+  // days are read one at a time into the shared rollup buffer
+  bool comma = 0;
+  for(unsigned int i=start;i<=end;i++) {
+    if (!read_rollup(i))  continue;
+    if (comma)  bfill.emit_p(PSTR(","));
+    else {comma=1;}
+    bfill.emit_p(PSTR("{\"d\":$D,\"wl\":$D,\"rd\":$L,\"rs\":$L,\"fl\":$L,\"fa\":$D,\"st\":["),
+                 rollup.day, (rollup.wl==255)?-1:(int)rollup.wl, rollup.rd_secs, rollup.rs_secs, rollup.flow, rollup.alerts);
+    bool scomma = 0;
+    for(byte sid=0;sid<os.nstations;sid++) {
+      if (!rollup.runs[sid])  continue;
+      if (scomma)  bfill.emit_p(PSTR(","));
+      else {scomma=1;}
+      bfill.emit_p(PSTR("[$D,$L,$D]"), sid, rollup.run_secs[sid], rollup.runs[sid]);
+      if (available_ether_buffer() < 80) {
+        send_packet();
+      }
+    }
+    bfill.emit_p(PSTR("]}"));
+    if (available_ether_buffer() < 80) {
+      send_packet();
+    }
+  }
+
+  bfill.emit_p(PSTR("]}"));
+  INSERT_DELAY(1);
+#ifdef ESP8266
+  send_packet(true);
+#else
+  handle_return(HTML_OK);
+#endif
+}
+
 /**
  * Delete log
  * Command: /dl?pw=xxx&day=xxx
@@ -1861,32 +2253,534 @@ void server_delete_log() {
   handle_return(HTML_SUCCESS);
 }
 
-/** Output all JSON data, including jc, jp, jo, js, jn */
+#ifdef EMIT_BENCHMARK
+/** Serialization time of the /ja program records and options:
+ * the emit_p format interpreter against the typed writer.
+ * Each side renders every record EMIT_BENCHMARK times into the reply buffer
+ * (program reads are not timed). Result: [interpreter us, typed us, bytes, same output] */
+static ulong ebench[4];
+
+static void emit_benchmark() {
+  ulong t;
+  uint16_t crc_a = 0xFFFF, crc_b = 0xFFFF;
+  byte pid, i, r, oid;
+  ProgramStruct prog;
+  ebench[0] = ebench[1] = ebench[2] = 0;
+  for (pid=0; pid<pd.nprograms; pid++) {
+    pd.read(pid, &prog);
+    for (r=0; r<EMIT_BENCHMARK; r++) {
+      rewind_ether_buffer();
+      t = micros();
+      bfill.emit_p(PSTR("[$D,$D,$D,["), (byte)*(char*)(&prog), prog.days[0], prog.days[1]);
+      for (i=0;i<(MAX_NUM_STARTTIMES-1);i++) {
+        bfill.emit_p(PSTR("$D,"), prog.starttimes[i]);
+      }
+      bfill.emit_p(PSTR("$D],["), prog.starttimes[i]);
+      for (i=0; i<os.nstations-1; i++) {
+        bfill.emit_p(PSTR("$L,"),(unsigned long)prog.durations[i]);
+      }
+      bfill.emit_p(PSTR("$L],\""),(unsigned long)prog.durations[i]);
+      strncpy(tmp_buffer, prog.name, PROGRAM_NAME_SIZE);
+      tmp_buffer[PROGRAM_NAME_SIZE] = 0;
+      bfill.emit_p(PSTR("$S\"]"), tmp_buffer);
+      ebench[0] += micros() - t;
+      if (!r)  crc_a = crc16(crc_a, (const byte*)bfill.buffer(), bfill.position());
+
+      rewind_ether_buffer();
+      t = micros();
+      emit_program(&prog);
+      ebench[1] += micros() - t;
+      if (!r) {
+        crc_b = crc16(crc_b, (const byte*)bfill.buffer(), bfill.position());
+        ebench[2] += bfill.position();
+      }
+    }
+  }
+  for (r=0; r<EMIT_BENCHMARK; r++) {
+    rewind_ether_buffer();
+    t = micros();
+    for (oid=0; oid<NUM_OPTIONS; oid++) {
+      strncpy_P0(tmp_buffer, op_name(oid), 5);
+      bfill.emit_p(PSTR("\"$S\":$D,"), tmp_buffer, os.options[oid]);
+    }
+    ebench[0] += micros() - t;
+    if (!r)  crc_a = crc16(crc_a, (const byte*)bfill.buffer(), bfill.position());
+
+    rewind_ether_buffer();
+    t = micros();
+    for (oid=0; oid<NUM_OPTIONS; oid++) {
+      strncpy_P0(tmp_buffer, op_name(oid), 5);
+      reply_emit('"', tmp_buffer, EMIT_P("\":"), os.options[oid], ',');
+    }
+    ebench[1] += micros() - t;
+    if (!r) {
+      crc_b = crc16(crc_b, (const byte*)bfill.buffer(), bfill.position());
+      ebench[2] += bfill.position();
+    }
+  }
+  ebench[3] = (crc_a == crc_b);
+  rewind_ether_buffer();
+}
+#endif
+
+/* /ja sections, in output order: each name must be strictly
+ * 8 characters (padded with 0) with an ending 0, so 9 characters total */
+#define JA_NUM_SECTIONS 5
+static const char ja_section_names[] PROGMEM =
+    "settings\0"
+    "programs\0"
+    "options\0\0"
+    "status\0\0\0"
+    "stations\0";
+
+typedef void (*JsonSection)(void);
+static const JsonSection ja_sections[JA_NUM_SECTIONS] = {
+  server_json_controller_main,
+  server_json_programs_main,
+  server_json_options_main,
+  server_json_status_main,
+  server_json_stations_main
+};
+
+/** Output all JSON data, including jc, jp, jo, js, jn
+ * Command: /ja?fields=x
+ *
+ * fields: sections to output (optional), e.g. status,settings
+ *         if unspecified, output all sections
+ * secus:  time spent generating each section (in us, 0: skipped)
+ */
 void server_json_all() {
 #ifdef ESP8266
+  char* p = NULL;
   if(!process_password(true)) return;
   rewind_ether_buffer();
+#else
+  char* p = get_buffer;
+#endif
+
+  // pick the sections named in fields
+  byte fields = (1<<JA_NUM_SECTIONS)-1;
+  byte i;
+  char name[9];
+  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("fields"), true)) {
+    fields = 0;
+    for (i=0; i<JA_NUM_SECTIONS; i++) {
+      strcpy_P(name, ja_section_names+i*9);
+      if (strstr(tmp_buffer, name))  fields |= (1<<i);
+    }
+  }
+
+#ifdef EMIT_BENCHMARK
+  emit_benchmark();
 #endif
+  gzip_begin();
   print_json_header();
-  bfill.emit_p(PSTR("\"settings\":{"));
-  server_json_controller_main();
-  send_packet();
-  bfill.emit_p(PSTR(",\"programs\":{"));
-  server_json_programs_main();
-  send_packet();
-  bfill.emit_p(PSTR(",\"options\":{"));
-  server_json_options_main();
-  send_packet();
-  bfill.emit_p(PSTR(",\"status\":{"));
-  server_json_status_main();
-  send_packet();
-  bfill.emit_p(PSTR(",\"stations\":{"));
-  server_json_stations_main();
+  ulong secus[JA_NUM_SECTIONS];
+  bool comma = 0;
+  for (i=0; i<JA_NUM_SECTIONS; i++) {
+    secus[i] = 0;
+    if (!(fields & (1<<i)))  continue;
+    if (comma)  bfill.emit_p(PSTR(","));
+    else {comma=1;}
+    bfill.emit_p(PSTR("\"$F\":{"), ja_section_names+i*9);
+    ulong t = micros();
+    (ja_sections[i])();
+    secus[i] = micros() - t;
+    send_packet();
+  }
+  bfill.emit_p(comma ? PSTR(",\"secus\":[") : PSTR("\"secus\":["));
+  for (i=0; i<JA_NUM_SECTIONS; i++) {
+    reply_emit(secus[i], (i<JA_NUM_SECTIONS-1)?',':']');
+  }
+#ifdef EMIT_BENCHMARK
+  bfill.emit_p(PSTR(",\"ebench\":[$L,$L,$L,$L]"), ebench[0], ebench[1], ebench[2], ebench[3]);
+#endif
   bfill.emit_p(PSTR("}"));
   INSERT_DELAY(1);
   handle_return(HTML_OK);
 }
 
+/* Configuration snapshot
+ * A byte stream, transferred in hex:
+ *   header:   'O','S','X',snapshot version,fw version,ext boards,station name size,
+ *             number of options,program type version,special data size
+ *   sections: [type][len lo][len hi][payload], one of each type
+ *   trailer:  CRC-16 of everything before it (lo, hi)
+ * The header must match the importing firmware exactly.
+ */
+#define SNAP_VERSION        2
+#define SNAP_HEADER_SIZE    10
+#define SNAP_CHUNK          32  // bytes moved per step
+
+#define SNAP_OPTIONS        1   // options[]
+#define SNAP_STATIONS       2   // station names and attribute bits, as in nvm
+#define SNAP_SPECIAL        3   // [sid][StationSpecialData] of each special station, by sid
+#define SNAP_GROUPS         4   // sequential group of each station, then group delays
+#define SNAP_PROGRAMS       5   // program records, in program order
+#define SNAP_GEO            6   // latitude lo/hi, longitude lo/hi, tag
+#define SNAP_LAST           SNAP_GEO
+#define SNAP_ALL_SECTIONS   0x7E
+
+#define SNAP_STATIONS_SIZE  (ADDR_NVM_OPTIONS-ADDR_NVM_STN_NAMES)
+#define SNAP_SPECIAL_SIZE   (1+sizeof(StationSpecialData))
+#define SNAP_GROUPS_SIZE    (MAX_NUM_STATIONS+NUM_SEQ_GROUPS-1)
+#define SNAP_GEO_SIZE       5
+
+static uint16_t snap_crc;
+static uint16_t snap_len;
+
+static void snap_header(byte *h) {
+  h[0]='O'; h[1]='S'; h[2]='X';
+  h[3]=SNAP_VERSION;
+  h[4]=OS_FW_VERSION;
+  h[5]=MAX_EXT_BOARDS;
+  h[6]=STATION_NAME_SIZE;
+  h[7]=NUM_OPTIONS;
+  h[8]=PROGRAM_TYPE_VERSION;
+  h[9]=sizeof(StationSpecialData);
+}
+
+static bool snap_special(byte sid) {
+  return os.station_attrib_bits_read(ADDR_NVM_STNSPE+(sid>>3))&(1<<(sid&0x07));
+}
+
+/** Output snapshot bytes in hex, keeping the running length and CRC */
+static void snap_emit(const byte *p, uint16_t n) {
+  char hex[2*SNAP_CHUNK+1];
+  snap_crc = crc16(snap_crc, p, n);
+  snap_len += n;
+  while (n) {
+    byte k = (n>SNAP_CHUNK) ? SNAP_CHUNK : n;
+    for (byte i=0; i<k; i++) {
+      byte hi = p[i]>>4, lo = p[i]&0x0F;
+      hex[2*i]   = (hi<10) ? ('0'+hi) : ('a'+hi-10);
+      hex[2*i+1] = (lo<10) ? ('0'+lo) : ('a'+lo-10);
+    }
+    hex[2*k] = 0;
+    bfill.emit_p(PSTR("$S"), hex);
+    if (available_ether_buffer() < 250) {
+      send_packet();
+    }
+    p += k;
+    n -= k;
+  }
+}
+
+static void snap_emit_section(byte type, uint16_t len) {
+  byte h[3] = {type, (byte)len, (byte)(len>>8)};
+  snap_emit(h, 3);
+}
+
+/** Read n bytes at pos of the staged snapshot */
+static bool snap_read(uint16_t pos, byte *dst, uint16_t n) {
+  char hex[2*SNAP_CHUNK+2];
+  while (n) {
+    byte k = (n>SNAP_CHUNK) ? SNAP_CHUNK : n;
+    read_from_file(snap_filename, hex, 2*k+1, 2*pos);
+    if (strlen(hex) < 2*k) return false;
+    for (byte i=0; i<k; i++) {
+      dst[i] = (h2int(hex[2*i])<<4) | h2int(hex[2*i+1]);
+    }
+    pos += k;
+    dst += k;
+    n -= k;
+  }
+  return true;
+}
+
+/** Validate a staged snapshot of len bytes, and find its sections */
+static byte snap_check(uint16_t len, uint16_t *at, uint16_t *sz) {
+  byte buf[PROGRAM_RECORD_MAX];
+  ProgramStruct prog;
+  uint16_t pos, end, i, crc = 0xFFFF;
+  byte k, seen = 0;
+
+  // 1. integrity
+  if (len < SNAP_HEADER_SIZE+2) return HTML_DATA_FORMATERROR;
+  len -= 2;
+  for (pos=0; pos<len; pos+=k) {
+    k = (len-pos>SNAP_CHUNK) ? SNAP_CHUNK : (len-pos);
+    if (!snap_read(pos, buf, k)) return HTML_DATA_FORMATERROR;
+    crc = crc16(crc, buf, k);
+  }
+  if (!snap_read(len, buf, 2) || crc != (buf[0] | ((uint16_t)buf[1]<<8)))
+    return HTML_DATA_FORMATERROR;
+
+  // 2. same firmware and nvm layout
+  byte h[SNAP_HEADER_SIZE];
+  snap_header(h);
+  snap_read(0, buf, SNAP_HEADER_SIZE);
+  if (memcmp(buf, h, SNAP_HEADER_SIZE)) return HTML_MISMATCH;
+
+  // 3. section contents
+  for (pos=SNAP_HEADER_SIZE; pos<len; pos=end) {
+    if (pos+3 > len) return HTML_DATA_FORMATERROR;
+    snap_read(pos, buf, 3);
+    byte type = buf[0];
+    pos += 3;
+    end = pos + (buf[1] | ((uint16_t)buf[2]<<8));
+    if (type<SNAP_OPTIONS || type>SNAP_LAST || (seen&(1<<type)) || end>len)
+      return HTML_DATA_FORMATERROR;
+    seen |= 1<<type;
+    at[type] = pos;
+    sz[type] = end-pos;
+
+    switch (type) {
+    case SNAP_OPTIONS:
+      if (sz[type] != NUM_OPTIONS) return HTML_DATA_FORMATERROR;
+      for (i=0; i<NUM_OPTIONS; i+=k) {
+        k = (NUM_OPTIONS-i>SNAP_CHUNK) ? SNAP_CHUNK : (NUM_OPTIONS-i);
+        snap_read(pos+i, buf, k);
+        for (byte j=0; j<k; j++) {
+          if (option_settable(i+j) && buf[j] > op_max(i+j))
+            return HTML_DATA_OUTOFBOUND;
+        }
+      }
+      break;
+
+    case SNAP_STATIONS:
+      if (sz[type] != SNAP_STATIONS_SIZE) return HTML_DATA_FORMATERROR;
+      break;
+
+    case SNAP_SPECIAL: {
+      if (sz[type] % SNAP_SPECIAL_SIZE) return HTML_DATA_FORMATERROR;
+      int last = -1;
+      for (i=pos; i<end; i+=SNAP_SPECIAL_SIZE) {
+        snap_read(i, buf, 1);
+        if ((int)buf[0] <= last || buf[0] >= MAX_NUM_STATIONS) return HTML_DATA_FORMATERROR;
+        last = buf[0];
+      }
+      } break;
+
+    case SNAP_GROUPS:
+      if (sz[type] != SNAP_GROUPS_SIZE) return HTML_DATA_FORMATERROR;
+      for (i=0; i<SNAP_GROUPS_SIZE; i+=k) {
+        k = (SNAP_GROUPS_SIZE-i>SNAP_CHUNK) ? SNAP_CHUNK : (SNAP_GROUPS_SIZE-i);
+        snap_read(pos+i, buf, k);
+        for (byte j=0; j<k; j++) {
+          if (i+j < MAX_NUM_STATIONS ? (buf[j] >= NUM_SEQ_GROUPS) : (buf[j] > 240))
+            return HTML_DATA_OUTOFBOUND;
+        }
+      }
+      break;
+
+    case SNAP_PROGRAMS: {
+      byte n = 0;
+      uint16_t total = 0;
+      for (i=pos; i<end; i+=buf[0]) {
+        snap_read(i, buf, 1);
+        if (buf[0] > PROGRAM_RECORD_MAX || buf[0] < 2 || i+buf[0] > end) return HTML_DATA_FORMATERROR;
+        snap_read(i, buf, buf[0]);
+        if (!pd.decode_record(buf, &prog)) return HTML_DATA_FORMATERROR;
+        total += buf[0];
+        if (++n > MAX_NUMBER_PROGRAMS || total > ADDR_PROGRAMEND-ADDR_PROGRAMHEAP)
+          return HTML_DATA_OUTOFBOUND;
+      }
+      } break;
+
+    case SNAP_GEO: {
+      if (sz[type] != SNAP_GEO_SIZE) return HTML_DATA_FORMATERROR;
+      snap_read(pos, buf, SNAP_GEO_SIZE);
+      int16_t lat = buf[0] | ((uint16_t)buf[1]<<8);
+      int16_t lon = buf[2] | ((uint16_t)buf[3]<<8);
+      if (buf[4]==GEOLOC_TAG && (lat<-9000 || lat>9000 || lon<-18000 || lon>18000))
+        return HTML_DATA_OUTOFBOUND;
+      } break;
+    }
+  }
+  if (seen != SNAP_ALL_SECTIONS) return HTML_DATA_MISSING;
+  return HTML_SUCCESS;
+}
+
+/** Apply a snapshot that passed snap_check */
+static void snap_apply(const uint16_t *at, const uint16_t *sz) {
+  byte buf[PROGRAM_RECORD_MAX];
+  ProgramStruct prog;
+  uint16_t i, pos;
+  byte k, sid;
+
+  byte prev[NUM_OPTIONS];
+  memcpy(prev, os.options, NUM_OPTIONS);
+
+  reset_all_stations_immediate();
+  nvm_begin();
+  // options, except the ones /co cannot change either
+  for (i=0; i<NUM_OPTIONS; i+=k) {
+    k = (NUM_OPTIONS-i>SNAP_CHUNK) ? SNAP_CHUNK : (NUM_OPTIONS-i);
+    snap_read(at[SNAP_OPTIONS]+i, buf, k);
+    for (byte j=0; j<k; j++) {
+      if (option_settable(i+j)) os.options[i+j] = buf[j];
+    }
+  }
+  os.options_save();
+  // station names and attribute bits
+  for (i=0; i<SNAP_STATIONS_SIZE; i+=k) {
+    k = (SNAP_STATIONS_SIZE-i>SNAP_CHUNK) ? SNAP_CHUNK : (SNAP_STATIONS_SIZE-i);
+    snap_read(at[SNAP_STATIONS]+i, buf, k);
+    nvm_write_block(buf, (void *)(ADDR_NVM_STN_NAMES+i), k);
+  }
+  // programs
+  pd.eraseall();
+  for (i=at[SNAP_PROGRAMS]; i<at[SNAP_PROGRAMS]+sz[SNAP_PROGRAMS]; i+=buf[0]) {
+    snap_read(i, buf, 1);
+    snap_read(i, buf, buf[0]);
+    pd.decode_record(buf, &prog);
+    pd.add(&prog);
+  }
+  nvm_commit();
+
+  // special station data: one record per station, standard unless in the snapshot
+  int stepsize = sizeof(StationSpecialData);
+  remove_file(stns_filename);
+  pos = at[SNAP_SPECIAL];
+  for (sid=0; sid<MAX_NUM_STATIONS; sid++) {
+    if (pos < at[SNAP_SPECIAL]+sz[SNAP_SPECIAL] && snap_read(pos, buf, 1) && buf[0]==sid) {
+      snap_read(pos+1, (byte *)tmp_buffer, stepsize);
+      pos += SNAP_SPECIAL_SIZE;
+    } else {
+      tmp_buffer[0] = STN_TYPE_STANDARD;
+      tmp_buffer[1] = '0';
+      tmp_buffer[2] = 0;
+    }
+    write_to_file(stns_filename, tmp_buffer, stepsize, sid*stepsize, false);
+  }
+  // sequential groups
+  snap_read(at[SNAP_GROUPS], os.seq_group, MAX_NUM_STATIONS);
+  snap_read(at[SNAP_GROUPS]+MAX_NUM_STATIONS, os.seq_group_delay, NUM_SEQ_GROUPS-1);
+  os.seq_groups_save();
+  // geolocation, so sunrise/sunset follow the restored time zone and coordinates
+  snap_read(at[SNAP_GEO], buf, SNAP_GEO_SIZE);
+  os.geo.lat = buf[0] | ((uint16_t)buf[1]<<8);
+  os.geo.lon = buf[2] | ((uint16_t)buf[3]<<8);
+  os.geo.tag = (buf[4]==GEOLOC_TAG) ? GEOLOC_TAG : 0;
+  os.geo_save();
+  sun_table_build();
+  if (os.geo.tag==GEOLOC_TAG) sun_update(os.now_tz());
+
+  remove_file(snap_filename);
+  os.file_cache_invalidate(FILE_CACHE_STNS);
+  station_cfg_serial++;
+  options_changed(prev, true);  // time, ntp and weather follow the restored options
+}
+
+/**
+ * Export a configuration snapshot: options, station names and
+ * attributes, special station data, sequential groups, programs and
+ * geolocation
+ * Command: /jx?pw=xxx
+ * Output: {"snap":"<hex>","len":x}
+ */
+void server_json_snapshot() {
+#ifdef ESP8266
+  if(!process_password()) return;
+  rewind_ether_buffer();
+#endif
+  byte buf[PROGRAM_RECORD_MAX];
+  byte sid, pid, n;
+  uint16_t len;
+
+  print_json_header();
+  bfill.emit_p(PSTR("\"snap\":\""));
+  snap_crc = 0xFFFF;
+  snap_len = 0;
+  snap_header(buf);
+  snap_emit(buf, SNAP_HEADER_SIZE);
+
+  snap_emit_section(SNAP_OPTIONS, NUM_OPTIONS);
+  snap_emit(os.options, NUM_OPTIONS);
+
+  snap_emit_section(SNAP_STATIONS, SNAP_STATIONS_SIZE);
+  for (len=0; len<SNAP_STATIONS_SIZE; len+=n) {
+    n = (SNAP_STATIONS_SIZE-len>SNAP_CHUNK) ? SNAP_CHUNK : (SNAP_STATIONS_SIZE-len);
+    nvm_read_block(buf, (void *)(ADDR_NVM_STN_NAMES+len), n);
+    snap_emit(buf, n);
+  }
+
+  int stepsize = sizeof(StationSpecialData);
+  for (sid=0, n=0; sid<MAX_NUM_STATIONS; sid++) {
+    if (snap_special(sid)) n++;
+  }
+  snap_emit_section(SNAP_SPECIAL, n*SNAP_SPECIAL_SIZE);
+  for (sid=0; sid<MAX_NUM_STATIONS; sid++) {
+    if (!snap_special(sid)) continue;
+    memset(tmp_buffer, 0, stepsize);
+    read_from_file(stns_filename, tmp_buffer, stepsize, sid*stepsize);
+    snap_emit(&sid, 1);
+    snap_emit((byte *)tmp_buffer, stepsize);
+  }
+
+  snap_emit_section(SNAP_GROUPS, SNAP_GROUPS_SIZE);
+  snap_emit(os.seq_group, MAX_NUM_STATIONS);
+  snap_emit(os.seq_group_delay, NUM_SEQ_GROUPS-1);
+
+  for (pid=0, len=0; pid<pd.nprograms; pid++) {
+    len += pd.read_record(pid, buf);
+  }
+  snap_emit_section(SNAP_PROGRAMS, len);
+  for (pid=0; pid<pd.nprograms; pid++) {
+    snap_emit(buf, pd.read_record(pid, buf));
+  }
+
+  snap_emit_section(SNAP_GEO, SNAP_GEO_SIZE);
+  buf[0] = os.geo.lat&0xFF;
+  buf[1] = (os.geo.lat>>8)&0xFF;
+  buf[2] = os.geo.lon&0xFF;
+  buf[3] = (os.geo.lon>>8)&0xFF;
+  buf[4] = os.geo.tag;
+  snap_emit(buf, SNAP_GEO_SIZE);
+
+  len = snap_crc;
+  buf[0] = len&0xFF;
+  buf[1] = len>>8;
+  snap_emit(buf, 2);
+  bfill.emit_p(PSTR("\",\"len\":$D}"), snap_len);
+  INSERT_DELAY(1);
+  handle_return(HTML_OK);
+}
+
+/**
+ * Import a configuration snapshot made by /jx
+ * Command: /ix?pw=xxx&o=x&d=xxx
+ *          /ix?pw=xxx&len=x
+ *
+ * o:   byte offset of this chunk (0 starts a new snapshot)
+ * d:   chunk data in hex
+ * len: total length of the staged snapshot; the whole snapshot is
+ *      checked first, then applied in one nvm transaction
+ */
+void server_import_snapshot() {
+#ifdef ESP8266
+  char* p = NULL;
+  if(!process_password()) return;
+#else
+  char* p = get_buffer;
+#endif
+  if (!os.status.has_sd)  handle_return(HTML_PAGE_NOT_FOUND);
+
+  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("len"), true)) {
+    uint16_t at[SNAP_LAST+1], sz[SNAP_LAST+1];
+    byte ret = snap_check(atol(tmp_buffer), at, sz);
+    if (ret != HTML_SUCCESS)  handle_return(ret);
+    snap_apply(at, sz);
+    handle_return(HTML_SUCCESS);
+  }
+
+  if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("o"), true))
+    handle_return(HTML_DATA_MISSING);
+  uint16_t off = atol(tmp_buffer);
+  if (!findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("d"), true))
+    handle_return(HTML_DATA_MISSING);
+  int n = strlen(tmp_buffer);
+  if (n&1)  handle_return(HTML_DATA_FORMATERROR);
+  for (int i=0; i<n; i++) {
+    char c = tmp_buffer[i];
+    if (!((c>='0'&&c<='9') || (c>='a'&&c<='f') || (c>='A'&&c<='F')))
+      handle_return(HTML_DATA_FORMATERROR);
+  }
+  write_to_file(snap_filename, tmp_buffer, n, 2*off, off==0);
+  handle_return(HTML_SUCCESS);
+}
+
 typedef void (*URLHandler)(void);
 
 /* Server function urls
@@ -1916,7 +2810,10 @@ const char _url_keys[] PROGMEM =
   "dl"
   "su"
   "cu"
-  "ja";
+  "ja"
+  "jx"
+  "ix"
+  "jr";
 
 // Server function handlers
 URLHandler urls[] = {
@@ -1940,7 +2837,10 @@ URLHandler urls[] = {
   server_delete_log,      // dl
   server_view_scripturl,  // su
   server_change_scripturl,// cu
-  server_json_all         // ja
+  server_json_all,        // ja
+  server_json_snapshot,   // jx
+  server_import_snapshot, // ix
+  server_json_rollup      // jr
 };
 
 // handle Ethernet request
@@ -1999,6 +2899,10 @@ void start_server_client() {
   wifi_server->on("/update", HTTP_GET, on_sta_update); // handle firmware update
   wifi_server->on("/update", HTTP_POST, on_sta_upload_fin, on_sta_upload);  
   
+  // Accept-Encoding decides whether a reply can be compressed
+  const char *collect[] = {"Accept-Encoding"};
+  wifi_server->collectHeaders(collect, 1);
+
   // set up all other handlers
   char uri[4];
   uri[0]='/';
@@ -2015,6 +2919,18 @@ void handle_web_request(char *p)
 {
 #if defined(ARDUINO)
   ether.httpServerReplyAck();
+#endif
+#ifdef GZIP_WINDOW
+  // the reply shares the buffer with the request, so check the header first
+  // (header names and content codings are case-insensitive)
+  gz_accepted = false;
+  for (char *l=strchr(p, '\n'); l && !gz_accepted; l=strchr(l, '\n')) {
+    l++;
+    if (strncasecmp(l, "Accept-Encoding:", 16)) continue;
+    for (char *c=l+16; *c && *c!='\n'; c++) {
+      if (!strncasecmp(c, "gzip", 4)) { gz_accepted = true; break; }
+    }
+  }
 #endif
   rewind_ether_buffer();
 
@@ -2045,7 +2961,7 @@ void handle_web_request(char *p)
           if(check_password(dat)==false) {
             print_json_header();
             bfill.emit_p(PSTR("\"$F\":$D}"),
-                   op_json_names+0, os.options[0]);
+                   op_name(0), os.options[0]);
             ret = HTML_OK;
           } else {
             get_buffer = dat;
@@ -2090,53 +3006,103 @@ void handle_web_request(char *p)
 #endif
 
 #if defined(ARDUINO)
-/** NTP sync request */
-unsigned long getNtpTime()
+/** NTP exchange, driven by perform_ntp_sync()
+ * ntp_send() sends one request and returns at once; ntp_receive() checks,
+ * without waiting, whether the answer has arrived.
+ * Server NTP_SERVER_CONFIGURED is the one set by OPTION_NTP_IP1..4,
+ * NTP_SERVER_POOL is resolved from the pool name. The lookup blocks, so its
+ * result is kept for NTP_POOL_REFRESH_MS, and a failed lookup is retried
+ * after a growing delay instead of on every request. */
+static const char ntp_pool_name[] PROGMEM = "pool.ntp.org";
+
+#if !defined(ESP8266)
+#define NTP_POOL_REFRESH_MS  3600000UL  // look the pool up again after an hour
+#define NTP_POOL_RETRY_MS    60000UL    // first retry after a failed lookup
+static byte ntp_pool_ip[4];             // last resolved pool member (0.0.0.0: none)
+static ulong ntp_pool_next = 0;         // when to look the pool up again (in ms, 0: now)
+static ulong ntp_pool_backoff = NTP_POOL_RETRY_MS;
+
+/** Resolve the pool into ntp_pool_ip, if the cached address is due for renewal */
+static void ntp_pool_resolve() {
+  if (ntp_pool_next && (long)(millis()-ntp_pool_next)<0) return;  // still fresh, or backing off
+  // the lookup answers in hisip, which other requests rely on
+  byte hisip[4];
+  memcpy(hisip, ether.hisip, 4);
+  char name[16];
+  strcpy_P(name, ntp_pool_name);
+  if (ether.dnsLookup(name, true)) {
+    memcpy(ntp_pool_ip, ether.hisip, 4);
+    ntp_pool_backoff = NTP_POOL_RETRY_MS;
+    ntp_pool_next = millis()+NTP_POOL_REFRESH_MS;
+  } else {
+    ntp_pool_next = millis()+ntp_pool_backoff;
+    if (ntp_pool_backoff<NTP_POOL_REFRESH_MS) ntp_pool_backoff <<= 1;
+  }
+  memcpy(ether.hisip, hisip, 4);
+}
+#endif
+
+bool ntp_send(byte server)
 {
 #ifdef ESP8266
+  // the SDK's SNTP client does the exchange (and the server fallback) by itself
   static bool configured = false;
-  if (os.state!=OS_STATE_CONNECTED || WiFi.status()!=WL_CONNECTED) return 0;
-  
-  if(!configured) {
-    configTime(0, 0, "pool.ntp.org", "time.nist.org", NULL);
-    delay(1000);
+  static byte configured_ip[4];
+  static char ntpip_str[16];
+  if (os.state!=OS_STATE_CONNECTED || WiFi.status()!=WL_CONNECTED) return false;
+  byte ntpip[4] = {
+    os.options[OPTION_NTP_IP1],
+    os.options[OPTION_NTP_IP2],
+    os.options[OPTION_NTP_IP3],
+    os.options[OPTION_NTP_IP4]};
+  // configure again when the server options have changed (/co, snapshot restore)
+  if(!configured || memcmp(configured_ip, ntpip, 4)) {
+    ntpip_str[0] = 0;
+    if (ntpip[0]) ip2string(ntpip_str, ntpip);
+    configTime(0, 0, ntpip_str[0] ? ntpip_str : "pool.ntp.org", "pool.ntp.org", "time.nist.gov");
+    memcpy(configured_ip, ntpip, 4);
     configured = true;
   }
-  ulong gt = 0;
-  byte tick=0;
-  do {
-    gt = time(NULL);
-    tick++;
-  } while(!gt && tick<100);
-  return gt;
+  return true;
 #else
   byte ntpip[4] = {
     os.options[OPTION_NTP_IP1],
     os.options[OPTION_NTP_IP2],
     os.options[OPTION_NTP_IP3],
     os.options[OPTION_NTP_IP4]};
-  uint32_t time;
-  byte tick=0;
-  unsigned long expire;
-  do {
-    ether.ntpRequest(ntpip, ++ntpclientportL);
-    expire = millis() + 1000; // wait for at most 1 second
-    do {
-      word len = ether.packetReceive();
-      ether.packetLoop(len);
-      if(len > 0 && ether.ntpProcessAnswer(&time, ntpclientportL)) {
-        if ((time & 0x80000000UL) ==0){
-          time+=2085978496;
-        }else{
-          time-=2208988800UL;
-        }
-        return time;
-      }
-    } while(millis() < expire);
-    tick ++;
-  } while(tick<20);
+  if (server==NTP_SERVER_POOL || !ntpip[0]) {
+    ntp_pool_resolve();
+    if (!ntp_pool_ip[0]) return false;
+    memcpy(ntpip, ntp_pool_ip, 4);
+  }
+  ether.ntpRequest(ntpip, ++ntpclientportL);
+  return true;
 #endif
+}
+
+/** Check for the NTP answer; plen is the length of the packet just received
+ * Returns the time (seconds since 1970) or 0 */
+ulong ntp_receive(uint16_t plen)
+{
+#ifdef ESP8266
+  time_t gt = time(NULL);
+  return (gt>978307200) ? gt : 0;  // 0 until SNTP has synced
+#else
+  uint32_t time;
+  #ifndef OPENSPRINKLER_ARDUINO_W5100
+  // EtherCard: the answer is in the packet just received
+  if (plen==0) return 0;
+  #endif
+  if (ether.ntpProcessAnswer(&time, ntpclientportL)) {
+    if ((time & 0x80000000UL) ==0){
+      time+=2085978496;
+    }else{
+      time-=2208988800UL;
+    }
+    return time;
+  }
   return 0;
+#endif
 }
 #endif
 
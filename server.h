@@ -82,6 +82,8 @@ public:
         va_end(ap);
     }
 
+    void emit_raw (const char* s, uint16_t n) { memcpy(ptr, s, n); ptr += n; *ptr = 0; }
+
     char* buffer () const { return start; }
     unsigned int position () const { return ptr - start; }
 };
@@ -138,6 +140,8 @@ public:
       va_end(ap);
     }    
 
+    void emit_raw (const char* s, uint16_t n) { memcpy(ptr, s, n); ptr += n; *ptr = 0; }
+
     char* buffer () const { return start; }
 
     unsigned int position () const { return ptr - start; }
@@ -2,6 +2,7 @@
 #include <inttypes.h>
 #include <Arduino.h>
 #include <Wire.h>
+#include <string.h>
 
 // When the display powers up, it is configured as follows:
 //
@@ -200,17 +201,27 @@ void LiquidCrystal::clear()
 {
   command(LCD_CLEARDISPLAY);// clear display, set cursor position to zero
   delayMicroseconds(2000);  // this command takes a long time!
+  memset(_fb, ' ', sizeof(_fb));
+  memset(_dirty, 0, sizeof(_dirty));
+  _col = _row = 0;
+  _hw_col = _hw_row = 0;
+  _hw_valid = 1;
 }
 
 void LiquidCrystal::home()
 {
   command(LCD_RETURNHOME);  // set cursor position to zero
   delayMicroseconds(2000);  // this command takes a long time!
+  _col = _row = 0;
+  _hw_col = _hw_row = 0;
+  _hw_valid = 1;
 }
 
+// The cursor is only moved logically here. The
+// LCD address counter is updated by push() when
+// a changed cell actually needs to be written
 void LiquidCrystal::setCursor(uint8_t col, uint8_t row)
 {
-  int row_offsets[] = { 0x00, 0x40, 0x14, 0x54 };
   #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__)  
   if (_type == LCD_I2C) {
     if (row > _rows) {
@@ -223,7 +234,8 @@ void LiquidCrystal::setCursor(uint8_t col, uint8_t row)
       row = _numlines-1;
     }
   }  
-  command(LCD_SETDDRAMADDR | (col + row_offsets[row]));
+  _col = col;
+  _row = row;
 }
 
 // Turn the display on/off (quickly)
@@ -294,8 +306,9 @@ void LiquidCrystal::createChar(uint8_t location, uint8_t charmap[]) {
   location &= 0x7; // we only have 8 locations 0-7
   command(LCD_SETCGRAMADDR | (location << 3));
   for (int i=0; i<8; i++) {
-    write(charmap[i]);
+    send(charmap[i], Rs);
   }
+  _hw_valid = 0;  // address counter now points into CGRAM
 }
 
 #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__)
@@ -317,15 +330,64 @@ inline void LiquidCrystal::command(uint8_t value) {
 	send(value, 0);
 }
 
-inline size_t LiquidCrystal::write(uint8_t value) {
-	send(value, Rs);
+size_t LiquidCrystal::write(uint8_t value) {
+  store(value);
+  flush();
   return 1; // assume sucess
 }
 
+size_t LiquidCrystal::write(const uint8_t *buffer, size_t size) {
+  for (size_t i=0; i<size; i++) {
+    store(buffer[i]);
+  }
+  flush();  // push the whole string in one pass
+  return size;
+}
+
+// Record a character at the logical cursor and advance it.
+// Cells outside the framebuffer are written straight through
+void LiquidCrystal::store(uint8_t value) {
+  if (_row < LCD_FB_ROWS && _col < LCD_FB_COLS) {
+    if (_fb[_row][_col] != value) {
+      _fb[_row][_col] = value;
+      _dirty[_row] |= (uint16_t)1<<_col;
+    }
+  } else {
+    push(_col, _row, value);
+  }
+  _col++;
+}
+
+// Push all dirty cells to the LCD. Runs of adjacent
+// dirty cells share a single set-address command
+void LiquidCrystal::flush() {
+  for (uint8_t row=0; row<LCD_FB_ROWS; row++) {
+    uint16_t dirty = _dirty[row];
+    for (uint8_t col=0; dirty; col++, dirty>>=1) {
+      if (dirty&1) push(col, row, _fb[row][col]);
+    }
+    _dirty[row] = 0;
+  }
+}
+
+// Write one character to the given cell, moving the
+// LCD address counter only if it is not already there
+void LiquidCrystal::push(uint8_t col, uint8_t row, uint8_t value) {
+  static const uint8_t row_offsets[] = { 0x00, 0x40, 0x14, 0x54 };
+  if (!_hw_valid || _hw_col != col || _hw_row != row) {
+    command(LCD_SETDDRAMADDR | (col + row_offsets[row&0x03]));
+  }
+  send(value, Rs);
+  _hw_col = col+1;
+  _hw_row = row;
+  _hw_valid = 1;
+}
+
 /************ low level data pushing commands **********/
 
 // write either command or data
 void LiquidCrystal::send(uint8_t value, uint8_t mode) {
+  _bus_bytes++;
   #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__)
   if (_type == LCD_I2C) {
 	  uint8_t highnib=value&0xf0;
@@ -55,6 +55,10 @@
 #define LCD_I2C_ADDR1 0x27 // type using PCF8574,  at address 0x27
 #define LCD_I2C_ADDR2 0x3F // type using PCF8574A, at address 0x3F
 
+// shadow framebuffer size
+#define LCD_FB_COLS 16
+#define LCD_FB_ROWS 2
+
 class LiquidCrystal : public Print {
 public:
   LiquidCrystal() {}
@@ -83,9 +87,12 @@ public:
   void createChar(uint8_t, uint8_t[]);
   void setCursor(uint8_t, uint8_t); 
   virtual size_t write(uint8_t);
+  virtual size_t write(const uint8_t *buffer, size_t size);
   void command(uint8_t);
+  void flush();
 
   inline uint8_t type() { return _type; }
+  inline uint32_t bus_bytes() { return _bus_bytes; }
   #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__)
   void noBacklight();
   void backlight();
@@ -94,6 +101,8 @@ public:
   using Print::write;	 
 private:
   void send(uint8_t, uint8_t);
+  void push(uint8_t, uint8_t, uint8_t);
+  void store(uint8_t);
   void write4bits(uint8_t);
   void pulseEnable();
 
@@ -120,6 +129,14 @@ private:
   uint8_t _initialized;
 
   uint8_t _numlines,_currline;
+
+  // shadow framebuffer: a cell is only sent to the LCD when its value changes
+  uint8_t _fb[LCD_FB_ROWS][LCD_FB_COLS];
+  uint16_t _dirty[LCD_FB_ROWS]; // per-cell dirty bits
+  uint8_t _col, _row;           // logical cursor position
+  uint8_t _hw_col, _hw_row;     // LCD address counter position
+  uint8_t _hw_valid;            // 1 if _hw_col/_hw_row match the LCD address counter
+  uint32_t _bus_bytes;          // number of command/data bytes sent to the LCD
 };
 
 #endif // LIQUID_CRYSTAL_DUAL_H
@@ -11,26 +11,39 @@
 #define LCD_STD 0     // Standard LCD
 #define LCD_I2C 1
 
+#define LCD_FB_COLS 16  // text framebuffer size
+#define LCD_FB_ROWS 4
+
 class SSD1306Display : public SSD1306{
 public:
   SSD1306Display(uint8_t _addr, uint8_t _sda, uint8_t _scl) : SSD1306(_addr, _sda, _scl) {
+    i2c_addr = _addr;
     cx = 0;
     cy = 0;
     for(byte i=0;i<8;i++) custom_chars[i]=NULL;
+    bus_count = 0;
+    dirty_pages = 0;
   }
   void begin() {
     flipScreenVertically();
     setFont(Monospaced_plain_13);
     fontWidth = 8;
     fontHeight = 16;
+    memset(fb, ' ', sizeof(fb));
   }
   void clear() {
     SSD1306::clear();
+    memset(fb, ' ', sizeof(fb));
+    mark_dirty(0, 0, 128, 64);
   }
   void clear(int start, int end) {
     setColor(BLACK);
     fillRect(0, (start+1)*fontHeight, 128, (end-start+1)*fontHeight);
     setColor(WHITE);
+    for(int row=start+1;row<=end+1;row++) {
+      if(row>=0 && row<LCD_FB_ROWS) memset(fb[row], ' ', LCD_FB_COLS);
+    }
+    mark_dirty(0, (start+1)*fontHeight, 128, (end-start+1)*fontHeight);
   }
   
   uint8_t type() { return LCD_I2C; }
@@ -45,36 +58,121 @@ public:
   void noBacklight() {/*no support*/}
   void backlight() {/*no support*/}
   size_t write(uint8_t c) {
-    setColor(BLACK);
-    fillRect(cx, cy, fontWidth, fontHeight);
-    setColor(WHITE);
-
-    if(c<8 && custom_chars[c]!=NULL) {
-      drawXbm(cx, cy, fontWidth, fontHeight, custom_chars[c]);
-    } else {
-      drawString(cx, cy, String((char)c));
-    }
-    cx += fontWidth;
-    display();  // todo: not very efficient
+    draw_char(c);
+    flush();
     return 1;
   }
   size_t write(const char* s) {
     uint8_t nc = strlen(s);
-    setColor(BLACK);
-    fillRect(cx, cy, fontWidth*nc, fontHeight);  
-    setColor(WHITE);
-    drawString(cx, cy, String(s));
-    cx += fontWidth*nc;
-    display();  // todo: not very efficient
+    for(uint8_t i=0;i<nc;i++) draw_char(s[i]);
+    flush();
     return nc;
   }
   void createChar(byte idx, PGM_P ptr) {
     if(idx>=0&&idx<8) custom_chars[idx]=ptr;
   }
+  /* full screen update */
+  void display() {
+    SSD1306::display();
+    bus_count += 128*8;
+    dirty_pages = 0;
+  }
+  /* mark a pixel rectangle as needing to be pushed by flush() */
+  void mark_dirty(int x, int y, int w, int h) {
+    if(w<=0 || h<=0) return;
+    if(x<0) { w+=x; x=0; }
+    if(x+w>128) w=128-x;
+    for(int page=y/8;page<=(y+h-1)/8 && page<8;page++) {
+      if(page<0) continue;
+      if(dirty_pages & (1<<page)) {
+        if(x<dirty_x0[page]) dirty_x0[page]=x;
+        if(x+w-1>dirty_x1[page]) dirty_x1[page]=x+w-1;
+      } else {
+        dirty_pages |= (1<<page);
+        dirty_x0[page]=x;
+        dirty_x1[page]=x+w-1;
+      }
+    }
+  }
+  /* partial update: push only the dirty column range of each dirty page */
+  void flush() {
+    for(byte page=0;page<8;page++) {
+      if(!(dirty_pages & (1<<page))) continue;
+      byte x0=dirty_x0[page], x1=dirty_x1[page];
+      send_command(COLUMNADDR);
+      send_command(x0);
+      send_command(x1);
+      send_command(PAGEADDR);
+      send_command(page);
+      send_command(page);
+      bus_count += 6;
+      for(int x=x0;x<=x1;) {
+        Wire.beginTransmission(i2c_addr);
+        Wire.write(0x40);
+        for(byte k=0;k<16 && x<=x1;k++,x++) {
+          Wire.write(buffer[x+page*128]);
+          bus_count++;
+        }
+        Wire.endTransmission();
+      }
+    }
+    dirty_pages = 0;
+  }
+  /* graphics drawn outside the text path: push the pixels, and forget the
+     text cells underneath so the next character written there is redrawn */
+  template<typename T>
+  void drawXbm(int16_t x, int16_t y, int16_t w, int16_t h, T xbm) {
+    SSD1306::drawXbm(x, y, w, h, xbm);
+    touch(x, y, w, h);
+  }
+  void fillCircle(int16_t x0, int16_t y0, int16_t r) {
+    SSD1306::fillCircle(x0, y0, r);
+    touch(x0-r, y0-r, 2*r+1, 2*r+1);
+  }
+  uint32_t bus_bytes() { return bus_count; }
 private:
+  void touch(int x, int y, int w, int h) {
+    mark_dirty(x, y, w, h);
+    if(w<=0 || h<=0) return;
+    for(int row=(y<0?0:y/fontHeight);row<=(y+h-1)/fontHeight && row<LCD_FB_ROWS;row++) {
+      for(int col=(x<0?0:x/fontWidth);col<=(x+w-1)/fontWidth && col<LCD_FB_COLS;col++)
+        fb[row][col] = 0xFF;  // matches no character
+    }
+  }
+  /* the I2C transfers flush() needs, done here rather than through the base class */
+  void send_command(uint8_t cmd) {
+    Wire.beginTransmission(i2c_addr);
+    Wire.write(0x80);
+    Wire.write(cmd);
+    Wire.endTransmission();
+  }
+  /* draw one character into the frame buffer if the cell has changed */
+  void draw_char(uint8_t c) {
+    byte col = cx/fontWidth, row = cy/fontHeight;
+    if(col<LCD_FB_COLS && row<LCD_FB_ROWS) {
+      if(fb[row][col]==c) { cx += fontWidth; return; }
+      fb[row][col]=c;
+    }
+    setColor(BLACK);
+    fillRect(cx, cy, fontWidth, fontHeight);
+    setColor(WHITE);
+
+    if(c<8 && custom_chars[c]!=NULL) {
+      SSD1306::drawXbm(cx, cy, fontWidth, fontHeight, custom_chars[c]);
+    } else {
+      drawString(cx, cy, String((char)c));
+    }
+    mark_dirty(cx, cy, fontWidth, fontHeight);
+    cx += fontWidth;
+  }
+  uint8_t i2c_addr;
   uint8_t cx, cy;
   uint8_t fontWidth, fontHeight;
   PGM_P custom_chars[8];
+  uint8_t fb[LCD_FB_ROWS][LCD_FB_COLS]; // text shadow of the screen
+  uint8_t dirty_pages;                  // one bit per 8-pixel page
+  uint8_t dirty_x0[8], dirty_x1[8];     // dirty column range of each page
+  uint32_t bus_count;                   // bytes pushed over I2C
 };
 
 #endif
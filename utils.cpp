@@ -127,45 +127,143 @@ void remove_file(const char *name) {
 
 #ifdef ESP8266
 // nvm functions for ESP8266
-// do not use File.readBytes or readBytesUntil because it's very slow
-void nvm_read_block(void *dst, const void *src, int len) {
-  File f = SPIFFS.open(NVM_FILENAME, "r");
-  if(f) {
-    f.seek((unsigned int)src, SeekSet);
-    f.read((byte*)dst, len);
-    f.close();
+// The nvm image is kept in RAM: reads are served from memory and each write
+// is appended to a journal (nvm.log) as a CRC-checked record
+//   [0xA5][addr:2][len:2][data:len][crc:2]
+// At boot the base image (nvm.dat) is loaded and the journal replayed up to
+// the first damaged record, so a write cut short by power loss is dropped.
+// Once the journal exceeds NVM_LOG_MAX it is folded into a new base image:
+// nvm.tmp is written with a trailing CRC, renamed over nvm.dat, then the
+// journal is removed. Replay is idempotent, so a reset at any step of that
+// sequence still recovers the latest state.
+#define NVM_LOG_MAGIC  0xA5
+#define NVM_LOG_HDR    5
+static byte nvm_image[NVM_SIZE];
+static bool nvm_loaded = false;
+static bool nvm_held = false;
+static ulong nvm_log_size = 0;
+
+// load a base image; a compacted image must carry a valid CRC,
+// an image written by older firmware has none
+static bool nvm_read_image(const char *fn, bool need_crc) {
+  File f = SPIFFS.open(fn, "r");
+  if(!f) return false;
+  int n = f.read(nvm_image, NVM_SIZE);
+  uint16_t crc;
+  bool has_crc = (f.read((byte*)&crc, 2)==2);
+  f.close();
+  if(!need_crc) return true;
+  return (n==NVM_SIZE && has_crc && crc==crc16(0xFFFF, nvm_image, NVM_SIZE));
+}
+
+static void nvm_compact() {
+  File f = SPIFFS.open(NVM_TMP_FILENAME, "w");
+  if(!f) return;
+  uint16_t crc = crc16(0xFFFF, nvm_image, NVM_SIZE);
+  bool ok = (f.write(nvm_image, NVM_SIZE)==NVM_SIZE && f.write((byte*)&crc, 2)==2);
+  f.close();
+  if(!ok) { SPIFFS.remove(NVM_TMP_FILENAME); return; }
+  SPIFFS.remove(NVM_FILENAME);
+  SPIFFS.rename(NVM_TMP_FILENAME, NVM_FILENAME);
+  SPIFFS.remove(NVM_LOG_FILENAME);
+  nvm_log_size = 0;
+}
+
+static void nvm_load() {
+  nvm_loaded = true;
+  // finish a compaction that was cut short after the old base was removed
+  if(SPIFFS.exists(NVM_TMP_FILENAME)) {
+    if(!SPIFFS.exists(NVM_FILENAME) && nvm_read_image(NVM_TMP_FILENAME, true))
+      SPIFFS.rename(NVM_TMP_FILENAME, NVM_FILENAME);
+    else
+      SPIFFS.remove(NVM_TMP_FILENAME);
+  }
+  memset(nvm_image, 0, NVM_SIZE);
+  nvm_read_image(NVM_FILENAME, false);
+
+  File f = SPIFFS.open(NVM_LOG_FILENAME, "r");
+  if(!f) return;
+  ulong size = f.size(), pos = 0;
+  byte hdr[NVM_LOG_HDR], buf[32];
+  while(pos+NVM_LOG_HDR+2 <= size) {
+    if(f.read(hdr, NVM_LOG_HDR)!=NVM_LOG_HDR || hdr[0]!=NVM_LOG_MAGIC) break;
+    uint16_t addr = hdr[1] | ((uint16_t)hdr[2]<<8);
+    uint16_t len  = hdr[3] | ((uint16_t)hdr[4]<<8);
+    if((ulong)addr+len>NVM_SIZE || pos+NVM_LOG_HDR+len+2>size) break;
+    // check the record before it touches the image
+    uint16_t crc = crc16(0xFFFF, hdr+1, NVM_LOG_HDR-1), c;
+    for(uint16_t i=0;i<len;) {
+      int k = (len-i>sizeof(buf)) ? sizeof(buf) : (len-i);
+      f.read(buf, k);
+      crc = crc16(crc, buf, k);
+      i += k;
+    }
+    if(f.read((byte*)&c, 2)!=2 || c!=crc) break;
+    f.seek(pos+NVM_LOG_HDR, SeekSet);
+    f.read(nvm_image+addr, len);
+    pos += NVM_LOG_HDR+len+2;
+    f.seek(pos, SeekSet);
   }
+  f.close();
+  nvm_log_size = pos;
+  if(pos<size) nvm_compact();  // drop the damaged tail so new records stay reachable
+}
+
+static void nvm_append(uint16_t addr, const byte *src, uint16_t len) {
+  if(!nvm_loaded && os.status.has_sd) nvm_load();
+  if(addr>=NVM_SIZE) return;
+  if((ulong)addr+len>NVM_SIZE) len = NVM_SIZE-addr;
+  // trim bytes that already hold the value; unchanged writes cost nothing
+  while(len && nvm_image[addr]==*src) { addr++; src++; len--; }
+  while(len && nvm_image[addr+len-1]==src[len-1]) len--;
+  if(!len) return;
+  memcpy(nvm_image+addr, src, len);
+  if(nvm_held) return;
+
+  byte hdr[NVM_LOG_HDR] = {NVM_LOG_MAGIC, (byte)addr, (byte)(addr>>8), (byte)len, (byte)(len>>8)};
+  uint16_t crc = crc16(crc16(0xFFFF, hdr+1, NVM_LOG_HDR-1), src, len);
+  File f = SPIFFS.open(NVM_LOG_FILENAME, "a");
+  if(!f) return;
+  f.write(hdr, NVM_LOG_HDR);
+  f.write(src, len);
+  f.write((byte*)&crc, 2);
+  f.close();
+  nvm_log_size += NVM_LOG_HDR+len+2;
+  if(nvm_log_size>NVM_LOG_MAX) nvm_compact();
+}
+
+// start a transaction: writes only change the RAM image until nvm_commit()
+void nvm_begin() {
+  if(!nvm_loaded && os.status.has_sd) nvm_load();
+  nvm_held = true;
+}
+
+// store all writes since nvm_begin() as one new base image
+void nvm_commit() {
+  nvm_held = false;
+  nvm_compact();
+}
+
+void nvm_read_block(void *dst, const void *src, int len) {
+  if(!nvm_loaded && os.status.has_sd) nvm_load();
+  unsigned int addr = (unsigned int)src;
+  if(addr>=NVM_SIZE) return;
+  if(addr+len>NVM_SIZE) len = NVM_SIZE-addr;
+  memcpy(dst, nvm_image+addr, len);
 }
 
 void nvm_write_block(const void *src, void *dst, int len) {
-  File f = SPIFFS.open(NVM_FILENAME, "r+");
-  if(!f) f = SPIFFS.open(NVM_FILENAME, "w");
-  if(f) {
-    f.seek((unsigned int)dst, SeekSet);
-    f.write((byte*)src, len);
-    f.close();
-  }
+  nvm_append((unsigned int)dst, (const byte*)src, len);
 }
 
 byte nvm_read_byte(const byte *p) {
-  File f = SPIFFS.open(NVM_FILENAME, "r");
-  byte v = 0;
-  if(f) {
-    f.seek((unsigned int)p, SeekSet);
-    f.read((byte*)&v, 1);
-    f.close();
-  }
-  return v;
+  if(!nvm_loaded && os.status.has_sd) nvm_load();
+  unsigned int addr = (unsigned int)p;
+  return (addr<NVM_SIZE) ? nvm_image[addr] : 0;
 }
 
 void nvm_write_byte(const byte *p, byte v) {
-  File f = SPIFFS.open(NVM_FILENAME, "r+");
-  if(!f) f = SPIFFS.open(NVM_FILENAME, "w");
-  if(f) {
-    f.seek((unsigned int)p, SeekSet);
-    f.write(&v, 1);
-    f.close();  
-  }
+  nvm_append((unsigned int)p, &v, 1);
 }
 
 #endif
@@ -411,6 +509,15 @@ void strncpy_P0(char* dest, const char* src, int n) {
   *dest=0;
 }
 
+// CRC-16/CCITT, start with crc=0xFFFF
+uint16_t crc16(uint16_t crc, const byte *p, int len) {
+  while(len--) {
+    crc ^= (uint16_t)(*p++)<<8;
+    for(byte i=0;i<8;i++)  crc = (crc&0x8000) ? ((crc<<1)^0x1021) : (crc<<1);
+  }
+  return crc;
+}
+
 // compare a string to nvm
 byte strcmp_to_nvm(const char* src, int _addr) {
   byte c1, c2;
@@ -42,6 +42,7 @@ byte strcmp_to_nvm(const char* src, int addr);
 ulong water_time_resolve(uint16_t v);
 byte water_time_encode_signed(int16_t i);
 int16_t water_time_decode_signed(byte i);
+uint16_t crc16(uint16_t crc, const byte *p, int len);
 void write_to_file(const char *name, const char *data, int size, int pos=0, bool trunc=true);
 bool read_from_file(const char *name, char *data, int maxsize=TMP_BUFFER_SIZE, int pos=0);
 void remove_file(const char *name);
@@ -51,17 +52,23 @@ void remove_file(const char *name);
     void nvm_write_block(const void *src, void *dst, int len);
     byte nvm_read_byte(const byte *p);
     void nvm_write_byte(const byte *p, byte v);  
+    void nvm_begin();   // hold writes in RAM until nvm_commit()
+    void nvm_commit();  // store the held writes in one step
   #else
     #define nvm_read_block  eeprom_read_block
-    #define nvm_write_block eeprom_write_block
+    #define nvm_write_block eeprom_update_block // only cells that change are erased/written
     #define nvm_read_byte   eeprom_read_byte
-    #define nvm_write_byte  eeprom_write_byte
+    #define nvm_write_byte  eeprom_update_byte
+    #define nvm_begin()     // EEPROM cells are written directly
+    #define nvm_commit()
   #endif
 #else // NVM functions for RPI/BBB
   void nvm_read_block(void *dst, const void *src, int len);
   void nvm_write_block(const void *src, void *dst, int len);
   byte nvm_read_byte(const byte *p);
   void nvm_write_byte(const byte *p, byte v);
+  #define nvm_begin()
+  #define nvm_commit()
   char* get_runtime_path();
   char* get_filename_fullpath(const char *filename);
   void delay(ulong ms);
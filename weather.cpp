@@ -30,6 +30,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <math.h>
 extern char ether_buffer[];
 #endif
 
@@ -42,90 +43,177 @@ extern const char wtopts_filename[];
 
 extern OpenSprinkler os; // OpenSprinkler object
 extern char tmp_buffer[];
-byte findKeyVal (const char *str,char *strbuf, uint8_t maxlen,const char *key,bool key_in_pgm=false,uint8_t *keyfound=NULL);
 void write_log(byte type, ulong curr_time);
+bool push_busy();
 
 // The weather function calls getweather.py on remote server to retrieve weather data
 // the default script is WEATHER_SCRIPT_HOST/weather?.py
 //static char website[] PROGMEM = DEFAULT_WEATHER_URL ;
 
-static void getweather_callback(byte status, uint16_t off, uint16_t len) {
-#if defined(ARDUINO) && !defined(ESP8266)
-    // OPENSPRINKLER_ARDUINO_W5100
-    // char *p = (char*)Ethernet::buffer + off;
-    char *p = (char*)ether.buffer + off;
-#else
-  char *p = ether_buffer;
+/* ====== Weather request pipeline ======
+ * GetWeather() only arms a request. weather_poll() is called from the main
+ * loop and advances the request by one step per call:
+ *   RESOLVE - look up the weather server (AVR)
+ *   REQUEST - build the query, connect and send it
+ *   WAIT    - collect the reply, or give up after WEATHER_TIMEOUT
+ *   APPLY   - commit the changed values, writing each NVM block at most once
+ * The reply is parsed in a single pass as soon as it arrives. The time spent
+ * in each step is kept in weather_diag and reported by /jc. */
+
+#define WEATHER_TIMEOUT  5  // reply timeout (in seconds)
+
+// parsed weather reply; the order of the keys matches the WEATHER_UPDATE_ bits
+struct WeatherResult {
+  byte found;         // WEATHER_UPDATE_ bits of the keys present in the reply
+  int sunrise;
+  int sunset;
+  ulong eip;
+  int scale;
+  int tz;
+  int rd;
+};
+static const char weather_keys[] PROGMEM = "sunrise\0sunset\0eip\0scale\0tz\0rd\0";
+
+WeatherDiag weather_diag;
+static WeatherResult weather_result;
+static ulong weather_timeout;
+#if defined(ESP8266)
+static WiFiClient weather_client;
+#elif !defined(ARDUINO)
+static EthernetClient weather_client;
 #endif
+#if !defined(ARDUINO) || defined(ESP8266)
+static uint16_t weather_len;  // number of reply bytes in ether_buffer
+#endif
+
+static void weather_tick_done(ulong start_us) {
+  ulong us = micros()-start_us;
+  weather_diag.last_us = us;
+  if(us>weather_diag.max_us) weather_diag.max_us = us;
+}
+
+/** Parse the key/value reply in a single pass
+ * Returns false if the buffer holds no key/value data */
+static bool weather_parse(const char *p, WeatherResult *r) {
   /* scan the buffer until the first & symbol */
   while(*p && *p!='&') {
     p++;
   }
-  if (*p != '&')  return;
-  int v;
-  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("sunrise"), true)) {
-    v = atoi(tmp_buffer);
-    if (v>=0 && v<=1440 && v != os.nvdata.sunrise_time) {
-      os.nvdata.sunrise_time = v;
-      os.nvdata_save();
-      os.weather_update_flag |= WEATHER_UPDATE_SUNRISE;
+  if (*p != '&')  return false;
+  r->found = 0;
+  while(*p=='&') {
+    const char *key = ++p;
+    while(*p && *p!='=' && *p!='&' && *p!=' ' && *p!='\n') p++;
+    if(*p!='=') continue;
+    byte klen = p-key;
+    const char *val = ++p;
+    PGM_P k = weather_keys;
+    for(byte i=0;pgm_read_byte(k);i++) {
+      byte n = strlen_P(k);
+      if(n==klen && strncmp_P(key, k, n)==0) {
+        byte bit = 1<<i;
+        switch(bit) {
+        case WEATHER_UPDATE_SUNRISE: r->sunrise = atoi(val); break;
+        case WEATHER_UPDATE_SUNSET:  r->sunset = atoi(val);  break;
+        case WEATHER_UPDATE_EIP:     r->eip = strtoul(val, NULL, 10); break;
+        case WEATHER_UPDATE_WL:      r->scale = atoi(val);   break;
+        case WEATHER_UPDATE_TZ:      r->tz = atoi(val);      break;
+        case WEATHER_UPDATE_RD:      r->rd = atoi(val);      break;
+        }
+        r->found |= bit;
+        break;
+      }
+      k += n+1;
     }
+    while(*p && *p!='&' && *p!=' ' && *p!='\n') p++;
   }
+  return true;
+}
 
-  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("sunset"), true)) {
-    v = atoi(tmp_buffer);
-    if (v>=0 && v<=1440 && v != os.nvdata.sunset_time) {
-      os.nvdata.sunset_time = v;
-      os.nvdata_save();
-      os.weather_update_flag |= WEATHER_UPDATE_SUNSET;      
-    }
+/** Commit the parsed values
+ * Changed fields are collected first, then nvdata and options
+ * are each written at most once */
+static void weather_apply(const WeatherResult *r) {
+  bool nv_dirty = false, op_dirty = false;
+  byte f = r->found;
+  int v;
+
+  // sunrise/sunset computed locally take precedence
+  if (os.geo.tag == GEOLOC_TAG) f &= ~(WEATHER_UPDATE_SUNRISE|WEATHER_UPDATE_SUNSET);
+
+  v = r->sunrise;
+  if ((f&WEATHER_UPDATE_SUNRISE) && v>=0 && v<=1440 && v != os.nvdata.sunrise_time) {
+    os.nvdata.sunrise_time = v;
+    nv_dirty = true;
+    os.weather_update_flag |= WEATHER_UPDATE_SUNRISE;
   }
 
-  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("eip"), true)) {
-    uint32_t l = atol(tmp_buffer);
-    if(l != os.nvdata.external_ip) {
-      os.nvdata.external_ip = atol(tmp_buffer);
-      os.nvdata_save();
-      os.weather_update_flag |= WEATHER_UPDATE_EIP;
-    }
+  v = r->sunset;
+  if ((f&WEATHER_UPDATE_SUNSET) && v>=0 && v<=1440 && v != os.nvdata.sunset_time) {
+    os.nvdata.sunset_time = v;
+    nv_dirty = true;
+    os.weather_update_flag |= WEATHER_UPDATE_SUNSET;
   }
 
-  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("scale"), true)) {
-    v = atoi(tmp_buffer);
-    if (v>=0 && v<=250 && v != os.options[OPTION_WATER_PERCENTAGE]) {
-      // only save if the value has changed
-      os.options[OPTION_WATER_PERCENTAGE] = v;
-      os.options_save();
-      os.weather_update_flag |= WEATHER_UPDATE_WL;      
-    }
+  if ((f&WEATHER_UPDATE_EIP) && r->eip != os.nvdata.external_ip) {
+    os.nvdata.external_ip = r->eip;
+    nv_dirty = true;
+    os.weather_update_flag |= WEATHER_UPDATE_EIP;
   }
-  
-  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("tz"), true)) {
-    v = atoi(tmp_buffer);
-    if (v>=0 && v<= 108) {
-      if (v != os.options[OPTION_TIMEZONE]) {
-        // if timezone changed, save change and force ntp sync
-        os.options[OPTION_TIMEZONE] = v;
-        os.options_save();
-        os.weather_update_flag |= WEATHER_UPDATE_TZ;
-      }
-    }
+
+  v = r->scale;
+  if ((f&WEATHER_UPDATE_WL) && v>=0 && v<=250 && v != os.options[OPTION_WATER_PERCENTAGE]) {
+    // only save if the value has changed
+    os.options[OPTION_WATER_PERCENTAGE] = v;
+    op_dirty = true;
+    os.weather_update_flag |= WEATHER_UPDATE_WL;
   }
-  
-  if (findKeyVal(p, tmp_buffer, TMP_BUFFER_SIZE, PSTR("rd"), true)) {
-    v = atoi(tmp_buffer);
+
+  v = r->tz;
+  if ((f&WEATHER_UPDATE_TZ) && v>=0 && v<=108 && v != os.options[OPTION_TIMEZONE]) {
+    // if timezone changed, save change and force ntp sync
+    os.options[OPTION_TIMEZONE] = v;
+    op_dirty = true;
+    os.weather_update_flag |= WEATHER_UPDATE_TZ;
+  }
+
+  if (f&WEATHER_UPDATE_RD) {
+    v = r->rd;
     if (v>0) {
       os.nvdata.rd_stop_time = os.now_tz() + (unsigned long) v * 3600;
-      os.raindelay_start();
-    } else if (v==0) {
-      os.raindelay_stop();
+      os.status.rain_delayed = 1;
+      nv_dirty = true;
+    } else if (v==0 && (os.status.rain_delayed || os.nvdata.rd_stop_time)) {
+      os.status.rain_delayed = 0;
+      os.nvdata.rd_stop_time = 0;
+      nv_dirty = true;
     }
   }
 
+  if (nv_dirty) os.nvdata_save();
+  if (op_dirty) os.options_save();
+
   os.checkwt_success_lasttime = os.now_tz();
   write_log(LOGDATA_WATERLEVEL, os.checkwt_success_lasttime);
 }
 
+static void weather_failed() {
+  weather_diag.fails++;
+  weather_diag.state = WEATHER_STATE_IDLE;
+}
+
+#if defined(ARDUINO) && !defined(ESP8266)
+static void getweather_callback(byte status, uint16_t off, uint16_t len) {
+  if (weather_diag.state != WEATHER_STATE_WAIT) return;
+  ulong start_us = micros();
+  // OPENSPRINKLER_ARDUINO_W5100
+  // char *p = (char*)Ethernet::buffer + off;
+  char *p = (char*)ether.buffer + off;
+  if (weather_parse(p, &weather_result)) weather_diag.state = WEATHER_STATE_APPLY;
+  weather_tick_done(start_us);
+}
+#endif
+
 #if !defined(ARDUINO) || defined(ESP8266)
 void peel_http_header() { // remove the HTTP header
   int i=0;
@@ -155,21 +243,34 @@ void peel_http_header() { // remove the HTTP header
 }
 #endif
 
-#if defined(ARDUINO)  // for AVR
+/** Arm a weather request; the work is done by weather_poll() */
 void GetWeather() {
-  // perform DNS lookup for every query
+  if (weather_diag.state != WEATHER_STATE_IDLE) return;
+#if defined(ARDUINO) && !defined(ESP8266)
+  weather_diag.state = WEATHER_STATE_RESOLVE;
+#else
+  weather_diag.state = WEATHER_STATE_REQUEST;
+#endif
+}
+
+#if defined(ARDUINO)  // for AVR
+static void weather_request() {
   nvm_read_block(tmp_buffer, (void*)ADDR_NVM_WEATHERURL, MAX_WEATHERURL);
 
 #ifdef ESP8266
-  if (os.state!=OS_STATE_CONNECTED || WiFi.status()!=WL_CONNECTED) return;
-  WiFiClient client;
-  if(!client.connect(tmp_buffer, 80))  return;
-#else
-  ether.dnsLookup(tmp_buffer, true);
+  if (os.state!=OS_STATE_CONNECTED || WiFi.status()!=WL_CONNECTED) {
+    weather_failed();
+    return;
+  }
+  if(!weather_client.connect(tmp_buffer, 80)) {
+    weather_failed();
+    return;
+  }
 #endif
 
   char tmp[60];
-  read_from_file(wtopts_filename, tmp, 60);
+  strncpy(tmp, os.get_wtopts(), sizeof(tmp)-1);
+  tmp[sizeof(tmp)-1] = 0;
 #ifdef ESP8266
   BufferFiller bf = tmp_buffer;
 #else  
@@ -207,31 +308,23 @@ void GetWeather() {
   strcat(urlBuffer, " HTTP/1.0\r\nHOST: ");
   strcat(urlBuffer, "*\r\n\r\n");
   
-  client.write((uint8_t *)urlBuffer, strlen(urlBuffer));
-  
-  time_t timeout = os.now_tz() + 5; // 5 seconds timeout
-  while(!client.available() && os.now_tz() < timeout) {
-  }
-
+  weather_client.write((uint8_t *)urlBuffer, strlen(urlBuffer));
   bzero(ether_buffer, ETHER_BUFFER_SIZE);
-  while(client.available()) {
-    client.read((uint8_t*)ether_buffer, ETHER_BUFFER_SIZE);
-  }
-  client.stop();
-  peel_http_header();
-  getweather_callback(0, 0, ETHER_BUFFER_SIZE);
+  weather_len = 0;
 #else
   uint16_t _port = ether.hisport; // save current port number
   ether.hisport = 80;
+  // hisip is shared with NTP and push requests, so set it from our own lookup
+  memcpy(ether.hisip, weather_diag.ip, 4);
   ether.browseUrl(PSTR("/weather"), dst, PSTR("*"), getweather_callback);
   ether.hisport = _port;
 #endif
+  weather_diag.state = WEATHER_STATE_WAIT;
 }
 
 #else // for RPI/BBB/LINUX
 
-void GetWeather() {
-  EthernetClient client;
+static void weather_request() {
   uint16_t port = 80;
   char * delim;
   struct hostent *server;
@@ -249,6 +342,7 @@ void GetWeather() {
   if (!server) {
     DEBUG_PRINT("can't resolve weather server - ");
     DEBUG_PRINTLN(tmp_buffer);
+    weather_failed();
     return;
   }
   DEBUG_PRINT("weather server ip:port - ");
@@ -262,14 +356,16 @@ void GetWeather() {
   DEBUG_PRINT(":");
   DEBUG_PRINTLN(port);
 
-  if (!client.connect((uint8_t*)server->h_addr, port)) {
-    client.stop();
+  if (!weather_client.connect((uint8_t*)server->h_addr, port)) {
+    weather_client.stop();
+    weather_failed();
     return;
   }
 
   BufferFiller bf = tmp_buffer;
   char tmp[100];
-  read_from_file(wtopts_filename, tmp, 100);
+  strncpy(tmp, os.get_wtopts(), sizeof(tmp)-1);
+  tmp[sizeof(tmp)-1] = 0;
   bf.emit_p(PSTR("$D.py?loc=$E&key=$E&fwv=$D&wto=$S"),
                 (int) os.options[OPTION_USE_WEATHER],
                 ADDR_NVM_LOCATION,
@@ -303,24 +399,159 @@ void GetWeather() {
   strcat(urlBuffer, server->h_name);
   strcat(urlBuffer, "\r\n\r\n");
   
-  client.write((uint8_t *)urlBuffer, strlen(urlBuffer));
+  weather_client.write((uint8_t *)urlBuffer, strlen(urlBuffer));
   
   bzero(ether_buffer, ETHER_BUFFER_SIZE);
-  
-  time_t timeout = os.now_tz() + 5; // 5 seconds timeout
-  while(os.now_tz() < timeout) {
-    int len=client.read((uint8_t *)ether_buffer, ETHER_BUFFER_SIZE);
-    if (len<=0) {
-      if(!client.connected())
-        break;
-      else 
-        continue;
+  weather_len = 0;
+  weather_diag.state = WEATHER_STATE_WAIT;
+}
+#endif
+
+/** Advance the weather request by one step */
+void weather_poll() {
+  if (weather_diag.state == WEATHER_STATE_IDLE) return;
+  ulong start_us = micros();
+
+  switch(weather_diag.state) {
+
+#if defined(ARDUINO) && !defined(ESP8266)
+  case WEATHER_STATE_RESOLVE:
+    // EtherCard has a single outgoing client: wait for a push POST to finish
+    if (push_busy()) break;
+    // perform DNS lookup for every query
+    // note: the lookup itself still blocks until the DNS reply (or the
+    // Ethernet library's timeout); it only runs in a step of its own
+    nvm_read_block(tmp_buffer, (void*)ADDR_NVM_WEATHERURL, MAX_WEATHERURL);
+    if (ether.dnsLookup(tmp_buffer, true)) {
+      memcpy(weather_diag.ip, ether.hisip, 4);
+      weather_diag.state = WEATHER_STATE_REQUEST;
+    } else {
+      memset(weather_diag.ip, 0, 4);
+      weather_failed();
+    }
+    break;
+#endif
+
+  case WEATHER_STATE_REQUEST:
+    weather_timeout = os.now_tz() + WEATHER_TIMEOUT;
+    weather_request();
+    break;
+
+  case WEATHER_STATE_WAIT:
+#if !defined(ARDUINO) || defined(ESP8266)
+    // take what has arrived so far, without waiting for more
+    while(weather_client.available() && weather_len<ETHER_BUFFER_SIZE-1) {
+      int len = weather_client.read((uint8_t*)ether_buffer+weather_len, ETHER_BUFFER_SIZE-1-weather_len);
+      if(len<=0) break;
+      weather_len += len;
+    }
+    ether_buffer[weather_len] = 0;
+    if(!weather_client.connected() || weather_len>=ETHER_BUFFER_SIZE-1) {
+      weather_client.stop();
+      peel_http_header();
+      if(weather_parse(ether_buffer, &weather_result)) weather_diag.state = WEATHER_STATE_APPLY;
+      else weather_failed();
+      break;
+    }
+#endif
+    if(os.now_tz() >= weather_timeout) {
+#if !defined(ARDUINO) || defined(ESP8266)
+      weather_client.stop();
+#endif
+      weather_failed();
     }
-    peel_http_header();
-    getweather_callback(0, 0, ETHER_BUFFER_SIZE);
     break;
+
+  case WEATHER_STATE_APPLY:
+    weather_apply(&weather_result);
+    weather_diag.state = WEATHER_STATE_IDLE;
+    break;
+
+  default:
+    weather_diag.state = WEATHER_STATE_IDLE;
   }
-  client.stop();
+
+  weather_tick_done(start_us);
 }
-#endif // GetWeather()
 
+/* ====== Local sunrise/sunset ======
+ * When the controller's latitude/longitude are set (os.geo), sunrise and
+ * sunset are computed locally (NOAA approximation) instead of coming from
+ * the weather script. sun_table_build() precomputes, for every SUN_TABLE_STEP
+ * days of the year, the half day length and the equation of time, which only
+ * depend on the latitude. Longitude and time zone are applied by sun_lookup(),
+ * which takes any day of the year, so the schedule for other days can be
+ * previewed with the same table.
+ * Entry format: bits 0-9 half day length (minutes), bits 10-15 equation of time+32 (minutes) */
+static uint16_t sun_table[SUN_TABLE_SIZE];
+static bool sun_table_valid = false;
+
+#define SUN_HALFDAY_MASK  0x3FF
+#define SUN_EOT_SHIFT     10
+#define SUN_EOT_BIAS      32
+
+void sun_table_build() {
+  sun_table_valid = false;
+  if (os.geo.tag != GEOLOC_TAG) return;
+  float lat = os.geo.lat * (float)(M_PI/18000.0);
+  float zenith = cos(90.833f*(float)(M_PI/180.0));  // includes refraction and solar disc
+  for (uint16_t i=0; i<SUN_TABLE_SIZE; i++) {
+    float g = (float)(2*M_PI/365.0) * (i*SUN_TABLE_STEP);
+    float eot = 229.18f*(0.000075f+0.001868f*cos(g)-0.032077f*sin(g)
+                         -0.014615f*cos(2*g)-0.040849f*sin(2*g));
+    float decl = 0.006918f-0.399912f*cos(g)+0.070257f*sin(g)-0.006758f*cos(2*g)
+                 +0.000907f*sin(2*g)-0.002697f*cos(3*g)+0.00148f*sin(3*g);
+    float c = zenith/(cos(lat)*cos(decl))-tan(lat)*tan(decl);
+    int16_t h;
+    if (c>=1)       h = 0;    // polar night
+    else if (c<=-1) h = 720;  // midnight sun
+    else            h = (int16_t)(acos(c)*(float)(4*180/M_PI)+0.5f);
+    int16_t e = (int16_t)(eot+(eot<0?-0.5f:0.5f))+SUN_EOT_BIAS;
+    sun_table[i] = (uint16_t)h | ((uint16_t)e<<SUN_EOT_SHIFT);
+  }
+  sun_table_valid = true;
+}
+
+/** Look up sunrise/sunset (local time, in minutes) for a day of the year (0-365) */
+bool sun_lookup(uint16_t doy, int16_t *rise, int16_t *set) {
+  if (!sun_table_valid) return false;
+  if (doy>365) doy = 365;
+  uint16_t i = doy/SUN_TABLE_STEP;
+  uint16_t e0 = sun_table[i];
+  int16_t h = e0&SUN_HALFDAY_MASK;
+  int16_t eot = (int16_t)(e0>>SUN_EOT_SHIFT)-SUN_EOT_BIAS;
+#if SUN_TABLE_STEP>1
+  byte frac = doy%SUN_TABLE_STEP;
+  if (frac) {
+    uint16_t e1 = sun_table[i+1];
+    h += ((int16_t)(e1&SUN_HALFDAY_MASK)-h)*frac/SUN_TABLE_STEP;
+    eot += ((int16_t)(e1>>SUN_EOT_SHIFT)-SUN_EOT_BIAS-eot)*frac/SUN_TABLE_STEP;
+  }
+#endif
+  // solar noon in local time
+  int16_t noon = 720-(int16_t)((int32_t)os.geo.lon*4/100)-eot+((int16_t)os.options[OPTION_TIMEZONE]-48)*15;
+  int16_t r = noon-h, s = noon+h;
+  *rise = (r<0) ? 0 : ((r>1439) ? 1439 : r);
+  *set  = (s<0) ? 0 : ((s>1439) ? 1439 : s);
+  return true;
+}
+
+/** Refresh os.nvdata sunrise/sunset from the local table (RAM only) */
+void sun_update(time_t curr_time) {
+  uint16_t doy;
+#if defined(ARDUINO)
+  static const uint16_t cumdays[] PROGMEM = {0,31,59,90,120,151,181,212,243,273,304,334};
+  byte m = month(curr_time);
+  int y = year(curr_time);
+  doy = pgm_read_word(cumdays+m-1)+day(curr_time)-1;
+  if (m>2 && (y%4==0) && (y%100!=0 || y%400==0)) doy++;
+#else
+  time_t ct = curr_time;
+  struct tm *ti = gmtime(&ct);
+  doy = ti->tm_yday;
+#endif
+  int16_t rise, set;
+  if (!sun_lookup(doy, &rise, &set)) return;
+  os.nvdata.sunrise_time = rise;
+  os.nvdata.sunset_time = set;
+}
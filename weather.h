@@ -32,6 +32,35 @@
 #define WEATHER_UPDATE_TZ       0x10
 #define WEATHER_UPDATE_RD       0x20
 
+#define WEATHER_STATE_IDLE      0
+#define WEATHER_STATE_RESOLVE   1
+#define WEATHER_STATE_REQUEST   2
+#define WEATHER_STATE_WAIT      3
+#define WEATHER_STATE_APPLY     4
+
+// weather pipeline diagnostics
+struct WeatherDiag {
+  byte state;     // WEATHER_STATE_
+  byte fails;     // failed requests since boot
+  ulong last_us;  // time spent in the last step (in us)
+  ulong max_us;   // longest step since boot (in us)
+  byte ip[4];     // weather server address from the last lookup (AVR)
+};
+extern WeatherDiag weather_diag;
+
 void GetWeather();
+void weather_poll();
+
+// local sunrise/sunset table: one entry every SUN_TABLE_STEP days of the year
+#if defined(ARDUINO) && !defined(ESP8266) && !defined(__AVR_ATmega1284P__) && !defined(__AVR_ATmega1284__)
+#define SUN_TABLE_STEP  4   // limited RAM: interpolate between entries
+#else
+#define SUN_TABLE_STEP  1
+#endif
+#define SUN_TABLE_SIZE  (366/SUN_TABLE_STEP+2)
+
+void sun_table_build();
+bool sun_lookup(uint16_t doy, int16_t *rise, int16_t *set);
+void sun_update(time_t curr_time);
 
 #endif  // _WEATHER_H